@@ -0,0 +1,891 @@
+/*
+ * Block driver for sparse, deduplicating images
+ *
+ * The image is split into 4 KiB blocks. Every virtual block maps to nothing
+ * (read from the backing file, or zeroes), to an explicit zero block, or to
+ * a physical data block. Physical blocks are shared between all virtual
+ * blocks with the same content, found through a hash of the data.
+ *
+ * Metadata is kept in memory and written back on flush. Physical blocks that
+ * lose their last reference are only reused, and punched out of the image
+ * file, once the metadata that no longer references them is on disk.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "sysemu/block-backend.h"
+#include "qemu/bitmap.h"
+#include "qemu/bswap.h"
+#include "qemu/coroutine.h"
+#include "qemu/cutils.h"
+#include "qemu/memalign.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "migration/blocker.h"
+
+#define DEDUP_MAGIC (('Q' << 24) | ('D' << 16) | ('D' << 8) | 'P')
+#define DEDUP_VERSION 1
+#define DEDUP_BLOCK_BITS 12
+#define DEDUP_HEADER_SIZE 4096
+#define DEDUP_BACKING_FILE_MAX 1023
+
+/* Virtual block map entries */
+#define DEDUP_MAP_UNALLOCATED 0
+#define DEDUP_MAP_ZERO        1
+#define DEDUP_MAP_PHYS_BASE   2
+
+/* Metadata is written back in units of this many bytes */
+#define DEDUP_META_CHUNK 4096
+#define DEDUP_MAP_CHUNK_ENTRIES (DEDUP_META_CHUNK / sizeof(uint32_t))
+#define DEDUP_HASH_CHUNK_ENTRIES (DEDUP_META_CHUNK / sizeof(uint64_t))
+
+typedef struct DedupHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t block_bits;
+    uint32_t backing_file_size;
+    uint64_t backing_file_offset;
+    uint64_t size; /* in bytes */
+    uint64_t map_offset;
+    uint64_t hash_offset;
+    uint64_t data_offset;
+    uint64_t nb_phys;
+} QEMU_PACKED DedupHeader;
+
+typedef struct BDRVDedupState {
+    CoRwlock lock;
+    uint32_t block_size;
+    uint64_t nb_blocks;
+    uint64_t map_offset;
+    uint64_t hash_offset;
+    uint64_t data_offset;
+
+    /* One entry per virtual block */
+    uint32_t *map;
+    unsigned long *map_dirty;
+
+    /*
+     * One entry per physical block. Both arrays are sized for the worst
+     * case of no sharing at all, but only the first nb_phys entries are
+     * ever touched.
+     */
+    uint64_t *hashes;
+    uint32_t *refcount;
+    unsigned long *hash_dirty;
+    uint64_t nb_phys;
+    bool header_dirty;
+
+    /* Content hash -> physical block + 1, keys point into hashes[] */
+    GHashTable *index;
+    GArray *free_list;
+    GArray *pending_free;
+
+    Error *migration_blocker;
+} BDRVDedupState;
+
+static QemuOptsList dedup_create_opts;
+
+static int dedup_probe(const uint8_t *buf, int buf_size, const char *filename)
+{
+    const DedupHeader *header = (const void *)buf;
+
+    if (buf_size >= sizeof(DedupHeader) &&
+        be32_to_cpu(header->magic) == DEDUP_MAGIC &&
+        be32_to_cpu(header->version) == DEDUP_VERSION) {
+        return 100;
+    }
+    return 0;
+}
+
+static uint64_t dedup_hash_block(const void *buf, size_t len)
+{
+    GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+    uint8_t digest[32];
+    gsize digest_len = sizeof(digest);
+
+    g_checksum_update(checksum, buf, len);
+    g_checksum_get_digest(checksum, digest, &digest_len);
+    g_checksum_free(checksum);
+    return ldq_le_p(digest);
+}
+
+static void dedup_free_state(BDRVDedupState *s)
+{
+    if (s->index) {
+        g_hash_table_destroy(s->index);
+        s->index = NULL;
+    }
+    if (s->free_list) {
+        g_array_free(s->free_list, true);
+        s->free_list = NULL;
+    }
+    if (s->pending_free) {
+        g_array_free(s->pending_free, true);
+        s->pending_free = NULL;
+    }
+    g_free(s->map);
+    s->map = NULL;
+    g_free(s->map_dirty);
+    s->map_dirty = NULL;
+    g_free(s->hashes);
+    s->hashes = NULL;
+    g_free(s->refcount);
+    s->refcount = NULL;
+    g_free(s->hash_dirty);
+    s->hash_dirty = NULL;
+}
+
+static int dedup_open(BlockDriverState *bs, QDict *options, int flags,
+                      Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+    DedupHeader header;
+    uint64_t i;
+    int ret;
+
+    bs->file = bdrv_open_child(NULL, options, "file", bs, &child_of_bds,
+                               BDRV_CHILD_IMAGE, false, errp);
+    if (!bs->file) {
+        return -EINVAL;
+    }
+
+    ret = bdrv_pread(bs->file, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read image header");
+        return ret;
+    }
+    header.magic = be32_to_cpu(header.magic);
+    header.version = be32_to_cpu(header.version);
+    header.block_bits = be32_to_cpu(header.block_bits);
+    header.backing_file_size = be32_to_cpu(header.backing_file_size);
+    header.backing_file_offset = be64_to_cpu(header.backing_file_offset);
+    header.size = be64_to_cpu(header.size);
+    header.map_offset = be64_to_cpu(header.map_offset);
+    header.hash_offset = be64_to_cpu(header.hash_offset);
+    header.data_offset = be64_to_cpu(header.data_offset);
+    header.nb_phys = be64_to_cpu(header.nb_phys);
+
+    if (header.magic != DEDUP_MAGIC) {
+        error_setg(errp, "Image not in dedup format");
+        return -EINVAL;
+    }
+    if (header.version != DEDUP_VERSION) {
+        error_setg(errp, "Unsupported dedup version %" PRIu32,
+                   header.version);
+        return -ENOTSUP;
+    }
+    if (header.block_bits != DEDUP_BLOCK_BITS) {
+        error_setg(errp, "Unsupported dedup block size");
+        return -ENOTSUP;
+    }
+
+    s->block_size = 1 << header.block_bits;
+    s->nb_blocks = DIV_ROUND_UP(header.size, s->block_size);
+    if (s->nb_blocks == 0 ||
+        s->nb_blocks > UINT32_MAX - DEDUP_MAP_PHYS_BASE ||
+        header.nb_phys > s->nb_blocks) {
+        error_setg(errp, "Invalid dedup image geometry");
+        return -EINVAL;
+    }
+    s->map_offset = header.map_offset;
+    s->hash_offset = header.hash_offset;
+    s->data_offset = header.data_offset;
+    s->nb_phys = header.nb_phys;
+    bs->total_sectors = header.size / BDRV_SECTOR_SIZE;
+
+    s->map = g_try_new(uint32_t, s->nb_blocks);
+    s->hashes = g_try_new0(uint64_t, s->nb_blocks);
+    s->refcount = g_try_new0(uint32_t, s->nb_blocks);
+    if (!s->map || !s->hashes || !s->refcount) {
+        error_setg(errp, "Could not allocate dedup tables");
+        ret = -ENOMEM;
+        goto fail;
+    }
+    s->map_dirty = bitmap_new(DIV_ROUND_UP(s->nb_blocks,
+                                           DEDUP_MAP_CHUNK_ENTRIES));
+    s->hash_dirty = bitmap_new(DIV_ROUND_UP(s->nb_blocks,
+                                            DEDUP_HASH_CHUNK_ENTRIES));
+
+    ret = bdrv_pread(bs->file, s->map_offset,
+                     s->nb_blocks * sizeof(uint32_t), s->map, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not read block map");
+        goto fail;
+    }
+    if (s->nb_phys) {
+        ret = bdrv_pread(bs->file, s->hash_offset,
+                         s->nb_phys * sizeof(uint64_t), s->hashes, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not read hash table");
+            goto fail;
+        }
+    }
+
+    for (i = 0; i < s->nb_blocks; i++) {
+        s->map[i] = be32_to_cpu(s->map[i]);
+        if (s->map[i] >= DEDUP_MAP_PHYS_BASE) {
+            uint64_t phys = s->map[i] - DEDUP_MAP_PHYS_BASE;
+            if (phys >= s->nb_phys) {
+                error_setg(errp, "Block map references physical block %"
+                           PRIu64 " beyond the end of the image", phys);
+                ret = -EINVAL;
+                goto fail;
+            }
+            s->refcount[phys]++;
+        }
+    }
+
+    s->index = g_hash_table_new(g_int64_hash, g_int64_equal);
+    s->free_list = g_array_new(false, false, sizeof(uint32_t));
+    s->pending_free = g_array_new(false, false, sizeof(uint32_t));
+    for (i = 0; i < s->nb_phys; i++) {
+        s->hashes[i] = be64_to_cpu(s->hashes[i]);
+        if (s->refcount[i] == 0) {
+            uint32_t phys = i;
+            g_array_append_val(s->free_list, phys);
+        } else if (!g_hash_table_contains(s->index, &s->hashes[i])) {
+            g_hash_table_insert(s->index, &s->hashes[i],
+                                GUINT_TO_POINTER(i + 1));
+        }
+    }
+
+    if (header.backing_file_offset != 0) {
+        uint32_t len = header.backing_file_size;
+        if (len > DEDUP_BACKING_FILE_MAX ||
+            len >= sizeof(bs->backing_file)) {
+            error_setg(errp, "Backing file name too long");
+            ret = -EINVAL;
+            goto fail;
+        }
+        ret = bdrv_pread(bs->file, header.backing_file_offset, len,
+                         bs->auto_backing_file, 0);
+        if (ret < 0) {
+            goto fail;
+        }
+        bs->auto_backing_file[len] = '\0';
+        pstrcpy(bs->backing_file, sizeof(bs->backing_file),
+                bs->auto_backing_file);
+    }
+
+    error_setg(&s->migration_blocker, "The dedup format used by node '%s' "
+               "does not support live migration",
+               bdrv_get_device_or_node_name(bs));
+    ret = migrate_add_blocker(s->migration_blocker, errp);
+    if (ret < 0) {
+        error_free(s->migration_blocker);
+        s->migration_blocker = NULL;
+        goto fail;
+    }
+
+    qemu_co_rwlock_init(&s->lock);
+    return 0;
+
+fail:
+    dedup_free_state(s);
+    return ret;
+}
+
+static int dedup_reopen_prepare(BDRVReopenState *state,
+                                BlockReopenQueue *queue, Error **errp)
+{
+    return 0;
+}
+
+static void dedup_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bs->bl.request_alignment = s->block_size;
+    bs->bl.pwrite_zeroes_alignment = s->block_size;
+    bs->bl.pdiscard_alignment = s->block_size;
+}
+
+static void dedup_close(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    dedup_free_state(s);
+    if (s->migration_blocker) {
+        migrate_del_blocker(s->migration_blocker);
+        error_free(s->migration_blocker);
+    }
+}
+
+/* Length of the run of blocks starting at @block that can be served alike */
+static uint64_t dedup_run_length(BDRVDedupState *s, uint64_t block,
+                                 uint64_t max_blocks)
+{
+    uint32_t first = s->map[block];
+    uint64_t n = 1;
+
+    while (n < max_blocks) {
+        uint32_t next = s->map[block + n];
+        if (first >= DEDUP_MAP_PHYS_BASE ? next != first + n : next != first) {
+            break;
+        }
+        n++;
+    }
+    return n;
+}
+
+static coroutine_fn int dedup_co_preadv(BlockDriverState *bs, int64_t offset,
+                                        int64_t bytes, QEMUIOVector *qiov,
+                                        BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    size_t qiov_offset = 0;
+    int ret = 0;
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    while (bytes > 0) {
+        uint64_t block = offset / s->block_size;
+        uint64_t in_block = offset % s->block_size;
+        uint64_t nb = DIV_ROUND_UP(in_block + bytes, s->block_size);
+        uint32_t entry = s->map[block];
+        int64_t n;
+
+        nb = dedup_run_length(s, block, nb);
+        n = MIN(nb * s->block_size - in_block, bytes);
+
+        if (entry >= DEDUP_MAP_PHYS_BASE) {
+            uint64_t phys = entry - DEDUP_MAP_PHYS_BASE;
+            BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+            ret = bdrv_co_preadv_part(bs->file, s->data_offset +
+                                      phys * s->block_size + in_block,
+                                      n, qiov, qiov_offset, 0);
+        } else if (entry == DEDUP_MAP_UNALLOCATED && bs->backing) {
+            BLKDBG_EVENT(bs->file, BLKDBG_READ_BACKING_AIO);
+            ret = bdrv_co_preadv_part(bs->backing, offset, n, qiov,
+                                      qiov_offset, 0);
+        } else {
+            qemu_iovec_memset(qiov, qiov_offset, 0, n);
+        }
+        if (ret < 0) {
+            break;
+        }
+
+        offset += n;
+        bytes -= n;
+        qiov_offset += n;
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+    return ret < 0 ? ret : 0;
+}
+
+static void dedup_unref(BDRVDedupState *s, uint32_t phys)
+{
+    assert(s->refcount[phys] > 0);
+    if (--s->refcount[phys]) {
+        return;
+    }
+    if (g_hash_table_lookup(s->index, &s->hashes[phys]) ==
+        GUINT_TO_POINTER(phys + 1)) {
+        g_hash_table_remove(s->index, &s->hashes[phys]);
+    }
+    /* Still referenced by the on-disk map until the next flush */
+    g_array_append_val(s->pending_free, phys);
+}
+
+static void dedup_set_map(BDRVDedupState *s, uint64_t block, uint32_t entry)
+{
+    uint32_t old = s->map[block];
+
+    if (old == entry) {
+        return;
+    }
+    s->map[block] = entry;
+    set_bit(block / DEDUP_MAP_CHUNK_ENTRIES, s->map_dirty);
+    if (old >= DEDUP_MAP_PHYS_BASE) {
+        dedup_unref(s, old - DEDUP_MAP_PHYS_BASE);
+    }
+}
+
+static int coroutine_fn dedup_flush_metadata(BlockDriverState *bs);
+
+static int coroutine_fn dedup_alloc_phys(BlockDriverState *bs, uint32_t *phys)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    if (!s->free_list->len && s->nb_phys == s->nb_blocks &&
+        s->pending_free->len) {
+        /* Out of space: make the blocks released since the last flush free */
+        ret = dedup_flush_metadata(bs);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (s->free_list->len) {
+        *phys = g_array_index(s->free_list, uint32_t, s->free_list->len - 1);
+        g_array_set_size(s->free_list, s->free_list->len - 1);
+        return 0;
+    }
+    if (s->nb_phys < s->nb_blocks) {
+        *phys = s->nb_phys++;
+        s->header_dirty = true;
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+static int coroutine_fn dedup_write_block(BlockDriverState *bs, uint64_t block,
+                                          uint8_t *buf, uint8_t *tmp)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t hash;
+    gpointer found;
+    uint32_t phys;
+    int ret;
+
+    if (buffer_is_zero(buf, s->block_size)) {
+        dedup_set_map(s, block, DEDUP_MAP_ZERO);
+        return 0;
+    }
+
+    hash = dedup_hash_block(buf, s->block_size);
+    found = g_hash_table_lookup(s->index, &hash);
+    if (found) {
+        phys = GPOINTER_TO_UINT(found) - 1;
+        if (s->map[block] == phys + DEDUP_MAP_PHYS_BASE) {
+            return 0;
+        }
+        /* The hash is only a hint, make sure the data really matches */
+        ret = bdrv_co_pread(bs->file, s->data_offset + phys * s->block_size,
+                            s->block_size, tmp, 0);
+        if (ret < 0) {
+            return ret;
+        }
+        if (!memcmp(buf, tmp, s->block_size)) {
+            s->refcount[phys]++;
+            dedup_set_map(s, block, phys + DEDUP_MAP_PHYS_BASE);
+            return 0;
+        }
+    }
+
+    ret = dedup_alloc_phys(bs, &phys);
+    if (ret < 0) {
+        return ret;
+    }
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+    ret = bdrv_co_pwrite(bs->file, s->data_offset + phys * s->block_size,
+                         s->block_size, buf, 0);
+    if (ret < 0) {
+        g_array_append_val(s->free_list, phys);
+        return ret;
+    }
+
+    s->hashes[phys] = hash;
+    s->refcount[phys] = 1;
+    set_bit(phys / DEDUP_HASH_CHUNK_ENTRIES, s->hash_dirty);
+    if (!found) {
+        g_hash_table_insert(s->index, &s->hashes[phys],
+                            GUINT_TO_POINTER(phys + 1));
+    }
+    dedup_set_map(s, block, phys + DEDUP_MAP_PHYS_BASE);
+    return 0;
+}
+
+static coroutine_fn int dedup_co_pwritev(BlockDriverState *bs, int64_t offset,
+                                         int64_t bytes, QEMUIOVector *qiov,
+                                         BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t block = offset / s->block_size;
+    size_t qiov_offset = 0;
+    uint8_t *buf, *tmp;
+    int ret = 0;
+
+    assert(QEMU_IS_ALIGNED(offset, s->block_size));
+    assert(QEMU_IS_ALIGNED(bytes, s->block_size));
+
+    buf = qemu_try_blockalign(bs->file->bs, s->block_size);
+    tmp = qemu_try_blockalign(bs->file->bs, s->block_size);
+    if (!buf || !tmp) {
+        ret = -ENOMEM;
+        goto out;
+    }
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    while (qiov_offset < bytes) {
+        qemu_iovec_to_buf(qiov, qiov_offset, buf, s->block_size);
+        ret = dedup_write_block(bs, block, buf, tmp);
+        if (ret < 0) {
+            break;
+        }
+        block++;
+        qiov_offset += s->block_size;
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+
+out:
+    qemu_vfree(buf);
+    qemu_vfree(tmp);
+    return ret;
+}
+
+static int coroutine_fn dedup_co_pwrite_zeroes(BlockDriverState *bs,
+                                               int64_t offset, int64_t bytes,
+                                               BdrvRequestFlags flags)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t block;
+
+    if (!QEMU_IS_ALIGNED(offset | bytes, s->block_size)) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    for (block = offset / s->block_size;
+         block < (offset + bytes) / s->block_size; block++) {
+        dedup_set_map(s, block, DEDUP_MAP_ZERO);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+    return 0;
+}
+
+static int coroutine_fn dedup_co_pdiscard(BlockDriverState *bs,
+                                          int64_t offset, int64_t bytes)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t start = DIV_ROUND_UP(offset, s->block_size);
+    uint64_t end = (offset + bytes) / s->block_size;
+    uint64_t block;
+
+    /*
+     * Discarded blocks read back as zeroes rather than backing file data,
+     * which is what an NVMe deallocate with DLFEAT=1 promises the guest.
+     */
+    qemu_co_rwlock_wrlock(&s->lock);
+    for (block = start; block < end; block++) {
+        dedup_set_map(s, block, DEDUP_MAP_ZERO);
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+    return 0;
+}
+
+static int coroutine_fn dedup_co_block_status(BlockDriverState *bs,
+                                              bool want_zero,
+                                              int64_t offset, int64_t bytes,
+                                              int64_t *pnum, int64_t *map,
+                                              BlockDriverState **file)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t block = offset / s->block_size;
+    uint64_t in_block = offset % s->block_size;
+    uint64_t nb = DIV_ROUND_UP(in_block + bytes, s->block_size);
+    uint32_t entry;
+    int ret;
+
+    qemu_co_rwlock_rdlock(&s->lock);
+    entry = s->map[block];
+    nb = dedup_run_length(s, block, nb);
+    *pnum = MIN(nb * s->block_size - in_block, bytes);
+
+    if (entry >= DEDUP_MAP_PHYS_BASE) {
+        *map = s->data_offset +
+               (uint64_t)(entry - DEDUP_MAP_PHYS_BASE) * s->block_size +
+               in_block;
+        *file = bs->file->bs;
+        ret = BDRV_BLOCK_DATA | BDRV_BLOCK_OFFSET_VALID;
+    } else if (entry == DEDUP_MAP_ZERO) {
+        ret = BDRV_BLOCK_ZERO;
+    } else {
+        ret = 0;
+    }
+    qemu_co_rwlock_unlock(&s->lock);
+    return ret;
+}
+
+static int coroutine_fn dedup_write_header(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t nb_phys = cpu_to_be64(s->nb_phys);
+
+    return bdrv_co_pwrite(bs->file, offsetof(DedupHeader, nb_phys),
+                          sizeof(nb_phys), &nb_phys, 0);
+}
+
+/* Called with s->lock held for writing */
+static int coroutine_fn dedup_flush_metadata(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    uint64_t nb_map_chunks = DIV_ROUND_UP(s->nb_blocks,
+                                          DEDUP_MAP_CHUNK_ENTRIES);
+    uint64_t nb_hash_chunks = DIV_ROUND_UP(s->nb_blocks,
+                                           DEDUP_HASH_CHUNK_ENTRIES);
+    uint8_t *buf;
+    uint64_t chunk, i;
+    int ret;
+
+    if (find_first_bit(s->map_dirty, nb_map_chunks) == nb_map_chunks &&
+        find_first_bit(s->hash_dirty, nb_hash_chunks) == nb_hash_chunks &&
+        !s->header_dirty && !s->pending_free->len) {
+        return 0;
+    }
+
+    /* New data blocks must be stable before anything points to them */
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = qemu_blockalign(bs->file->bs, DEDUP_META_CHUNK);
+    for (chunk = find_first_bit(s->hash_dirty, nb_hash_chunks);
+         chunk < nb_hash_chunks;
+         chunk = find_next_bit(s->hash_dirty, nb_hash_chunks, chunk + 1)) {
+        uint64_t first = chunk * DEDUP_HASH_CHUNK_ENTRIES;
+        uint64_t n = MIN(DEDUP_HASH_CHUNK_ENTRIES, s->nb_phys - first);
+
+        for (i = 0; i < n; i++) {
+            stq_be_p(buf + i * sizeof(uint64_t), s->hashes[first + i]);
+        }
+        ret = bdrv_co_pwrite(bs->file,
+                             s->hash_offset + first * sizeof(uint64_t),
+                             n * sizeof(uint64_t), buf, 0);
+        if (ret < 0) {
+            goto out;
+        }
+        clear_bit(chunk, s->hash_dirty);
+    }
+
+    /*
+     * nb_phys only ever grows, so the header must cover every physical
+     * block before a map entry can point to it. A crash in between only
+     * leaves unreferenced blocks behind, which open puts on the free list.
+     */
+    if (s->header_dirty) {
+        ret = dedup_write_header(bs);
+        if (ret < 0) {
+            goto out;
+        }
+        ret = bdrv_co_flush(bs->file->bs);
+        if (ret < 0) {
+            goto out;
+        }
+        s->header_dirty = false;
+    }
+
+    for (chunk = find_first_bit(s->map_dirty, nb_map_chunks);
+         chunk < nb_map_chunks;
+         chunk = find_next_bit(s->map_dirty, nb_map_chunks, chunk + 1)) {
+        uint64_t first = chunk * DEDUP_MAP_CHUNK_ENTRIES;
+        uint64_t n = MIN(DEDUP_MAP_CHUNK_ENTRIES, s->nb_blocks - first);
+
+        for (i = 0; i < n; i++) {
+            stl_be_p(buf + i * sizeof(uint32_t), s->map[first + i]);
+        }
+        ret = bdrv_co_pwrite(bs->file,
+                             s->map_offset + first * sizeof(uint32_t),
+                             n * sizeof(uint32_t), buf, 0);
+        if (ret < 0) {
+            goto out;
+        }
+        clear_bit(chunk, s->map_dirty);
+    }
+
+    ret = bdrv_co_flush(bs->file->bs);
+    if (ret < 0) {
+        goto out;
+    }
+
+    /* Nothing on disk references these any more: reuse them and shrink */
+    for (i = 0; i < s->pending_free->len; i++) {
+        uint32_t phys = g_array_index(s->pending_free, uint32_t, i);
+
+        bdrv_co_pdiscard(bs->file, s->data_offset + phys * s->block_size,
+                         s->block_size);
+        g_array_append_val(s->free_list, phys);
+    }
+    g_array_set_size(s->pending_free, 0);
+
+out:
+    qemu_vfree(buf);
+    return ret;
+}
+
+static int coroutine_fn dedup_co_flush_to_os(BlockDriverState *bs)
+{
+    BDRVDedupState *s = bs->opaque;
+    int ret;
+
+    qemu_co_rwlock_wrlock(&s->lock);
+    ret = dedup_flush_metadata(bs);
+    qemu_co_rwlock_unlock(&s->lock);
+    return ret;
+}
+
+static int dedup_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
+{
+    BDRVDedupState *s = bs->opaque;
+
+    bdi->cluster_size = s->block_size;
+    return 0;
+}
+
+static int coroutine_fn dedup_co_create_opts(BlockDriver *drv,
+                                             const char *filename,
+                                             QemuOpts *opts, Error **errp)
+{
+    DedupHeader header;
+    BlockBackend *blk = NULL;
+    char *backing_file = NULL;
+    char *backing_fmt = NULL;
+    uint64_t total_size, nb_blocks, backing_len = 0;
+    uint64_t map_offset, hash_offset, data_offset;
+    int ret;
+
+    /*
+     * We can't actually store a backing format, but can check that
+     * the user's request made sense.
+     */
+    backing_fmt = qemu_opt_get_del(opts, BLOCK_OPT_BACKING_FMT);
+    if (backing_fmt && !bdrv_find_format(backing_fmt)) {
+        error_setg(errp, "unrecognized backing format '%s'", backing_fmt);
+        ret = -EINVAL;
+        goto out;
+    }
+
+    /* Silently round up size */
+    total_size = ROUND_UP(qemu_opt_get_size_del(opts, BLOCK_OPT_SIZE, 0),
+                          1 << DEDUP_BLOCK_BITS);
+    nb_blocks = DIV_ROUND_UP(total_size, 1 << DEDUP_BLOCK_BITS);
+    if (nb_blocks == 0) {
+        error_setg(errp, "Image size is too small, cannot be zero length");
+        ret = -EINVAL;
+        goto out;
+    }
+    if (nb_blocks > UINT32_MAX - DEDUP_MAP_PHYS_BASE) {
+        error_setg(errp, "Image size is too large for the dedup format");
+        ret = -EINVAL;
+        goto out;
+    }
+
+    backing_file = qemu_opt_get_del(opts, BLOCK_OPT_BACKING_FILE);
+    if (backing_file) {
+        backing_len = strlen(backing_file);
+        if (backing_len > DEDUP_BACKING_FILE_MAX) {
+            error_setg(errp, "Backing file name too long");
+            ret = -EINVAL;
+            goto out;
+        }
+    }
+
+    map_offset = DEDUP_HEADER_SIZE;
+    hash_offset = map_offset + ROUND_UP(nb_blocks * sizeof(uint32_t),
+                                        DEDUP_META_CHUNK);
+    data_offset = hash_offset + ROUND_UP(nb_blocks * sizeof(uint64_t),
+                                         DEDUP_META_CHUNK);
+
+    ret = bdrv_create_file(filename, opts, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    blk = blk_new_open(filename, NULL, NULL,
+                       BDRV_O_RDWR | BDRV_O_RESIZE | BDRV_O_PROTOCOL, errp);
+    if (blk == NULL) {
+        ret = -EIO;
+        goto out;
+    }
+    blk_set_allow_write_beyond_eof(blk, true);
+
+    memset(&header, 0, sizeof(header));
+    header.magic = cpu_to_be32(DEDUP_MAGIC);
+    header.version = cpu_to_be32(DEDUP_VERSION);
+    header.block_bits = cpu_to_be32(DEDUP_BLOCK_BITS);
+    header.size = cpu_to_be64(total_size);
+    header.map_offset = cpu_to_be64(map_offset);
+    header.hash_offset = cpu_to_be64(hash_offset);
+    header.data_offset = cpu_to_be64(data_offset);
+    if (backing_file) {
+        header.backing_file_offset = cpu_to_be64(sizeof(header));
+        header.backing_file_size = cpu_to_be32(backing_len);
+    }
+
+    /* The metadata area stays sparse: all-zero tables mean an empty image */
+    ret = blk_truncate(blk, data_offset, false, PREALLOC_MODE_OFF, 0, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    ret = blk_pwrite(blk, 0, sizeof(header), &header, 0);
+    if (ret < 0) {
+        error_setg_errno(errp, -ret, "Could not write image header");
+        goto out;
+    }
+    if (backing_file) {
+        ret = blk_pwrite(blk, sizeof(header), backing_len, backing_file, 0);
+        if (ret < 0) {
+            error_setg_errno(errp, -ret, "Could not write backing file name");
+            goto out;
+        }
+    }
+
+    ret = 0;
+out:
+    blk_unref(blk);
+    g_free(backing_file);
+    g_free(backing_fmt);
+    return ret;
+}
+
+static QemuOptsList dedup_create_opts = {
+    .name = "dedup-create-opts",
+    .head = QTAILQ_HEAD_INITIALIZER(dedup_create_opts.head),
+    .desc = {
+        {
+            .name = BLOCK_OPT_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Virtual disk size"
+        },
+        {
+            .name = BLOCK_OPT_BACKING_FILE,
+            .type = QEMU_OPT_STRING,
+            .help = "File name of a base image"
+        },
+        {
+            .name = BLOCK_OPT_BACKING_FMT,
+            .type = QEMU_OPT_STRING,
+            .help = "Format of the backing image",
+        },
+        { /* end of list */ }
+    }
+};
+
+static BlockDriver bdrv_dedup = {
+    .format_name            = "dedup",
+    .instance_size          = sizeof(BDRVDedupState),
+    .bdrv_probe             = dedup_probe,
+    .bdrv_open              = dedup_open,
+    .bdrv_close             = dedup_close,
+    .bdrv_child_perm        = bdrv_default_perms,
+    .bdrv_reopen_prepare    = dedup_reopen_prepare,
+    .bdrv_co_create_opts    = dedup_co_create_opts,
+    .bdrv_has_zero_init     = bdrv_has_zero_init_1,
+    .is_format              = true,
+    .supports_backing       = true,
+    .bdrv_refresh_limits    = dedup_refresh_limits,
+
+    .bdrv_co_preadv         = dedup_co_preadv,
+    .bdrv_co_pwritev        = dedup_co_pwritev,
+    .bdrv_co_pwrite_zeroes  = dedup_co_pwrite_zeroes,
+    .bdrv_co_pdiscard       = dedup_co_pdiscard,
+    .bdrv_co_block_status   = dedup_co_block_status,
+    .bdrv_co_flush_to_os    = dedup_co_flush_to_os,
+    .bdrv_get_info          = dedup_get_info,
+
+    .create_opts            = &dedup_create_opts,
+};
+
+static void bdrv_dedup_init(void)
+{
+    bdrv_register(&bdrv_dedup);
+}
+
+block_init(bdrv_dedup_init);
@@ -923,6 +923,19 @@ SRST
     Show guest Apple DART IOMMUs.
 ERST
 
+    {
+        .name         = "spmi",
+        .args_type    = "name:s?",
+        .params       = "[name]",
+        .help         = "show guest Apple SPMI controller transaction counters",
+    },
+
+SRST
+  ``info spmi`` [*name*]
+    Show the request batches, commands and per-slave transfer counters of
+    the guest Apple SPMI controllers, or only of controller *name*.
+ERST
+
     {
         .name       = "stats",
         .args_type  = "target:s,names:s?,provider:s?",
@@ -564,8 +564,18 @@ static void apple_a13_realize(DeviceState *dev, Error **errp)
     DeviceState *fiq_or;
     Object *obj = OBJECT(dev);
 
-    object_property_set_link(OBJECT(tcpu), "memory", OBJECT(&tcpu->memory),
-                             errp);
+    /*
+     * With shared-sysmem every CPU uses the system memory root, so all of
+     * them share a single FlatView and dispatch tree. Per-CPU devices must
+     * then bank themselves on current_cpu instead of living in tcpu->memory.
+     */
+    if (tcpu->shared_sysmem) {
+        object_property_set_link(OBJECT(tcpu), "memory",
+                                 OBJECT(get_system_memory()), errp);
+    } else {
+        object_property_set_link(OBJECT(tcpu), "memory",
+                                 OBJECT(&tcpu->memory), errp);
+    }
     if (*errp) {
         return;
     }
@@ -744,6 +754,7 @@ AppleA13State *apple_a13_cpu_create(DTBNode *node)
 }
 
 static Property apple_a13_properties[] = {
+    DEFINE_PROP_BOOL("shared-sysmem", AppleA13State, shared_sysmem, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -30,6 +30,7 @@
 #include "qapi/error.h"
 #include "qapi/visitor.h"
 #include "qemu/cutils.h"
+#include "qemu/memfd.h"
 #include "hw/arm/boot.h"
 #include "exec/address-spaces.h"
 #include "hw/misc/unimp.h"
@@ -39,6 +40,7 @@
 #include "sysemu/runstate.h"
 #include "qemu/error-report.h"
 #include "hw/platform-bus.h"
+#include "migration/vmstate.h"
 #include "arm-powerctl.h"
 
 #include "hw/arm/t8030.h"
@@ -68,6 +70,7 @@
 
 #include "hw/arm/xnu_pf.h"
 #include "hw/display/m1_fb.h"
+#include "hw/display/apple_displaypipe.h"
 
 #define T8030_DRAM_BASE         (0x800000000)
 #define T8030_DRAM_SIZE         (4 * GiB)
@@ -727,6 +730,8 @@ static void t8030_cpu_setup(MachineState *machine)
 
         tms->cpus[i] = apple_a13_cpu_create(node);
         cluster_id = tms->cpus[i]->cluster_id;
+        qdev_prop_set_bit(DEVICE(tms->cpus[i]), "shared-sysmem",
+                          tms->shared_sysmem);
 
         object_property_add_child(OBJECT(&tms->clusters[cluster_id]),
                                   DEVICE(tms->cpus[i])->id,
@@ -762,11 +767,20 @@ static void t8030_create_aic(MachineState *machine)
 
     reg = (hwaddr*)prop->value;
 
+    if (tms->shared_sysmem) {
+        memory_region_add_subregion(tms->sysmem, tms->soc_base_pa + reg[0],
+                                    sysbus_mmio_get_region(tms->aic,
+                                                           machine->smp.cpus));
+    }
+
     for(i = 0; i < machine->smp.cpus; i++) {
-        memory_region_add_subregion_overlap(&tms->cpus[i]->memory,
-                                            tms->soc_base_pa + reg[0],
-                                            sysbus_mmio_get_region(tms->aic, i),
-                                                                   0);
+        if (!tms->shared_sysmem) {
+            memory_region_add_subregion_overlap(&tms->cpus[i]->memory,
+                                                tms->soc_base_pa + reg[0],
+                                                sysbus_mmio_get_region(tms->aic,
+                                                                       i),
+                                                0);
+        }
         sysbus_connect_irq(tms->aic, i,
                            qdev_get_gpio_in(DEVICE(tms->cpus[i]),
                                             ARM_CPU_IRQ));
@@ -1186,6 +1200,10 @@ static void t8030_create_usb(MachineState *machine)
 
     atc = qdev_new(TYPE_APPLE_TYPEC);
     object_property_add_child(OBJECT(machine), "atc", OBJECT(atc));
+    if (tms->usb_conn_addr) {
+        qdev_prop_set_string(atc, "conn-addr", tms->usb_conn_addr);
+    }
+    qdev_prop_set_bit(atc, "bulk-unthrottled", tms->usb_bulk_unthrottled);
 
     prop = find_dtb_prop(dart_mapper, "reg");
     assert(prop);
@@ -1402,6 +1420,15 @@ static void t8030_create_pmu(MachineState *machine, const char *parent,
     spmi_slave_realize_and_unref(SPMI_SLAVE(pmu), spmi->bus, &error_fatal);
 }
 
+static bool t8030_smc_battery_level_get(void *opaque, uint32_t key,
+                                        void *data, uint8_t size)
+{
+    T8030MachineState *tms = T8030_MACHINE(opaque);
+
+    stw_le_p(data, tms->battery_level);
+    return true;
+}
+
 static void t8030_create_smc(MachineState* machine)
 {
     int i;
@@ -1444,6 +1471,9 @@ static void t8030_create_smc(MachineState* machine)
 
     smc = apple_smc_create(child, tms->rtbuddyv2_protocol_version);
     assert(smc);
+    if (tms->smc_keys_filename) {
+        qdev_prop_set_string(DEVICE(smc), "key-db", tms->smc_keys_filename);
+    }
 
     object_property_add_child(OBJECT(machine), "smc", OBJECT(smc));
     prop = find_dtb_prop(child, "reg");
@@ -1469,6 +1499,12 @@ static void t8030_create_smc(MachineState* machine)
     }
 
     sysbus_realize_and_unref(smc, &error_fatal);
+
+    /* BRSC: battery relative state of charge, in percent */
+    apple_smc_add_dynamic_key(smc, SMC_MAKE_IDENTIFIER('B', 'R', 'S', 'C'), 2,
+                              SMC_MAKE_KEY_TYPE('u', 'i', '1', '6'),
+                              SMC_ATTR_LITTLE_ENDIAN,
+                              &t8030_smc_battery_level_get, tms);
 }
 
 static void t8030_create_sio(MachineState* machine)
@@ -1555,6 +1591,9 @@ static void t8030_create_boot_display(MachineState *machine)
     T8030MachineState *tms = T8030_MACHINE(machine);
     SysBusDevice *fb = NULL;
     MemoryRegion *vram = NULL;
+#ifdef CONFIG_POSIX
+    int fd;
+#endif
     tms->video.v_baseAddr = T8030_DISPLAY_BASE;
     tms->video.v_rowBytes = 480 * 4;
     tms->video.v_width = 480;
@@ -1572,7 +1611,24 @@ static void t8030_create_boot_display(MachineState *machine)
     object_property_set_uint(OBJECT(fb), "height", 640, &error_fatal);
 
     vram = g_new(MemoryRegion, 1);
-    memory_region_init_ram(vram, OBJECT(fb), "vram", T8030_DISPLAY_SIZE, &error_fatal);
+#ifdef CONFIG_POSIX
+    /*
+     * Back vram with a memfd when possible so that frame-stream-start
+     * can hand the framebuffer to clients without copying it.
+     */
+    fd = qemu_memfd_create("t8030-vram", T8030_DISPLAY_SIZE, false, 0, 0,
+                           NULL);
+    if (fd >= 0) {
+        memory_region_init_ram_from_fd(vram, OBJECT(fb), "vram",
+                                       T8030_DISPLAY_SIZE, RAM_SHARED, fd, 0,
+                                       &error_fatal);
+        vmstate_register_ram(vram, DEVICE(fb));
+    } else
+#endif
+    {
+        memory_region_init_ram(vram, OBJECT(fb), "vram", T8030_DISPLAY_SIZE,
+                               &error_fatal);
+    }
     memory_region_add_subregion_overlap(tms->sysmem, tms->video.v_baseAddr, vram, 1);
 
     object_property_add_const_link(OBJECT(fb), "vram", OBJECT(vram));
@@ -1581,6 +1637,63 @@ static void t8030_create_boot_display(MachineState *machine)
     sysbus_realize_and_unref(fb, &error_fatal);
 }
 
+static void t8030_create_display(MachineState *machine)
+{
+    uint32_t *ints;
+    DTBProp *prop;
+    uint64_t *reg;
+    T8030MachineState *tms = T8030_MACHINE(machine);
+    SysBusDevice *disp;
+    AppleDARTState *dart;
+    DTBNode *child = find_dtb_node(tms->device_tree, "arm-io");
+    IOMMUMemoryRegion *dma_mr = NULL;
+    DTBNode *dart_disp0 = find_dtb_node(child, "dart-disp0");
+    DTBNode *dart_disp0_mapper;
+
+    /* The stock display driver does not speak this register interface */
+    if (!tms->display_pipe) {
+        return;
+    }
+
+    assert(child != NULL);
+    child = find_dtb_node(child, "disp0");
+    if (!child || !dart_disp0) {
+        return;
+    }
+    dart_disp0_mapper = find_dtb_node(dart_disp0, "mapper-disp0");
+    if (!dart_disp0_mapper) {
+        return;
+    }
+
+    disp = apple_displaypipe_create(child);
+    assert(disp);
+
+    object_property_add_child(OBJECT(machine), "disp0", OBJECT(disp));
+    prop = find_dtb_prop(child, "reg");
+    assert(prop);
+    reg = (uint64_t *)prop->value;
+    sysbus_mmio_map(disp, 0, tms->soc_base_pa + reg[0]);
+
+    prop = find_dtb_prop(child, "interrupts");
+    assert(prop);
+    ints = (uint32_t *)prop->value;
+    sysbus_connect_irq(disp, 0, qdev_get_gpio_in(DEVICE(tms->aic), *ints));
+
+    dart = APPLE_DART(object_property_get_link(OBJECT(machine),
+                      "dart-disp0", &error_fatal));
+    assert(dart);
+
+    prop = find_dtb_prop(dart_disp0_mapper, "reg");
+    assert(prop);
+
+    dma_mr = apple_dart_iommu_mr(dart, *(uint32_t *)prop->value);
+    assert(dma_mr);
+    assert(object_property_add_const_link(OBJECT(disp), "dma-mr",
+                                          OBJECT(dma_mr)));
+
+    sysbus_realize_and_unref(disp, &error_fatal);
+}
+
 static void t8030_cpu_reset_work(CPUState *cpu, run_on_cpu_data data)
 {
     T8030MachineState *tms = data.host_ptr;
@@ -1816,6 +1929,7 @@ static void t8030_machine_init(MachineState *machine)
     }
 
     t8030_create_boot_display(machine);
+    t8030_create_display(machine);
 
     tms->init_done_notifier.notify = t8030_machine_init_done;
     qemu_add_machine_init_done_notifier(&tms->init_done_notifier);
@@ -1851,6 +1965,38 @@ static char *t8030_get_ticket_filename(Object *obj, Error **errp)
     return g_strdup(tms->ticket_filename);
 }
 
+static void t8030_set_usb_conn_addr(Object *obj, const char *value,
+                                    Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    g_free(tms->usb_conn_addr);
+    tms->usb_conn_addr = g_strdup(value);
+}
+
+static char *t8030_get_usb_conn_addr(Object *obj, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    return g_strdup(tms->usb_conn_addr);
+}
+
+static void t8030_set_smc_keys_filename(Object *obj, const char *value,
+                                        Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    g_free(tms->smc_keys_filename);
+    tms->smc_keys_filename = g_strdup(value);
+}
+
+static char *t8030_get_smc_keys_filename(Object *obj, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    return g_strdup(tms->smc_keys_filename);
+}
+
 static void t8030_set_boot_mode(Object *obj, const char *value, Error **errp)
 {
     T8030MachineState *tms = T8030_MACHINE(obj);
@@ -1948,6 +2094,21 @@ static bool t8030_get_kaslr_off(Object *obj, Error **errp)
     return tms->kaslr_off;
 }
 
+static void t8030_set_usb_bulk_unthrottled(Object *obj, bool value,
+                                           Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    tms->usb_bulk_unthrottled = value;
+}
+
+static bool t8030_get_usb_bulk_unthrottled(Object *obj, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    return tms->usb_bulk_unthrottled;
+}
+
 static ram_addr_t t8030_machine_fixup_ram_size(ram_addr_t size)
 {
     if (size != T8030_DRAM_SIZE) {
@@ -1956,6 +2117,68 @@ static ram_addr_t t8030_machine_fixup_ram_size(ram_addr_t size)
     return T8030_DRAM_SIZE;
 }
 
+static void t8030_set_shared_sysmem(Object *obj, bool value, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    tms->shared_sysmem = value;
+}
+
+static bool t8030_get_shared_sysmem(Object *obj, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    return tms->shared_sysmem;
+}
+
+static void t8030_set_display_pipe(Object *obj, bool value, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    tms->display_pipe = value;
+}
+
+static bool t8030_get_display_pipe(Object *obj, Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    return tms->display_pipe;
+}
+
+static void t8030_get_battery_level(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    visit_type_uint8(v, name, &tms->battery_level, errp);
+}
+
+static void t8030_set_battery_level(Object *obj, Visitor *v,
+                                    const char *name, void *opaque,
+                                    Error **errp)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+    uint8_t value;
+
+    if (!visit_type_uint8(v, name, &value, errp)) {
+        return;
+    }
+    if (value > 100) {
+        error_setg(errp, "Battery level must be a percentage");
+        return;
+    }
+
+    tms->battery_level = value;
+}
+
+static void t8030_machine_instance_init(Object *obj)
+{
+    T8030MachineState *tms = T8030_MACHINE(obj);
+
+    tms->battery_level = 100;
+}
+
 static void t8030_machine_class_init(ObjectClass *oc, void *data)
 {
     MachineClass *mc = MACHINE_CLASS(oc);
@@ -1985,6 +2208,19 @@ static void t8030_machine_class_init(ObjectClass *oc, void *data)
                                   t8030_set_ticket_filename);
     object_class_property_set_description(oc, "ticket-filename",
                                     "Set the APTicket filename to be loaded");
+    object_class_property_add_str(oc, "usb-conn-addr",
+                                  t8030_get_usb_conn_addr,
+                                  t8030_set_usb_conn_addr);
+    object_class_property_set_description(oc, "usb-conn-addr",
+                                    "Set the USB passthrough endpoint "
+                                    "(unix:<path>, abstract:<name>, "
+                                    "tcp:<host>:<port>)");
+    object_class_property_add_str(oc, "smc-keys-filename",
+                                  t8030_get_smc_keys_filename,
+                                  t8030_set_smc_keys_filename);
+    object_class_property_set_description(oc, "smc-keys-filename",
+                                    "Load extra SMC keys from a JSON or "
+                                    "binary key database");
     object_class_property_add_str(oc, "boot-mode",
                                   t8030_get_boot_mode,
                                   t8030_set_boot_mode);
@@ -2007,12 +2243,40 @@ static void t8030_machine_class_init(ObjectClass *oc, void *data)
                                   t8030_set_kaslr_off);
     object_class_property_set_description(oc, "kaslr-off",
                                           "Disable KASLR");
+    object_class_property_add_bool(oc, "usb-bulk-unthrottled",
+                                   t8030_get_usb_bulk_unthrottled,
+                                   t8030_set_usb_bulk_unthrottled);
+    object_class_property_set_description(oc, "usb-bulk-unthrottled",
+                                    "Service USB bulk endpoints as fast as "
+                                    "the host supplies data instead of "
+                                    "pacing them by frame");
+    object_class_property_add_bool(oc, "shared-sysmem",
+                                   t8030_get_shared_sysmem,
+                                   t8030_set_shared_sysmem);
+    object_class_property_set_description(oc, "shared-sysmem",
+                                    "Let all CPUs share the system address "
+                                    "space and bank per-CPU MMIO such as the "
+                                    "AIC on the accessing CPU");
+    object_class_property_add_bool(oc, "display-pipe",
+                                   t8030_get_display_pipe,
+                                   t8030_set_display_pipe);
+    object_class_property_set_description(oc, "display-pipe",
+                                    "Map the QEMU-defined display pipe at "
+                                    "disp0, for guests with a driver for it");
+    object_class_property_add(oc, "battery-level", "uint8",
+        t8030_get_battery_level,
+        t8030_set_battery_level,
+        NULL, NULL);
+    object_class_property_set_description(oc, "battery-level",
+        "Battery charge in percent reported by the SMC, can be changed "
+        "at runtime");
 }
 
 static const TypeInfo t8030_machine_info = {
     .name = TYPE_T8030_MACHINE,
     .parent = TYPE_MACHINE,
     .instance_size = sizeof(T8030MachineState),
+    .instance_init = t8030_machine_instance_init,
     .class_size = sizeof(T8030MachineClass),
     .class_init = t8030_machine_class_init,
 };
@@ -138,6 +138,11 @@ typedef struct {
     uint32_t    size;
 } AppleUartFIFO;
 
+/* Tx staging buffer in fast console mode, flushed in one chardev write */
+#define APPLE_UART_TX_BUF_SIZE      4096
+/* How long a partial run waits for more bytes in fast console mode */
+#define APPLE_UART_TX_IDLE_NS       (100 * SCALE_US)
+
 #define TYPE_APPLE_UART "apple.uart"
 OBJECT_DECLARE_SIMPLE_TYPE(AppleUartState, APPLE_UART)
 
@@ -148,13 +153,27 @@ struct AppleUartState {
 
     uint32_t             reg[APPLE_UART_REGS_MEM_SIZE / sizeof(uint32_t)];
     Fifo8   rx;
-    Fifo8   tx;
     uint32_t rx_fifo_size;
     uint32_t tx_fifo_size;
 
+    /*
+     * Bytes stored to UTXH are collected here and written to the chardev
+     * in runs, when the buffer fills up or after tx_timer expires. While
+     * the backend cannot take more, a watch is pending and the guest sees
+     * the Tx FIFO full instead of stalling the whole thread.
+     */
+    uint8_t *tx_buf;
+    uint32_t tx_count;
+    uint32_t tx_buf_size;
+    QEMUTimer *tx_timer;
+    guint watch_tag;
+
     QEMUTimer *fifo_timeout_timer;
     uint64_t wordtime;        /* word time in ns */
 
+    /* Don't pace the console by its baud rate */
+    bool fast_console;
+
     CharBackend       chr;
     qemu_irq          irq;
     qemu_irq          dmairq;
@@ -236,7 +255,7 @@ static void apple_uart_update_irq(AppleUartState *s)
      */
     uint32_t mask = UTRSTAT_Rx_BUFFER_DATA_READY;
     if (s->reg[I_(UFCON)] & UFCON_FIFO_ENABLE) {
-        uint32_t count = fifo8_num_used(&s->tx);
+        uint32_t count = s->tx_count;
 
         if (s->reg[I_(UCON)] & UCON_TXTHRESH_ENA) {
             mask |= UTRSTAT_Tx_THRESH | UTRSTAT_Tx_EMPTY |
@@ -337,7 +356,11 @@ static void apple_uart_update_parameters(AppleUartState *s)
 static void apple_uart_rx_timeout_set(AppleUartState *s)
 {
     if (s->reg[I_(UCON)] & UCON_RXTIMEOUT_ENA) {
-        uint32_t timeout = ((s->reg[I_(UCON)] >> 12) & 0x0f) * s->wordtime;
+        uint32_t timeout = 0;
+
+        if (!s->fast_console) {
+            timeout = ((s->reg[I_(UCON)] >> 12) & 0x0f) * s->wordtime;
+        }
 
         timer_mod(s->fifo_timeout_timer,
                   qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + timeout);
@@ -346,6 +369,102 @@ static void apple_uart_rx_timeout_set(AppleUartState *s)
     }
 }
 
+static gboolean apple_uart_xmit(void *do_not_use, GIOCondition cond,
+                                void *opaque);
+
+static void apple_uart_tx_done(AppleUartState *s)
+{
+    s->reg[I_(UTRSTAT)] |= UTRSTAT_Tx_EMPTY | UTRSTAT_Tx_BUFFER_EMPTY;
+    apple_uart_update_irq(s);
+}
+
+/* Write out as much of the staged Tx data as the backend accepts */
+static void apple_uart_flush_tx(AppleUartState *s)
+{
+    int ret;
+
+    timer_del(s->tx_timer);
+    if (s->watch_tag || s->tx_count == 0) {
+        return;
+    }
+
+    ret = qemu_chr_fe_write(&s->chr, s->tx_buf, s->tx_count);
+    if (ret > 0) {
+        s->tx_count -= ret;
+        memmove(s->tx_buf, s->tx_buf + ret, s->tx_count);
+    }
+
+    if (s->tx_count) {
+        s->watch_tag = qemu_chr_fe_add_watch(&s->chr, G_IO_OUT | G_IO_HUP,
+                                             apple_uart_xmit, s);
+        if (!s->watch_tag) {
+            /* The backend can't tell us when it drains, don't wait for it */
+            s->tx_count = 0;
+        }
+    }
+
+    if (s->tx_count < s->tx_buf_size) {
+        s->reg[I_(UTRSTAT)] |= UTRSTAT_Tx_BUFFER_EMPTY;
+    }
+    if (s->tx_count == 0) {
+        apple_uart_tx_done(s);
+    }
+}
+
+static gboolean apple_uart_xmit(void *do_not_use, GIOCondition cond,
+                                void *opaque)
+{
+    AppleUartState *s = opaque;
+
+    s->watch_tag = 0;
+    apple_uart_flush_tx(s);
+
+    return G_SOURCE_REMOVE;
+}
+
+static void apple_uart_tx_timeout(void *opaque)
+{
+    apple_uart_flush_tx(opaque);
+}
+
+/* Push everything out, blocking if we have to */
+static void apple_uart_drain_tx(AppleUartState *s)
+{
+    timer_del(s->tx_timer);
+    if (s->tx_count) {
+        qemu_chr_fe_write_all(&s->chr, s->tx_buf, s->tx_count);
+        s->tx_count = 0;
+        apple_uart_tx_done(s);
+    }
+}
+
+static void apple_uart_put_tx(AppleUartState *s, uint8_t ch)
+{
+    if (s->tx_count == s->tx_buf_size) {
+        /* The guest ignored Tx FIFO full, fall back to a blocking write */
+        apple_uart_drain_tx(s);
+    }
+
+    s->tx_buf[s->tx_count++] = ch;
+    trace_apple_uart_tx(s->channel, ch);
+    s->reg[I_(UTRSTAT)] &= ~UTRSTAT_Tx_EMPTY;
+
+    if (s->tx_count == s->tx_buf_size) {
+        s->reg[I_(UTRSTAT)] &= ~UTRSTAT_Tx_BUFFER_EMPTY;
+        apple_uart_flush_tx(s);
+    } else if (!timer_pending(s->tx_timer) && !s->watch_tag) {
+        uint64_t timeout = APPLE_UART_TX_IDLE_NS;
+
+        if (!s->fast_console) {
+            /* Send the run once it would have left the wire */
+            timeout = s->wordtime * s->tx_buf_size;
+        }
+        timer_mod(s->tx_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + timeout);
+    }
+    apple_uart_update_irq(s);
+}
+
 static void apple_uart_write(void *opaque, hwaddr offset,
                                uint64_t val, unsigned size)
 {
@@ -370,7 +489,7 @@ static void apple_uart_write(void *opaque, hwaddr offset,
             trace_apple_uart_rx_fifo_reset(s->channel);
         }
         if (val & UFCON_Tx_FIFO_RESET) {
-            fifo8_reset(&s->tx);
+            apple_uart_drain_tx(s);
             s->reg[I_(UFCON)] &= ~UFCON_Tx_FIFO_RESET;
             trace_apple_uart_tx_fifo_reset(s->channel);
         }
@@ -378,16 +497,8 @@ static void apple_uart_write(void *opaque, hwaddr offset,
 
     case UTXH:
         if (qemu_chr_fe_backend_connected(&s->chr)) {
-            s->reg[I_(UTRSTAT)] &= ~(UTRSTAT_Tx_EMPTY |
-                    UTRSTAT_Tx_BUFFER_EMPTY);
             ch = (uint8_t)val;
-            /* XXX this blocks entire thread. Rewrite to use
-             * qemu_chr_fe_write and background I/O callbacks */
-            qemu_chr_fe_write_all(&s->chr, &ch, 1);
-            trace_apple_uart_tx(s->channel, ch);
-            s->reg[I_(UTRSTAT)] |= UTRSTAT_Tx_EMPTY |
-                    UTRSTAT_Tx_BUFFER_EMPTY;
-            apple_uart_update_irq(s);
+            apple_uart_put_tx(s, ch);
         }
         break;
 
@@ -435,6 +546,11 @@ static uint64_t apple_uart_read(void *opaque, hwaddr offset,
         if (fifo8_num_free(&s->rx) == 0) {
             s->reg[I_(UFSTAT)] |= UFSTAT_Rx_FIFO_FULL;
         }
+        s->reg[I_(UFSTAT)] |= MIN(s->tx_count, 0xf)
+                              << UFSTAT_Tx_FIFO_COUNT_SHIFT;
+        if (s->tx_count == s->tx_buf_size) {
+            s->reg[I_(UFSTAT)] |= UFSTAT_Tx_FIFO_FULL;
+        }
         trace_apple_uart_read(s->channel, offset,
                                apple_uart_regname(offset),
                                s->reg[I_(UFSTAT)]);
@@ -503,9 +619,14 @@ static void apple_uart_receive(void *opaque, const uint8_t *buf, int size)
     AppleUartState *s = (AppleUartState *)opaque;
 
     if (s->reg[I_(UFCON)] & UFCON_FIFO_ENABLE) {
+        /*
+         * apple_uart_can_receive() never offers more than the FIFO can
+         * hold, the backend keeps the rest until URXH is read and
+         * qemu_chr_fe_accept_input() asks for more.
+         */
         if (fifo8_num_free(&s->rx) < size) {
             qemu_log_mask(LOG_GUEST_ERROR,
-            "%s: tx overflow: %d < %d\n", __func__, fifo8_num_free(&s->rx), size);
+            "%s: rx overflow: %d < %d\n", __func__, fifo8_num_free(&s->rx), size);
             size = fifo8_num_free(&s->rx);
         }
         fifo8_push_all(&s->rx, buf, size);
@@ -544,11 +665,22 @@ static void apple_uart_reset(DeviceState *dev)
     }
 
     fifo8_reset(&s->rx);
-    fifo8_reset(&s->tx);
+    timer_del(s->tx_timer);
+    s->tx_count = 0;
 
     trace_apple_uart_rxsize(s->channel, s->rx_fifo_size);
 }
 
+static int apple_uart_pre_save(void *opaque)
+{
+    AppleUartState *s = APPLE_UART(opaque);
+
+    /* Staged Tx data is not migrated */
+    apple_uart_drain_tx(s);
+
+    return 0;
+}
+
 static int apple_uart_post_load(void *opaque, int version_id)
 {
     AppleUartState *s = APPLE_UART(opaque);
@@ -563,6 +695,7 @@ static const VMStateDescription vmstate_apple_uart = {
     .name = "apple.uart",
     .version_id = 1,
     .minimum_version_id = 1,
+    .pre_save = apple_uart_pre_save,
     .post_load = apple_uart_post_load,
     .fields = (VMStateField[]) {
         VMSTATE_FIFO8(rx, AppleUartState),
@@ -629,7 +762,15 @@ static void apple_uart_realize(DeviceState *dev, Error **errp)
     }
 
     fifo8_create(&s->rx, s->rx_fifo_size);
-    fifo8_create(&s->tx, s->tx_fifo_size);
+
+    /*
+     * Without pacing, the guest only has to wait when the backend pushes
+     * back, so stage far more than the hardware FIFO holds.
+     */
+    s->tx_buf_size = s->fast_console ? APPLE_UART_TX_BUF_SIZE
+                                     : MAX(s->tx_fifo_size, 1);
+    s->tx_buf = g_malloc(s->tx_buf_size);
+    s->tx_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, apple_uart_tx_timeout, s);
 
     s->fifo_timeout_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
                                          apple_uart_timeout_int, s);
@@ -644,6 +785,7 @@ static Property apple_uart_properties[] = {
     DEFINE_PROP_UINT32("channel", AppleUartState, channel, 0),
     DEFINE_PROP_UINT32("rx-size", AppleUartState, rx_fifo_size, 15),
     DEFINE_PROP_UINT32("tx-size", AppleUartState, tx_fifo_size, 15),
+    DEFINE_PROP_BOOL("fast-console", AppleUartState, fast_console, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
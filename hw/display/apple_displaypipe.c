@@ -0,0 +1,370 @@
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "hw/irq.h"
+#include "hw/display/apple_displaypipe.h"
+#include "migration/vmstate.h"
+#include "qemu/bswap.h"
+#include "qemu/log.h"
+#include "qemu/module.h"
+#include "sysemu/dma.h"
+#include "trace.h"
+
+#define DISP_MAX_WIDTH  (4096)
+#define DISP_MAX_HEIGHT (4096)
+
+static void apple_displaypipe_update_irq(AppleDisplayPipeState *s)
+{
+    int level = 0;
+
+    if ((s->status & DISP_STATUS_VSYNC) && (s->ctrl & DISP_CTRL_VSYNC_IRQ_EN)) {
+        level = 1;
+    }
+    if ((s->status & DISP_STATUS_FLIP_DONE)
+        && (s->ctrl & DISP_CTRL_FLIP_IRQ_EN)) {
+        level = 1;
+    }
+    if (s->status & DISP_STATUS_DMA_ERROR) {
+        level = 1;
+    }
+    qemu_set_irq(s->irq, level);
+}
+
+/*
+ * Copy the current buffer into the console surface. This is the only place
+ * guest memory is read, so a static frame costs nothing after its flip.
+ */
+static void apple_displaypipe_scanout(AppleDisplayPipeState *s)
+{
+    DisplaySurface *surface = qemu_console_surface(s->console);
+    dma_addr_t iova = s->buf_addr[s->cur_buf];
+    uint32_t row_bytes = s->width * 4;
+    uint8_t *dest;
+    MemTxResult res = MEMTX_OK;
+
+    if (s->width == 0 || s->height == 0) {
+        return;
+    }
+
+    if (!surface || surface_width(surface) != s->width
+        || surface_height(surface) != s->height) {
+        qemu_console_resize(s->console, s->width, s->height);
+        surface = qemu_console_surface(s->console);
+    }
+    dest = surface_data(surface);
+
+    trace_apple_displaypipe_flip(s->cur_buf, iova, s->width, s->height);
+
+    if (s->stride == row_bytes && surface_stride(surface) == row_bytes) {
+        res = dma_memory_read(&s->dma_as, iova, dest,
+                              (dma_addr_t)row_bytes * s->height,
+                              MEMTXATTRS_UNSPECIFIED);
+    } else {
+        for (uint32_t y = 0; y < s->height && res == MEMTX_OK; y++) {
+            res = dma_memory_read(&s->dma_as, iova + (dma_addr_t)y * s->stride,
+                                  dest + y * surface_stride(surface),
+                                  row_bytes, MEMTXATTRS_UNSPECIFIED);
+        }
+    }
+
+    if (res != MEMTX_OK) {
+        trace_apple_displaypipe_dma_error(iova);
+        s->status |= DISP_STATUS_DMA_ERROR;
+    }
+
+    if (HOST_BIG_ENDIAN) {
+        for (uint32_t y = 0; y < s->height; y++) {
+            uint32_t *row = (uint32_t *)(dest + y * surface_stride(surface));
+
+            for (uint32_t x = 0; x < s->width; x++) {
+                le32_to_cpus(&row[x]);
+            }
+        }
+    }
+
+    s->dirty = true;
+}
+
+static void apple_displaypipe_vsync(void *opaque)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(opaque);
+
+    if (!(s->ctrl & DISP_CTRL_ENABLE)) {
+        return;
+    }
+
+    s->vsync_count++;
+    if (s->flip & DISP_FLIP_PENDING) {
+        s->cur_buf = s->flip & (DISP_NUM_BUFFERS - 1);
+        s->flip &= ~DISP_FLIP_PENDING;
+        apple_displaypipe_scanout(s);
+        s->status |= DISP_STATUS_FLIP_DONE;
+    }
+    s->status |= DISP_STATUS_VSYNC;
+    apple_displaypipe_update_irq(s);
+
+    timer_mod(s->vsync_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                              + NANOSECONDS_PER_SECOND / DISP_VSYNC_HZ);
+}
+
+static void apple_displaypipe_set_ctrl(AppleDisplayPipeState *s, uint32_t val)
+{
+    bool was_enabled = s->ctrl & DISP_CTRL_ENABLE;
+
+    s->ctrl = val;
+    if (!was_enabled && (val & DISP_CTRL_ENABLE)) {
+        /* Show whatever the current buffer holds until the first flip */
+        apple_displaypipe_scanout(s);
+        timer_mod(s->vsync_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                  + NANOSECONDS_PER_SECOND / DISP_VSYNC_HZ);
+    } else if (was_enabled && !(val & DISP_CTRL_ENABLE)) {
+        timer_del(s->vsync_timer);
+        s->flip &= ~DISP_FLIP_PENDING;
+    }
+    apple_displaypipe_update_irq(s);
+}
+
+static void apple_displaypipe_reg_write(void *opaque, hwaddr addr,
+                                        uint64_t data, unsigned size)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(opaque);
+    uint32_t val = data;
+
+    if (addr >= rDISP_BUF_ADDR_LO(0) && addr < DISP_REG_SIZE) {
+        int i = (addr - rDISP_BUF_ADDR_LO(0)) / 8;
+
+        if (addr & 4) {
+            s->buf_addr[i] = deposit64(s->buf_addr[i], 32, 32, val);
+        } else {
+            s->buf_addr[i] = deposit64(s->buf_addr[i], 0, 32, val);
+        }
+        return;
+    }
+
+    switch (addr) {
+    case rDISP_CTRL:
+        apple_displaypipe_set_ctrl(s, val);
+        break;
+    case rDISP_STATUS:
+        s->status &= ~val;
+        apple_displaypipe_update_irq(s);
+        break;
+    case rDISP_SIZE:
+        s->width = MIN(val & 0xffff, DISP_MAX_WIDTH);
+        s->height = MIN(val >> 16, DISP_MAX_HEIGHT);
+        break;
+    case rDISP_STRIDE:
+        s->stride = val;
+        break;
+    case rDISP_FORMAT:
+        if (val != DISP_FORMAT_XRGB8888) {
+            qemu_log_mask(LOG_UNIMP, "%s: unsupported format %u\n",
+                          __func__, val);
+            break;
+        }
+        s->format = val;
+        break;
+    case rDISP_FLIP:
+        s->flip = (val & (DISP_NUM_BUFFERS - 1)) | DISP_FLIP_PENDING;
+        break;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%"HWADDR_PRIx"\n",
+                      __func__, addr);
+        break;
+    }
+}
+
+static uint64_t apple_displaypipe_reg_read(void *opaque, hwaddr addr,
+                                           unsigned size)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(opaque);
+
+    if (addr >= rDISP_BUF_ADDR_LO(0) && addr < DISP_REG_SIZE) {
+        int i = (addr - rDISP_BUF_ADDR_LO(0)) / 8;
+
+        return extract64(s->buf_addr[i], (addr & 4) ? 32 : 0, 32);
+    }
+
+    switch (addr) {
+    case rDISP_CTRL:
+        return s->ctrl;
+    case rDISP_STATUS:
+        return s->status;
+    case rDISP_SIZE:
+        return s->width | (s->height << 16);
+    case rDISP_STRIDE:
+        return s->stride;
+    case rDISP_FORMAT:
+        return s->format;
+    case rDISP_CUR_BUF:
+        return s->cur_buf;
+    case rDISP_FLIP:
+        return s->flip;
+    case rDISP_VSYNC_COUNT:
+        return s->vsync_count;
+    default:
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: Bad offset 0x%"HWADDR_PRIx"\n",
+                      __func__, addr);
+        return 0;
+    }
+}
+
+static const MemoryRegionOps apple_displaypipe_reg_ops = {
+    .write = apple_displaypipe_reg_write,
+    .read = apple_displaypipe_reg_read,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+    .valid.unaligned = false,
+};
+
+static void apple_displaypipe_gfx_update(void *opaque)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(opaque);
+
+    if (s->dirty) {
+        s->dirty = false;
+        dpy_gfx_update_full(s->console);
+    }
+}
+
+static void apple_displaypipe_invalidate(void *opaque)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(opaque);
+
+    s->dirty = true;
+}
+
+static const GraphicHwOps apple_displaypipe_gfx_ops = {
+    .invalidate = apple_displaypipe_invalidate,
+    .gfx_update = apple_displaypipe_gfx_update,
+};
+
+static void apple_displaypipe_reset(DeviceState *dev)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(dev);
+
+    timer_del(s->vsync_timer);
+    s->ctrl = 0;
+    s->status = 0;
+    s->width = 0;
+    s->height = 0;
+    s->stride = 0;
+    s->format = DISP_FORMAT_XRGB8888;
+    s->cur_buf = 0;
+    s->flip = 0;
+    s->vsync_count = 0;
+    memset(s->buf_addr, 0, sizeof(s->buf_addr));
+    s->dirty = false;
+    qemu_set_irq(s->irq, 0);
+}
+
+static void apple_displaypipe_realize(DeviceState *dev, Error **errp)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(dev);
+    Object *obj;
+
+    obj = object_property_get_link(OBJECT(dev), "dma-mr", &error_abort);
+
+    s->dma_mr = MEMORY_REGION(obj);
+    address_space_init(&s->dma_as, s->dma_mr, TYPE_APPLE_DISPLAYPIPE);
+
+    s->vsync_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                  apple_displaypipe_vsync, s);
+    s->console = graphic_console_init(dev, 0, &apple_displaypipe_gfx_ops, s);
+}
+
+static void apple_displaypipe_unrealize(DeviceState *dev)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(dev);
+
+    timer_free(s->vsync_timer);
+    graphic_console_close(s->console);
+    address_space_destroy(&s->dma_as);
+}
+
+SysBusDevice *apple_displaypipe_create(DTBNode *node)
+{
+    DeviceState *dev;
+    AppleDisplayPipeState *s;
+    SysBusDevice *sbd;
+    DTBProp *prop;
+    uint64_t *reg;
+
+    dev = qdev_new(TYPE_APPLE_DISPLAYPIPE);
+    s = APPLE_DISPLAYPIPE(dev);
+    sbd = SYS_BUS_DEVICE(dev);
+
+    prop = find_dtb_prop(node, "reg");
+    assert(prop);
+
+    reg = (uint64_t *)prop->value;
+
+    memory_region_init_io(&s->iomem, OBJECT(dev), &apple_displaypipe_reg_ops,
+                          s, TYPE_APPLE_DISPLAYPIPE ".mmio",
+                          MAX(reg[1], DISP_REG_SIZE));
+    sysbus_init_mmio(sbd, &s->iomem);
+    sysbus_init_irq(sbd, &s->irq);
+
+    return sbd;
+}
+
+static int apple_displaypipe_post_load(void *opaque, int version_id)
+{
+    AppleDisplayPipeState *s = APPLE_DISPLAYPIPE(opaque);
+
+    /* The surface is not migrated, fetch the shown buffer again */
+    if (s->ctrl & DISP_CTRL_ENABLE) {
+        apple_displaypipe_scanout(s);
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_apple_displaypipe = {
+    .name = "apple_displaypipe",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = apple_displaypipe_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(ctrl, AppleDisplayPipeState),
+        VMSTATE_UINT32(status, AppleDisplayPipeState),
+        VMSTATE_UINT32(width, AppleDisplayPipeState),
+        VMSTATE_UINT32(height, AppleDisplayPipeState),
+        VMSTATE_UINT32(stride, AppleDisplayPipeState),
+        VMSTATE_UINT32(format, AppleDisplayPipeState),
+        VMSTATE_UINT32(cur_buf, AppleDisplayPipeState),
+        VMSTATE_UINT32(flip, AppleDisplayPipeState),
+        VMSTATE_UINT32(vsync_count, AppleDisplayPipeState),
+        VMSTATE_UINT64_ARRAY(buf_addr, AppleDisplayPipeState,
+                             DISP_NUM_BUFFERS),
+        VMSTATE_TIMER_PTR(vsync_timer, AppleDisplayPipeState),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static void apple_displaypipe_class_init(ObjectClass *klass, void *data)
+{
+    DeviceClass *dc = DEVICE_CLASS(klass);
+
+    dc->realize = apple_displaypipe_realize;
+    dc->unrealize = apple_displaypipe_unrealize;
+    dc->reset = apple_displaypipe_reset;
+    dc->desc = "Apple Display Pipe";
+    dc->vmsd = &vmstate_apple_displaypipe;
+    set_bit(DEVICE_CATEGORY_DISPLAY, dc->categories);
+}
+
+static const TypeInfo apple_displaypipe_info = {
+    .name = TYPE_APPLE_DISPLAYPIPE,
+    .parent = TYPE_SYS_BUS_DEVICE,
+    .instance_size = sizeof(AppleDisplayPipeState),
+    .class_init = apple_displaypipe_class_init,
+};
+
+static void apple_displaypipe_register_types(void)
+{
+    type_register_static(&apple_displaypipe_info);
+}
+
+type_init(apple_displaypipe_register_types);
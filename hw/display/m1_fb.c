@@ -36,11 +36,56 @@ static void fb_draw_row(void *opaque, uint8_t *dest, const uint8_t *src,
     }
 }
 
+/*
+ * The surface is backed by vram itself, so only tell the UI which runs of
+ * rows the guest touched since the last refresh.
+ */
+static void fb_gfx_update_mapped(M1FBState *s)
+{
+    int src_stride = s->width * 4;
+    DirtyBitmapSnapshot *snap;
+    int first_row = -1;
+
+    snap = memory_region_snapshot_and_clear_dirty(s->vram, 0,
+                                                  (hwaddr)src_stride
+                                                  * s->height,
+                                                  DIRTY_MEMORY_VGA);
+    if (s->full_update) {
+        s->full_update = false;
+        g_free(snap);
+        dpy_gfx_update_full(s->console);
+        return;
+    }
+
+    for (int y = 0; y < s->height; y++) {
+        if (memory_region_snapshot_get_dirty(s->vram, snap,
+                                             (hwaddr)y * src_stride,
+                                             src_stride)) {
+            if (first_row < 0) {
+                first_row = y;
+            }
+        } else if (first_row >= 0) {
+            dpy_gfx_update(s->console, 0, first_row, s->width, y - first_row);
+            first_row = -1;
+        }
+    }
+    if (first_row >= 0) {
+        dpy_gfx_update(s->console, 0, first_row, s->width,
+                       s->height - first_row);
+    }
+    g_free(snap);
+}
+
 static void fb_gfx_update(void *opaque)
 {
     M1FBState *s = M1_FB(opaque);
     DisplaySurface *surface = qemu_console_surface(s->console);
 
+    if (s->mapped) {
+        fb_gfx_update_mapped(s);
+        return;
+    }
+
     /* Used as both input to start converting fb memory and output of dirty */
     int first_row = 0;
     /* Output of last row of fb that was updated during conversion */
@@ -84,10 +129,12 @@ static void fb_gfx_update(void *opaque)
 
 static void fb_invalidate(void *opaque)
 {
+    M1FBState *s = M1_FB(opaque);
+
     /* FIXME: adding invalidate support for changing display parameters when
     * this is implemented
     */
-    printf("FB invalidate called\n");
+    s->full_update = true;
 }
 
 static const GraphicHwOps m1_fb_ops = {
@@ -110,7 +157,26 @@ static void m1_fb_realize(DeviceState *dev, Error **errp)
     s->vram = MEMORY_REGION(obj);
 
     s->console = graphic_console_init(dev, 0, &m1_fb_ops, s);
-    qemu_console_resize(s->console, s->width, s->height);
+
+    /*
+     * vram holds little-endian x8r8g8b8 pixels, which is the native
+     * surface format on little-endian hosts: scan out of it directly.
+     */
+    if (!HOST_BIG_ENDIAN && memory_region_is_ram(s->vram)
+        && memory_region_size(s->vram) >= (uint64_t)s->width * 4 * s->height) {
+        uint8_t *pixels = memory_region_get_ram_ptr(s->vram);
+        DisplaySurface *surface;
+
+        surface = qemu_create_displaysurface_from(s->width, s->height,
+                                                  PIXMAN_x8r8g8b8,
+                                                  s->width * 4, pixels);
+        memory_region_set_log(s->vram, true, DIRTY_MEMORY_VGA);
+        dpy_gfx_replace_surface(s->console, surface);
+        s->mapped = true;
+        s->full_update = true;
+    } else {
+        qemu_console_resize(s->console, s->width, s->height);
+    }
 }
 
 static const VMStateDescription vmstate_m1_fb = {
@@ -22,12 +22,67 @@ typedef struct xnu_ramfb_state {
     hwaddr fb_pa;
     uint32_t fb_size;
     hwaddr as;
+    /* Guest RAM backing the surface when the framebuffer could be mapped */
+    MemoryRegionSection fb_section;
+    bool mapped;
+    bool full_update;
 } xnu_ramfb_state;
 
-void xnu_ramfb_display_update(void *opaque)
+/*
+ * Point the console surface straight at the guest framebuffer and start
+ * dirty logging on it. Fails if the framebuffer is not plain RAM.
+ */
+static bool xnu_ramfb_map(xnu_ramfb_state *xnu_ramfb)
+{
+    AddressSpace *as = (AddressSpace *)xnu_ramfb->as;
+    MemoryRegionSection section;
+    DisplaySurface *ds;
+    uint8_t *ptr;
+
+    section = memory_region_find(as->root, xnu_ramfb->fb_pa,
+                                 xnu_ramfb->fb_size);
+    if (section.mr == NULL) {
+        return false;
+    }
+    if (!memory_region_is_ram(section.mr)
+        || int128_get64(section.size) < xnu_ramfb->fb_size) {
+        memory_region_unref(section.mr);
+        return false;
+    }
+
+    ptr = memory_region_get_ram_ptr(section.mr) + section.offset_within_region;
+    ds = qemu_create_displaysurface_from(xnu_ramfb->display_cfg.width,
+                                         xnu_ramfb->display_cfg.height,
+                                         xnu_ramfb->display_cfg.format,
+                                         xnu_ramfb->display_cfg.linesize,
+                                         ptr);
+    if (ds == NULL) {
+        memory_region_unref(section.mr);
+        return false;
+    }
+
+    memory_region_set_log(section.mr, true, DIRTY_MEMORY_VGA);
+    xnu_ramfb->fb_section = section;
+    xnu_ramfb->mapped = true;
+    dpy_gfx_replace_surface(xnu_ramfb->con, ds);
+    return true;
+}
+
+static void xnu_ramfb_unmap(xnu_ramfb_state *xnu_ramfb)
+{
+    if (!xnu_ramfb->mapped) {
+        return;
+    }
+    memory_region_set_log(xnu_ramfb->fb_section.mr, false, DIRTY_MEMORY_VGA);
+    memory_region_unref(xnu_ramfb->fb_section.mr);
+    xnu_ramfb->fb_section.mr = NULL;
+    xnu_ramfb->mapped = false;
+}
+
+/* Fallback for framebuffers outside of RAM: copy the whole frame */
+static void xnu_ramfb_copy_update(xnu_ramfb_state *xnu_ramfb)
 {
     DisplaySurface *ds = NULL;
-    xnu_ramfb_state *xnu_ramfb = XNU_RAMFB(opaque);
     uint32_t format = xnu_ramfb->display_cfg.format;
     uint32_t width = xnu_ramfb->display_cfg.width;
     uint32_t height = xnu_ramfb->display_cfg.height;
@@ -36,21 +91,80 @@ void xnu_ramfb_display_update(void *opaque)
     hwaddr as = xnu_ramfb->as;
     hwaddr fb_pa = xnu_ramfb->fb_pa;
     uint32_t fb_size = xnu_ramfb->fb_size;
-    uint8_t*  qemu_fb_ptr = xnu_ramfb->qemu_fb_ptr;
 
-    assert(qemu_fb_ptr != 0);
-    assert(fb_pa != 0);
+    if (xnu_ramfb->qemu_fb_ptr == NULL) {
+        xnu_ramfb->qemu_fb_ptr = g_malloc0(fb_size);
+    }
 
     address_space_rw((AddressSpace*) as, fb_pa, MEMTXATTRS_UNSPECIFIED,
-                qemu_fb_ptr, fb_size, FALSE);
+                xnu_ramfb->qemu_fb_ptr, fb_size, FALSE);
     ds = qemu_create_displaysurface_from(
-        width, height, format, linesize, qemu_fb_ptr);
+        width, height, format, linesize, xnu_ramfb->qemu_fb_ptr);
     if (ds) {
         dpy_gfx_replace_surface(con, ds);
     }
     dpy_gfx_update_full(con);
 }
 
+void xnu_ramfb_display_update(void *opaque)
+{
+    xnu_ramfb_state *xnu_ramfb = XNU_RAMFB(opaque);
+    uint32_t width = xnu_ramfb->display_cfg.width;
+    uint32_t height = xnu_ramfb->display_cfg.height;
+    uint32_t linesize = xnu_ramfb->display_cfg.linesize;
+    QemuConsole *con = xnu_ramfb->con;
+    MemoryRegion *mr;
+    hwaddr base;
+    DirtyBitmapSnapshot *snap;
+    int first = -1;
+
+    assert(xnu_ramfb->fb_pa != 0);
+
+    if (!xnu_ramfb->mapped) {
+        if (!xnu_ramfb_map(xnu_ramfb)) {
+            xnu_ramfb_copy_update(xnu_ramfb);
+            return;
+        }
+        xnu_ramfb->full_update = true;
+    }
+
+    mr = xnu_ramfb->fb_section.mr;
+    base = xnu_ramfb->fb_section.offset_within_region;
+    snap = memory_region_snapshot_and_clear_dirty(mr, base,
+                                                  (hwaddr)linesize * height,
+                                                  DIRTY_MEMORY_VGA);
+    if (xnu_ramfb->full_update) {
+        xnu_ramfb->full_update = false;
+        g_free(snap);
+        dpy_gfx_update_full(con);
+        return;
+    }
+
+    /* Send runs of dirty scanlines, the surface already has the pixels */
+    for (uint32_t y = 0; y < height; y++) {
+        if (memory_region_snapshot_get_dirty(mr, snap, base + y * linesize,
+                                             linesize)) {
+            if (first < 0) {
+                first = y;
+            }
+        } else if (first >= 0) {
+            dpy_gfx_update(con, 0, first, width, y - first);
+            first = -1;
+        }
+    }
+    if (first >= 0) {
+        dpy_gfx_update(con, 0, first, width, height - first);
+    }
+    g_free(snap);
+}
+
+static void xnu_ramfb_invalidate(void *opaque)
+{
+    xnu_ramfb_state *xnu_ramfb = XNU_RAMFB(opaque);
+
+    xnu_ramfb->full_update = true;
+}
+
 void xnu_display_prolog(xnu_ramfb_state* xnu_fb_state)
 {
     //currently empty
@@ -59,7 +173,6 @@ void xnu_display_prolog(xnu_ramfb_state* xnu_fb_state)
 
 void xnu_ramfb_setup(xnu_ramfb_state* xnu_fb_state)
 {
-    uint8_t* fb_ptr;
     xnu_fb_state->display_cfg.format = PIXMAN_LE_r8g8b8;
 
     if (xnu_fb_state->fb_size == 0){
@@ -67,13 +180,15 @@ void xnu_ramfb_setup(xnu_ramfb_state* xnu_fb_state)
             "xnu_ram_fb: size for the framebuffer is zero, aborting...\n");
         abort();
     }
-    fb_ptr = g_malloc0(xnu_fb_state->fb_size);
-    if (fb_ptr == NULL){
+    if ((uint64_t)xnu_fb_state->display_cfg.linesize
+        * xnu_fb_state->display_cfg.height > xnu_fb_state->fb_size) {
         fprintf(stderr,
-            "xnu_ram_fb: failed to allocate memory for the framebuffer.\n");
+            "xnu_ram_fb: framebuffer is smaller than the display, "
+            "aborting...\n");
         abort();
     }
-    xnu_fb_state->qemu_fb_ptr = fb_ptr;
+    /* The copy buffer is only allocated if the framebuffer can't be mapped */
+    xnu_fb_state->qemu_fb_ptr = NULL;
 
     xnu_display_prolog(xnu_fb_state);
 }
@@ -84,6 +199,7 @@ void xnu_ramfb_free(uint8_t* qemu_fb_ptr)
 }
 
 static const GraphicHwOps wrapper_ops = {
+    .invalidate = xnu_ramfb_invalidate,
     .gfx_update = xnu_ramfb_display_update,
 };
 
@@ -98,7 +214,9 @@ static void xnu_ramfb_unrealizefn(DeviceState *dev)
 {
     xnu_ramfb_state *xnu_ramfb = XNU_RAMFB(dev);
     graphic_console_close(xnu_ramfb->con);
+    xnu_ramfb_unmap(xnu_ramfb);
     xnu_ramfb_free(xnu_ramfb->qemu_fb_ptr);
+    xnu_ramfb->qemu_fb_ptr = NULL;
 }
 
 static Property xnu_ramfb_properties[] = {
@@ -83,15 +83,107 @@ typedef struct QEMU_PACKED sio_msg {
     };
 } sio_msg;
 
-static void apple_sio_map_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep)
+static dma_addr_t apple_sio_handle_addr(AppleSIOState *s, uint32_t handle)
 {
-    if (ep->mapped) {
-        return;
+    return ((dma_addr_t)s->params[DMA_SEGMENT_BASE] << 12) + handle * 12;
+}
+
+static void apple_sio_invalidate_segments(AppleSIOState *s, uint32_t handle)
+{
+    g_hash_table_remove(s->segment_tables, GUINT_TO_POINTER(handle));
+}
+
+/*
+ * A cached table is only reused if the descriptor still has the same
+ * segment count, first and last segment. That is two small reads instead
+ * of re-reading the whole table.
+ */
+static bool apple_sio_segments_valid(AppleSIOState *s, dma_addr_t handle_addr,
+                                     AppleSIOSegmentTable *table,
+                                     uint32_t segment_count,
+                                     sio_dma_segment *first)
+{
+    sio_dma_segment last;
+
+    if (segment_count != table->count) {
+        return false;
+    }
+    if (!segment_count) {
+        return true;
+    }
+    if (memcmp(first, &table->segments[0], sizeof(*first))) {
+        return false;
     }
-    qemu_iovec_init(&ep->iov, ep->count);
-    for (int i = 0; i < ep->count; i++) {
-        dma_addr_t base = ep->sgl.sg[i].base;
-        dma_addr_t len = ep->sgl.sg[i].len;
+    if (segment_count == 1) {
+        return true;
+    }
+    if (dma_memory_read(&s->dma_as,
+                        handle_addr + 0x48
+                        + (segment_count - 1) * sizeof(sio_dma_segment),
+                        &last, sizeof(last),
+                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        return false;
+    }
+    return !memcmp(&last, &table->segments[segment_count - 1], sizeof(last));
+}
+
+static AppleSIOSegmentTable *apple_sio_get_segments(AppleSIOState *s,
+                                                    uint32_t handle)
+{
+    dma_addr_t handle_addr = apple_sio_handle_addr(s, handle);
+    AppleSIOSegmentTable *table;
+    /* Segment count at 0x3C, the segments from 0x48 */
+    struct QEMU_PACKED {
+        uint32_t count;
+        uint8_t pad[8];
+        sio_dma_segment first;
+    } head;
+    uint32_t segment_count;
+
+    if (dma_memory_read(&s->dma_as, handle_addr + 0x3C, &head, sizeof(head),
+                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        return NULL;
+    }
+    segment_count = head.count;
+
+    table = g_hash_table_lookup(s->segment_tables, GUINT_TO_POINTER(handle));
+    if (table) {
+        if (apple_sio_segments_valid(s, handle_addr, table, segment_count,
+                                     &head.first)) {
+            return table;
+        }
+        apple_sio_invalidate_segments(s, handle);
+    }
+    if (segment_count > SIO_MAX_SEGMENTS) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: handle 0x%x has %u segments, "
+                      "more than the maximum of %u\n", __func__, handle,
+                      segment_count, (unsigned)SIO_MAX_SEGMENTS);
+        return NULL;
+    }
+
+    table = g_malloc0(sizeof(AppleSIOSegmentTable) +
+                      segment_count * sizeof(sio_dma_segment));
+    table->count = segment_count;
+    if (dma_memory_read(&s->dma_as, handle_addr + 0x48, table->segments,
+                        segment_count * sizeof(sio_dma_segment),
+                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        g_free(table);
+        return NULL;
+    }
+    g_hash_table_insert(s->segment_tables, GUINT_TO_POINTER(handle), table);
+    return table;
+}
+
+static AppleSIODMARequest *apple_sio_map_dma(AppleSIOState *s,
+                                             AppleSIODMAEndpoint *ep,
+                                             AppleSIOSegmentTable *table)
+{
+    AppleSIODMARequest *req = g_new0(AppleSIODMARequest, 1);
+
+    qemu_iovec_init(&req->iov, table->count);
+    for (int i = 0; i < table->count; i++) {
+        dma_addr_t base = table->segments[i].addr;
+        dma_addr_t len = table->segments[i].len;
 
         while (len) {
             dma_addr_t xlen = len;
@@ -101,70 +193,77 @@ static void apple_sio_map_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep)
             if (!mem) {
                 qemu_log_mask(LOG_GUEST_ERROR, "%s: unable to map memory\n",
                               __func__);
-                continue;
+                break;
             }
             if (xlen > len) {
                 xlen = len;
             }
-            qemu_iovec_add(&ep->iov, mem, xlen);
+            qemu_iovec_add(&req->iov, mem, xlen);
             len -= xlen;
             base += xlen;
         }
     }
 
-    ep->mapped = true;
-    ep->actual_length = 0;
-    /* TODO: call handler? */
+    return req;
 }
 
-static void apple_sio_unmap_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep)
+static void apple_sio_unmap_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep,
+                                AppleSIODMARequest *req)
 {
-    ep->mapped = false;
-    int unmap_length = ep->actual_length;
-    for (int i = 0; i < ep->iov.niov; i++) {
-        int access_len = ep->iov.iov[i].iov_len;
+    int unmap_length = req->actual_length;
+
+    for (int i = 0; i < req->iov.niov; i++) {
+        int access_len = req->iov.iov[i].iov_len;
         if (access_len > unmap_length) {
             access_len = unmap_length;
         }
 
-        dma_memory_unmap(&s->dma_as, ep->iov.iov[i].iov_base,
-                         ep->iov.iov[i].iov_len, ep->dir,
+        dma_memory_unmap(&s->dma_as, req->iov.iov[i].iov_base,
+                         req->iov.iov[i].iov_len, ep->dir,
                          access_len);
         unmap_length -= access_len;
     }
-    qemu_iovec_destroy(&ep->iov);
-    ep->count = 0;
-    ep->actual_length = 0;
-    ep->tag = 0;
-    g_free(ep->segments);
-    ep->segments = NULL;
-    qemu_sglist_destroy(&ep->sgl);
+    qemu_iovec_destroy(&req->iov);
+    QTAILQ_REMOVE(&ep->requests, req, next);
+    ep->queued--;
+    g_free(req);
+}
+
+static void apple_sio_unmap_all(AppleSIOState *s, AppleSIODMAEndpoint *ep)
+{
+    AppleSIODMARequest *req, *next;
+
+    QTAILQ_FOREACH_SAFE(req, &ep->requests, next, next) {
+        apple_sio_unmap_dma(s, ep, req);
+    }
 }
 
-static void apple_sio_dma_writeback(AppleSIOState *s, AppleSIODMAEndpoint *ep)
+static void apple_sio_dma_writeback(AppleSIOState *s, AppleSIODMAEndpoint *ep,
+                                    AppleSIODMARequest *req)
 {
     sio_msg m = { 0 };
     m.op = DMA_COMPLETE;
     m.ep = ep->id;
     m.param = (1 << 7);
-    m.tag = ep->tag;
-    m.data = ep->actual_length;
-    apple_sio_unmap_dma(s, ep);
+    m.tag = req->tag;
+    m.data = req->actual_length;
+    apple_sio_unmap_dma(s, ep, req);
     apple_mbox_send_message(s->mbox, 1, m.raw);
 }
 
 int apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
 {
     AppleSIOState *s = container_of(ep, AppleSIOState, eps[ep->id]);
+    AppleSIODMARequest *req = QTAILQ_FIRST(&ep->requests);
     int xlen = 0;
-    if (!ep->mapped) {
+    if (!req) {
         return 0;
     }
     assert(ep->dir == DMA_DIRECTION_TO_DEVICE);
-    xlen = qemu_iovec_to_buf(&ep->iov, ep->actual_length, buffer, len);
-    ep->actual_length += xlen;
-    if (ep->actual_length >= ep->iov.size) {
-        apple_sio_dma_writeback(s, ep);
+    xlen = qemu_iovec_to_buf(&req->iov, req->actual_length, buffer, len);
+    req->actual_length += xlen;
+    if (req->actual_length >= req->iov.size) {
+        apple_sio_dma_writeback(s, ep, req);
     }
     return xlen;
 }
@@ -172,21 +271,26 @@ int apple_sio_dma_read(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
 int apple_sio_dma_write(AppleSIODMAEndpoint *ep, void *buffer, size_t len)
 {
     AppleSIOState *s = container_of(ep, AppleSIOState, eps[ep->id]);
+    AppleSIODMARequest *req = QTAILQ_FIRST(&ep->requests);
     int xlen = 0;
-    if (!ep->mapped) {
+    if (!req) {
         return 0;
     }
     assert(ep->dir == DMA_DIRECTION_FROM_DEVICE);
-    xlen = qemu_iovec_from_buf(&ep->iov, ep->actual_length, buffer, len);
-    ep->actual_length += xlen;
-    if (ep->actual_length >= ep->iov.size) {
-        apple_sio_dma_writeback(s, ep);
+    xlen = qemu_iovec_from_buf(&req->iov, req->actual_length, buffer, len);
+    req->actual_length += xlen;
+    if (req->actual_length >= req->iov.size) {
+        apple_sio_dma_writeback(s, ep, req);
     }
     return xlen;
 }
 
 int apple_sio_dma_remaining(AppleSIODMAEndpoint *ep) {
-    return ep->iov.size - ep->actual_length;
+    AppleSIODMARequest *req = QTAILQ_FIRST(&ep->requests);
+    if (!req) {
+        return 0;
+    }
+    return req->iov.size - req->actual_length;
 }
 
 static void apple_sio_control(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg m)
@@ -201,6 +305,9 @@ static void apple_sio_control(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg
         break;
     }
     case SET_PARAM: {
+        if (m.param == DMA_SEGMENT_BASE || m.param == DMA_SEGMENT_SIZE) {
+            g_hash_table_remove_all(s->segment_tables);
+        }
         s->params[m.param] = m.data;
         reply.op = ACK;
         break;
@@ -218,7 +325,8 @@ static void apple_sio_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg m)
     reply.tag = m.tag;
     switch (m.op) {
     case CONFIG_SHIM: {
-        dma_addr_t config_addr = (s->params[DMA_SEGMENT_BASE] << 12) + m.data * 12;
+        dma_addr_t config_addr = apple_sio_handle_addr(s, m.data);
+        apple_sio_invalidate_segments(s, m.data);
         if (dma_memory_read(&s->dma_as, config_addr, &ep->config,
                             sizeof(ep->config),
                             MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
@@ -228,49 +336,40 @@ static void apple_sio_dma(AppleSIOState *s, AppleSIODMAEndpoint *ep, sio_msg m)
         break;
     }
     case START_DMA: {
-        dma_addr_t handle_addr = (s->params[DMA_SEGMENT_BASE] << 12) + m.data * 12;
-        dma_addr_t seg_addr = handle_addr + 0x48;
-        uint32_t segment_count = 0;
-        if (ep->mapped) {
-            qemu_log_mask(LOG_GUEST_ERROR, "SIO: Another DMA is running\n");
+        AppleSIOSegmentTable *table;
+        AppleSIODMARequest *req;
+
+        if (ep->queued >= SIO_MAX_QUEUED_DMA) {
+            qemu_log_mask(LOG_GUEST_ERROR, "SIO: Too many DMAs queued\n");
             reply.op = ERROR;
             break;
         }
-        if (dma_memory_read(&s->dma_as, handle_addr + 0x3C, &segment_count,
-                            sizeof(segment_count),
-                            MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+        table = apple_sio_get_segments(s, m.data);
+        if (!table) {
             return;
         }
-
-        qemu_sglist_init(&ep->sgl, DEVICE(s), segment_count, &s->dma_as);
-        ep->tag = m.tag;
-        ep->count = segment_count;
-        ep->segments = g_new0(sio_dma_segment, segment_count);
-        dma_memory_read(&s->dma_as, seg_addr, ep->segments,
-                        segment_count * sizeof(sio_dma_segment),
-                        MEMTXATTRS_UNSPECIFIED);
-        for (int i = 0; i < segment_count; i++) {
-            qemu_sglist_add(&ep->sgl, ep->segments[i].addr, ep->segments[i].len);
-        }
-        apple_sio_map_dma(s, ep);
+        req = apple_sio_map_dma(s, ep, table);
+        req->tag = m.tag;
+        QTAILQ_INSERT_TAIL(&ep->requests, req, next);
+        ep->queued++;
         reply.op = ACK;
         break;
     }
     case QUERY_DMA:
-        if (!ep->mapped) {
+        if (QTAILQ_EMPTY(&ep->requests)) {
             reply.op = ERROR;
             break;
         }
         reply.op = QUERY_DMA_OK;
-        reply.data = ep->actual_length;
+        reply.data = QTAILQ_FIRST(&ep->requests)->actual_length;
         break;
     case STOP_DMA:
-        if (!ep->mapped) {
+        if (QTAILQ_EMPTY(&ep->requests)) {
             reply.op = ERROR;
             break;
         }
         reply.op = ACK;
-        apple_sio_unmap_dma(s, ep);
+        apple_sio_unmap_all(s, ep);
         break;
     default:
         qemu_log_mask(LOG_UNIMP, "%s: Unknown SIO op: %d\n", __func__, m.op);
@@ -428,7 +527,11 @@ static void apple_sio_realize(DeviceState *dev, Error **errp)
 
     sysbus_realize(SYS_BUS_DEVICE(s->mbox), errp);
 
+    s->segment_tables = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                              NULL, g_free);
+
     for (int i = 0; i < SIO_NUM_EPS; i++) {
+        QTAILQ_INIT(&s->eps[i].requests);
         s->eps[i].id = i;
         s->eps[i].dir = i & 1 ? DMA_DIRECTION_FROM_DEVICE :
                                 DMA_DIRECTION_TO_DEVICE;
@@ -440,6 +543,7 @@ static void apple_sio_unrealize(DeviceState *dev)
     AppleSIOState *s = APPLE_SIO(dev);
 
     qdev_unrealize(DEVICE(s->mbox));
+    g_hash_table_destroy(s->segment_tables);
 }
 
 static void apple_sio_reset(DeviceState *dev)
@@ -448,11 +552,10 @@ static void apple_sio_reset(DeviceState *dev)
 
     s->params[PROTOCOL] = 9;
     for (int i = 0; i < SIO_NUM_EPS; i++) {
-        if (s->eps[i].mapped) {
-            apple_sio_unmap_dma(s, &s->eps[i]);
-        }
+        apple_sio_unmap_all(s, &s->eps[i]);
         memset(&s->eps[i].config, 0, sizeof(s->eps[i].config));
     }
+    g_hash_table_remove_all(s->segment_tables);
     device_cold_reset(DEVICE(s->mbox));
 }
 
@@ -75,29 +75,93 @@
 #define CFG_FUNC1       (INPUT_ENABLE | FUNC_ALT1 |                        INT_MASKED)
 #define CFG_FUNC2       (INPUT_ENABLE | FUNC_ALT2 |                        INT_MASKED)
 
+static AppleGPIOIntMasks *apple_gpio_int_masks(AppleGPIOState *s,
+                                               int irqgrp, int word)
+{
+    return &s->int_masks[irqgrp * s->nwords + word];
+}
+
+/* Latch @bits of @word as pending in @irqgrp */
+static void apple_gpio_set_pending(AppleGPIOState *s, int irqgrp, int word,
+                                   uint32_t bits)
+{
+    uint32_t new = bits & ~s->int_cfg[irqgrp][word];
+    uint32_t was = s->int_pending[irqgrp];
+
+    if (!new) {
+        return;
+    }
+    s->int_cfg[irqgrp][word] |= new;
+    s->int_pending[irqgrp] += ctpop32(new);
+    if (was == 0) {
+        qemu_irq_raise(s->irqs[irqgrp]);
+    }
+}
+
+static void apple_gpio_clear_pending(AppleGPIOState *s, int irqgrp, int word,
+                                     uint32_t bits)
+{
+    uint32_t cleared = bits & s->int_cfg[irqgrp][word];
+
+    if (!cleared) {
+        return;
+    }
+    s->int_cfg[irqgrp][word] &= ~cleared;
+    s->int_pending[irqgrp] -= ctpop32(cleared);
+    if (s->int_pending[irqgrp] == 0) {
+        qemu_irq_lower(s->irqs[irqgrp]);
+    }
+}
+
 static void apple_gpio_update_pincfg(AppleGPIOState *s, int pin, uint32_t value)
 {
+    int word = pin >> 5;
+    uint32_t bit = BIT(pin & 31);
+    uint32_t old = s->gpio_cfg[pin];
+
+    if ((old & INT_MASKED) != INT_MASKED) {
+        AppleGPIOIntMasks *m;
+
+        m = apple_gpio_int_masks(s, (old & INT_MASKED) >> INTR_GRP_SHIFT, word);
+        m->lvl_hi &= ~bit;
+        m->lvl_lo &= ~bit;
+        m->rise &= ~bit;
+        m->fall &= ~bit;
+    }
+
     if ((value & INT_MASKED) != INT_MASKED) {
         int irqgrp = (value & INT_MASKED) >> INTR_GRP_SHIFT;
+        AppleGPIOIntMasks *m = apple_gpio_int_masks(s, irqgrp, word);
 
-        clear_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
+        apple_gpio_clear_pending(s, irqgrp, word, bit);
 
         switch (value & CFG_MASK) {
         case CFG_INT_LVL_HI:
-            if (test_bit(pin, (unsigned long *)s->in)) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
+            m->lvl_hi |= bit;
+            apple_gpio_set_pending(s, irqgrp, word, s->in[word] & bit);
             break;
 
         case CFG_INT_LVL_LO:
-            if (!test_bit(pin, (unsigned long *)s->in)) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
+            m->lvl_lo |= bit;
+            apple_gpio_set_pending(s, irqgrp, word, ~s->in[word] & bit);
+            break;
+
+        case CFG_INT_EDG_RIS:
+            m->rise |= bit;
+            break;
+
+        case CFG_INT_EDG_FAL:
+            m->fall |= bit;
+            break;
+
+        case CFG_INT_EDG_ANY:
+            m->rise |= bit;
+            m->fall |= bit;
             break;
+
         default:
             break;
         }
-        qemu_set_irq(s->irqs[irqgrp], find_first_bit((unsigned long *)s->int_cfg[irqgrp], s->npins) != s->npins);
     }
 
     s->gpio_cfg[pin] = value;
@@ -122,73 +186,54 @@ static void apple_gpio_update_pincfg(AppleGPIOState *s, int pin, uint32_t value)
     }
 }
 
-
-static void apple_gpio_set(void *opaque, int pin, int level)
+static void apple_gpio_update_word(AppleGPIOState *s, unsigned int word,
+                                   uint32_t mask, uint32_t level)
 {
-    AppleGPIOState *s = APPLE_GPIO(opaque);
-    int grp;
-    int irqgrp = -1;
-
-    if (pin >= s->npins) {
-        return;
-    }
+    uint32_t old = s->old_in[word];
+    uint32_t in = (s->in[word] & ~mask) | (level & mask);
+    uint32_t rising = ~old & in & mask;
+    uint32_t falling = old & ~in & mask;
+    int i;
 
-    level = level != 0;
-    if (level) {
-        set_bit(pin, (unsigned long *)s->in);
-    } else {
-        clear_bit(pin, (unsigned long *)s->in);
-    }
+    s->in[word] = in;
 
-    grp = pin >> 5;
-    if ((s->gpio_cfg[pin] & INT_MASKED) != INT_MASKED) {
-        irqgrp = (s->gpio_cfg[pin] & INT_MASKED) >> INTR_GRP_SHIFT;
+    for (i = 0; i < s->nirqgrps; i++) {
+        AppleGPIOIntMasks *m = apple_gpio_int_masks(s, i, word);
+        uint32_t bits;
 
-        switch (s->gpio_cfg[pin] & CFG_MASK) {
-        case CFG_GP_IN:
-        case CFG_GP_OUT:
-            break;
+        bits = (mask & ((in & m->lvl_hi) | (~in & m->lvl_lo)))
+               | (rising & m->rise) | (falling & m->fall);
+        apple_gpio_set_pending(s, i, word, bits);
+    }
 
-        case CFG_INT_LVL_HI:
-            if (level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
+    s->old_in[word] = in;
+}
 
-        case CFG_INT_LVL_LO:
-            if (!level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
+void apple_gpio_set_word(DeviceState *dev, unsigned int word, uint32_t mask,
+                         uint32_t level)
+{
+    AppleGPIOState *s = APPLE_GPIO(dev);
 
-        case CFG_INT_EDG_RIS:
-            if (test_bit(pin, (unsigned long *)s->old_in) == 0 && level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
+    if (word >= s->nwords) {
+        return;
+    }
+    if (word == s->nwords - 1 && (s->npins & 31)) {
+        mask &= BIT(s->npins & 31) - 1;
+    }
 
-        case CFG_INT_EDG_FAL:
-            if (test_bit(pin, (unsigned long *)s->old_in) && !level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
+    apple_gpio_update_word(s, word, mask, level);
+}
 
-        case CFG_INT_EDG_ANY:
-            if (test_bit(pin, (unsigned long *)s->old_in) != level) {
-                set_bit(pin, (unsigned long *)s->int_cfg[irqgrp]);
-            }
-            break;
+static void apple_gpio_set(void *opaque, int pin, int level)
+{
+    AppleGPIOState *s = APPLE_GPIO(opaque);
+    uint32_t bit = BIT(pin & 31);
 
-        default:
-            break;
-        }
+    if (pin >= s->npins) {
+        return;
     }
 
-    s->old_in[grp] = s->in[grp];
-
-    if (irqgrp != -1) {
-        qemu_set_irq(s->irqs[irqgrp], find_first_bit((unsigned long *)s->int_cfg[irqgrp], s->npins) != s->npins);
-    }
+    apple_gpio_update_word(s, pin >> 5, bit, level ? bit : 0);
 }
 
 static void apple_gpio_realize(DeviceState *dev, Error **errp)
@@ -205,6 +250,10 @@ static void apple_gpio_realize(DeviceState *dev, Error **errp)
 
     s->old_in = g_new0(uint32_t, (s->npins + 63) >> 5);
     s->in = g_new0(uint32_t, (s->npins + 63) >> 5);
+
+    s->nwords = (s->npins + 31) >> 5;
+    s->int_masks = g_new0(AppleGPIOIntMasks, s->nirqgrps * s->nwords);
+    s->int_pending = g_new0(uint32_t, s->nirqgrps);
 }
 
 static void apple_gpio_reset(DeviceState *dev)
@@ -218,7 +267,11 @@ static void apple_gpio_reset(DeviceState *dev)
 
     for (i = 0; i < s->nirqgrps; i++) {
         memset(s->int_cfg[i], 0, 4 * s->npins);
+        s->int_pending[i] = 0;
+        qemu_irq_lower(s->irqs[i]);
     }
+    memset(s->int_masks, 0,
+           sizeof(AppleGPIOIntMasks) * s->nirqgrps * s->nwords);
 
     memset(s->old_in, 0, 4 * ((s->npins + 31) >> 5));
     memset(s->in, 0, 4 * ((s->npins + 31) >> 5));
@@ -268,11 +321,10 @@ static void apple_gpio_int_write(AppleGPIOState *s, unsigned int group,
     }
 
     offset = addr - rGPIOINT(group, 0);
-    s->int_cfg[group][offset >> 2] &= ~value;
-
-    if (find_first_bit((unsigned long *)s->int_cfg[group], s->npins) == s->npins) {
-        qemu_irq_lower(s->irqs[group]);
+    if ((offset >> 2) >= s->nwords) {
+        return;
     }
+    apple_gpio_clear_pending(s, group, offset >> 2, value);
 }
 
 static uint32_t apple_gpio_int_read(AppleGPIOState *s,
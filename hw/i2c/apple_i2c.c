@@ -9,6 +9,9 @@
 #include "qemu/module.h"
 #include "qemu/timer.h"
 #include "hw/arm/xnu_dtb.h"
+#include "hw/qdev-properties.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 
 //#define DEBUG_APPLE_I2C
 
@@ -107,85 +110,149 @@ static void apple_i2c_update_irq(AppleI2CState *s)
     }
 }
 
+static void apple_i2c_trace_end(AppleI2CState *s, bool nak)
+{
+    AppleI2CTraceEntry *e;
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    s->trace_count++;
+    s->total_bytes += s->xfer_tx + s->xfer_rx;
+    s->busy_ns += now - s->xfer_start_ns;
+
+    if (s->trace_depth) {
+        e = &s->trace[s->trace_head];
+        e->start_ns = s->xfer_start_ns;
+        e->end_ns = now;
+        e->tx_len = s->xfer_tx;
+        e->rx_len = s->xfer_rx;
+        e->addr = s->addr;
+        e->nak = nak;
+        s->trace_head = (s->trace_head + 1) % s->trace_depth;
+    }
+}
+
+/* Execute one Tx FIFO entry against the bus */
+static void apple_i2c_xfer_cmd(AppleI2CState *s, uint32_t value)
+{
+    DeviceState *dev = DEVICE(s);
+
+    if ((value & kMTXFIFOStart)) {
+        s->addr = kMTXFIFOData(value) >> 1;
+        s->is_recv = kMTXFIFOData(value) & 1;
+        /* A repeated Start carries on with the transaction up to Stop */
+        if (!s->xip) {
+            s->xfer_start_ns = s->cmds_ns;
+            s->xfer_tx = s->xfer_rx = 0;
+        }
+        if (i2c_start_transfer(s->bus, s->addr, s->is_recv) != 0) {
+            qemu_log_mask(LOG_GUEST_ERROR,
+                          "%s: can't find device @ 0x%x\n", dev->id, s->addr);
+            REG(s, rSMSTA) |= kSMSTAmtn;
+            s->xip = false;
+            apple_i2c_trace_end(s, true);
+            return;
+        }
+
+        s->xip = true;
+        REG(s, rSMSTA) |= kSMSTAxip;
+    } else if (s->xip) {
+        if (value & kMTXFIFORead) {
+            uint8_t len = kMTXFIFOData(value);
+            if (!s->is_recv) {
+                s->is_recv = 1;
+                if (i2c_start_transfer(s->bus, s->addr, s->is_recv) != 0) {
+                    REG(s, rSMSTA) |= kSMSTAmtn;
+                    return;
+                }
+            }
+            while (len-- && !fifo8_is_full(&s->rx_fifo)) {
+                fifo8_push(&s->rx_fifo, i2c_recv(s->bus));
+                s->xfer_rx++;
+            }
+            if (kMTXFIFOData(value) > 0) {
+                REG(s, rSMSTA) |= (kSMSTAmrne);
+                if (kMTXFIFOData(value) >= kRDCOUNT(REG(s, rRDCOUNT))) {
+                    REG(s, rSMSTA) |= (kSMSTAmrf);
+                }
+            }
+        } else {
+            if (s->is_recv) {
+                s->is_recv = 0;
+                if (i2c_start_transfer(s->bus, s->addr, s->is_recv) != 0) {
+                    REG(s, rSMSTA) |= kSMSTAmtn;
+                    return;
+                }
+            }
+            s->xfer_tx++;
+            if (i2c_send(s->bus, kMTXFIFOData(value))) {
+                REG(s, rSMSTA) |= kSMSTAmtn;
+                /* XXX: Should we end it here? */
+            }
+        }
+    }
+    if (value & kMTXFIFOStop) {
+        if (s->xip) {
+            i2c_end_transfer(s->bus);
+            s->xip = false;
+            apple_i2c_trace_end(s, REG(s, rSMSTA) & kSMSTAmtn);
+            REG(s, rSMSTA) |= kSMSTAxen;
+        }
+    }
+}
+
+/*
+ * Run the queued Tx FIFO entries as one transaction. Status bits are set
+ * in bus order (data, NAK, then transaction end) and the interrupt line
+ * is evaluated once for the lot.
+ */
+static void apple_i2c_flush_cmds(AppleI2CState *s)
+{
+    uint32_t i;
+
+    if (s->ncmds == 0) {
+        return;
+    }
+    for (i = 0; i < s->ncmds; i++) {
+        apple_i2c_xfer_cmd(s, s->cmds[i]);
+    }
+    s->ncmds = 0;
+    apple_i2c_update_irq(s);
+}
+
 static void apple_i2c_reg_write(void *opaque,
                   hwaddr addr,
                   uint64_t data,
                   unsigned size)
 {
     AppleI2CState *s = APPLE_I2C(opaque);
-    DeviceState *dev = DEVICE(opaque);
     #ifdef DEBUG_APPLE_I2C
+    DeviceState *dev = DEVICE(opaque);
     qemu_log_mask(LOG_UNIMP, "%s: reg WRITE @ 0x" TARGET_FMT_plx
                              " value: 0x" TARGET_FMT_plx "\n", dev->id, addr, data);
     #endif
 
     uint32_t *mmio = (uint32_t *)&s->reg[addr];
     uint32_t value = data;
-    uint32_t orig = *mmio;
+    uint32_t orig;
     bool iflg = false;
 
-    switch (addr) {
-    case rMTXFIFO: {
-        uint8_t addr = kMTXFIFOData(value) >> 1;
-        iflg = true;
-        if ((value & kMTXFIFOStart)) {
-
-            if (kMTXFIFOData(value) & 1) {
-                s->is_recv = true;
-            } else {
-                s->is_recv = false;
-            }
-            if (i2c_start_transfer(s->bus, addr, s->is_recv) != 0) {
-                qemu_log_mask(LOG_GUEST_ERROR,
-                              "%s: can't find device @ 0x%x\n", dev->id, addr);
-                REG(s, rSMSTA) |= kSMSTAmtn;
-                break;
-            }
+    if (addr != rMTXFIFO) {
+        /* Anything else may depend on the outcome of queued entries */
+        apple_i2c_flush_cmds(s);
+    }
+    orig = *mmio;
 
-            s->xip = true;
-            REG(s, rSMSTA) |= kSMSTAxip;
-        } else if (s->xip) {
-            if (value & kMTXFIFORead) {
-                uint8_t len = kMTXFIFOData(value);
-                if (!s->is_recv) {
-                    s->is_recv = 1;
-                    if (i2c_start_transfer(s->bus, addr, s->is_recv) != 0) {
-                        REG(s, rSMSTA) |= kSMSTAmtn;
-                        break;
-                    }
-                }
-                while (len--) {
-                    fifo8_push(&s->rx_fifo, i2c_recv(s->bus));
-                }
-                if (kMTXFIFOData(value) > 0) {
-                    REG(s, rSMSTA) |= (kSMSTAmrne);
-                    if (kMTXFIFOData(value) >= kRDCOUNT(REG(s, rRDCOUNT))) {
-                        REG(s, rSMSTA) |= (kSMSTAmrf);
-                    }
-                }
-            } else {
-                if (s->is_recv) {
-                    s->is_recv = 0;
-                    if (i2c_start_transfer(s->bus, addr, s->is_recv) != 0) {
-                        REG(s, rSMSTA) |= kSMSTAmtn;
-                        break;
-                    }
-                }
-                if (i2c_send(s->bus, kMTXFIFOData(value))) {
-                    REG(s, rSMSTA) |= kSMSTAmtn;
-                    /* XXX: Should we end it here? */
-                }
-            }
+    switch (addr) {
+    case rMTXFIFO:
+        if (s->ncmds == 0) {
+            /* Trace the time the guest spends on the whole transaction */
+            s->cmds_ns = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
         }
-        if (value & kMTXFIFOStop) {
-            if (s->xip) {
-                i2c_end_transfer(s->bus);
-                REG(s, rSMSTA) |= kSMSTAxen;
-                s->xip = false;
-            }
+        s->cmds[s->ncmds++] = value;
+        if ((value & kMTXFIFOStop) || s->ncmds == APPLE_I2C_CMD_QUEUE) {
+            apple_i2c_flush_cmds(s);
         }
-        break;
-    }
+        return;
     case rSMSTA:
         value = orig & (~value);
         iflg = true;
@@ -215,7 +282,10 @@ static uint64_t apple_i2c_reg_read(void *opaque,
 {
     AppleI2CState *s = APPLE_I2C(opaque);
     uint32_t *mmio = (uint32_t *)&s->reg[addr];
-    uint32_t value = *mmio;
+    uint32_t value;
+
+    apple_i2c_flush_cmds(s);
+    value = *mmio;
 
     switch (addr) {
     case rMRXFIFO:
@@ -261,6 +331,8 @@ static void apple_i2c_reset_enter(Object *obj, ResetType type)
     }
     memset(s->reg, 0, sizeof(s->reg));
     s->nak = s->xip = s->is_recv = 0;
+    s->addr = 0;
+    s->ncmds = 0;
     fifo8_reset(&s->rx_fifo);
 }
 
@@ -313,10 +385,96 @@ SysBusDevice *apple_i2c_create(const char *name)
     return sbd;
 }
 
+static void apple_i2c_get_trace(Object *obj, Visitor *v, const char *name,
+                                void *opaque, Error **errp)
+{
+    AppleI2CState *s = APPLE_I2C(obj);
+    Error *err = NULL;
+    uint32_t n = MIN(s->trace_count, s->trace_depth);
+    uint32_t i;
+
+    if (!visit_start_struct(v, name, NULL, 0, &err)) {
+        goto out;
+    }
+    if (!visit_type_uint64(v, "transactions", &s->trace_count, &err)) {
+        goto out_end;
+    }
+    if (!visit_type_uint64(v, "bytes", &s->total_bytes, &err)) {
+        goto out_end;
+    }
+    if (!visit_type_uint64(v, "busy-ns", &s->busy_ns, &err)) {
+        goto out_end;
+    }
+
+    /* Oldest first */
+    if (!visit_start_list(v, "entries", NULL, 0, &err)) {
+        goto out_end;
+    }
+    for (i = 0; i < n; i++) {
+        AppleI2CTraceEntry *e;
+        uint32_t addr;
+        bool ok;
+
+        e = &s->trace[(s->trace_head + s->trace_depth - n + i)
+                      % s->trace_depth];
+        addr = e->addr;
+        if (!visit_start_struct(v, NULL, NULL, 0, &err)) {
+            goto out_list;
+        }
+        ok = visit_type_uint32(v, "addr", &addr, &err) &&
+             visit_type_int64(v, "start-ns", &e->start_ns, &err) &&
+             visit_type_int64(v, "end-ns", &e->end_ns, &err) &&
+             visit_type_uint32(v, "tx", &e->tx_len, &err) &&
+             visit_type_uint32(v, "rx", &e->rx_len, &err) &&
+             visit_type_bool(v, "nak", &e->nak, &err);
+        if (ok) {
+            visit_check_struct(v, &err);
+        }
+        visit_end_struct(v, NULL);
+        if (err) {
+            goto out_list;
+        }
+    }
+    visit_check_list(v, &err);
+out_list:
+    visit_end_list(v, NULL);
+
+    if (!err) {
+        visit_check_struct(v, &err);
+    }
+out_end:
+    visit_end_struct(v, NULL);
+out:
+    error_propagate(errp, err);
+}
+
+static void apple_i2c_realize(DeviceState *dev, Error **errp)
+{
+    AppleI2CState *s = APPLE_I2C(dev);
+
+    if (s->trace_depth) {
+        s->trace = g_new0(AppleI2CTraceEntry, s->trace_depth);
+    }
+}
+
+static Property apple_i2c_properties[] = {
+    DEFINE_PROP_UINT32("trace-depth", AppleI2CState, trace_depth, 256),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
+static int apple_i2c_pre_save(void *opaque)
+{
+    /* Queued Tx FIFO entries are not migrated */
+    apple_i2c_flush_cmds(APPLE_I2C(opaque));
+
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_i2c = {
     .name = "apple_i2c",
-    .version_id = 1,
+    .version_id = 2,
     .minimum_version_id = 1,
+    .pre_save = apple_i2c_pre_save,
     .fields = (VMStateField[]) {
         VMSTATE_UINT8_ARRAY(reg, AppleI2CState, APPLE_I2C_MMIO_SIZE),
         VMSTATE_FIFO8(rx_fifo, AppleI2CState),
@@ -324,6 +482,7 @@ static const VMStateDescription vmstate_apple_i2c = {
         VMSTATE_BOOL(nak, AppleI2CState),
         VMSTATE_BOOL(xip, AppleI2CState),
         VMSTATE_BOOL(is_recv, AppleI2CState),
+        VMSTATE_UINT8_V(addr, AppleI2CState, 2),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -336,6 +495,10 @@ static void apple_i2c_class_init(ObjectClass *klass, void *data)
 
     dc->desc = "Apple I2C Controller";
     dc->vmsd = &vmstate_apple_i2c;
+    dc->realize = apple_i2c_realize;
+    device_class_set_props(dc, apple_i2c_properties);
+    object_class_property_add(klass, "trace", "AppleI2CTrace",
+                              apple_i2c_get_trace, NULL, NULL, NULL);
     resettable_class_set_parent_phases(rc, apple_i2c_reset_enter,
                                        apple_i2c_reset_hold,
                                        apple_i2c_reset_exit,
@@ -2,6 +2,7 @@
 #include "hw/intc/apple_aic.h"
 #include "trace.h"
 #include "hw/irq.h"
+#include "hw/core/cpu.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/lockable.h"
@@ -531,6 +532,44 @@ static const MemoryRegionOps apple_aic_ops = {
     .valid.unaligned = false,
 };
 
+/*
+ * The banked window is mapped once in the shared system address space and
+ * routes each access to the register bank of the CPU that issued it.
+ * Accesses that do not come from a CPU (e.g. the gdbstub) see CPU 0.
+ */
+static AppleAICCPU *apple_aic_current_cpu(AppleAICState *s)
+{
+    if (current_cpu && current_cpu->cpu_index < s->numCPU) {
+        return &s->cpus[current_cpu->cpu_index];
+    }
+    return &s->cpus[0];
+}
+
+static void apple_aic_banked_write(void *opaque, hwaddr addr, uint64_t data,
+                                   unsigned size)
+{
+    apple_aic_write(apple_aic_current_cpu(APPLE_AIC(opaque)), addr, data,
+                    size);
+}
+
+static uint64_t apple_aic_banked_read(void *opaque, hwaddr addr,
+                                      unsigned size)
+{
+    return apple_aic_read(apple_aic_current_cpu(APPLE_AIC(opaque)), addr,
+                          size);
+}
+
+static const MemoryRegionOps apple_aic_banked_ops = {
+    .read = apple_aic_banked_read,
+    .write = apple_aic_banked_write,
+    .endianness = DEVICE_NATIVE_ENDIAN,
+    .impl.min_access_size = 4,
+    .impl.max_access_size = 4,
+    .valid.min_access_size = 4,
+    .valid.max_access_size = 4,
+    .valid.unaligned = false,
+};
+
 static void apple_aic_realize(DeviceState *dev, struct Error **errp)
 {
     AppleAICState *s = APPLE_AIC(dev);
@@ -550,6 +589,9 @@ static void apple_aic_realize(DeviceState *dev, struct Error **errp)
         sysbus_init_mmio(sbd, &cpu->iomem);
         sysbus_init_irq(sbd, &cpu->irq);
     }
+    memory_region_init_io(&s->iomem_banked, OBJECT(dev), &apple_aic_banked_ops,
+                          s, TYPE_APPLE_AIC ".banked", s->base_size);
+    sysbus_init_mmio(sbd, &s->iomem_banked);
 
     qdev_init_gpio_in(dev, apple_aic_set_irq, s->numIRQ);
 
@@ -1,13 +1,16 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qjson.h"
 #include "hw/misc/apple_smc.h"
 #include "hw/misc/apple_mbox.h"
 #include "hw/irq.h"
+#include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
+#include "qemu/bswap.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
-#include "qemu/queue.h"
 #include "sysemu/runstate.h"
 #include "hw/arm/xnu.h"
 #include "hw/arm/xnu_dtb.h"
@@ -26,11 +29,6 @@ do { qemu_log_mask(LOG_GUEST_ERROR, "SMC: message:" \
 #define SMC_LOG_MSG(ep, msg) do {} while (0)
 #endif
 
-#define SMC_MAKE_IDENTIFIER(A, B, C, D)  \
-((uint32_t)(((uint32_t)(A) << 24U) | ((uint32_t)(B) << 16U) | \
-                                     ((uint32_t)(C) << 8U) | (uint32_t)(D)))
-#define SMC_MAKE_KEY_TYPE(A, B, C, D) SMC_MAKE_IDENTIFIER ((A), (B), (C), (D))
-
 enum {
     SmcKeyTypeFlag = SMC_MAKE_KEY_TYPE('f', 'l', 'a', 'g'),
     SmcKeyTypeHex = SMC_MAKE_KEY_TYPE('h', 'e', 'x', '_'),
@@ -60,7 +58,9 @@ enum smc_command {
     SMC_GET_KEY_INFO = 0x13,
     SMC_GET_SRAM_ADDR = 0x17,
     SMC_NOTIFICATION = 0x18,
-    SMC_READ_KEY_PAYLOAD = 0x20
+    SMC_READ_KEY_PAYLOAD = 0x20,
+    /* QEMU extension, not implemented by SMC firmware */
+    SMC_READ_KEY_BATCH = 0xe0,
 };
 
 enum smc_result {
@@ -128,9 +128,18 @@ typedef struct QEMU_PACKED smc_key_info {
     uint8_t attr;
 } smc_key_info;
 
-enum smc_attr {
-    SMC_ATTR_LITTLE_ENDIAN = (1 << 2),
-};
+/*
+ * SMC_READ_KEY_BATCH: the request carries the number of keys in length
+ * and their names in SRAM. Every key is answered in SRAM with one of
+ * these, packed back to back. The response carries the number of keys
+ * answered in length and the bytes used in response.
+ */
+typedef struct QEMU_PACKED smc_batch_entry {
+    uint32_t key;
+    uint8_t status;
+    uint8_t size;
+    uint8_t data[];
+} smc_batch_entry;
 
 typedef struct smc_key smc_key;
 
@@ -144,42 +153,83 @@ struct smc_key {
     smc_key_info info;
     void *data;
 
-    QTAILQ_ENTRY(smc_key) entry;
     KeyReader read;
     KeyWriter write;
+    /* Dynamic keys are computed on read straight into the response */
+    AppleSMCKeyGetter get;
+    void *opaque;
 };
 
 struct AppleSMCState {
     SysBusDevice parent_obj;
     MemoryRegion *iomems[3];
     AppleMboxState *mbox;
-    QTAILQ_HEAD(, smc_key) keys;
-    uint32_t key_count;
+    /* Keys in name order for index lookups, and hashed by name */
+    GPtrArray *keys;
+    GHashTable *key_table;
+    bool keys_sorted;
+    char *key_db;
     uint64_t sram_addr;
     uint8_t sram[0x4000];
 };
 
+static void smc_key_free(gpointer data)
+{
+    smc_key *k = data;
+
+    g_free(k->data);
+    g_free(k);
+}
+
+static gint smc_key_compare(gconstpointer a, gconstpointer b)
+{
+    const smc_key *ka = *(smc_key * const *)a;
+    const smc_key *kb = *(smc_key * const *)b;
+
+    return ka->key < kb->key ? -1 : ka->key > kb->key;
+}
+
 static smc_key *smc_get_key(AppleSMCState *s, uint32_t key)
 {
-    smc_key *d;
-    QTAILQ_FOREACH(d, &s->keys, entry) {
-        if (d->key == key) {
-            return d;
-        }
+    return g_hash_table_lookup(s->key_table, GUINT_TO_POINTER(key));
+}
+
+static smc_key *smc_get_key_by_index(AppleSMCState *s, uint32_t idx)
+{
+    if (idx >= s->keys->len) {
+        return NULL;
+    }
+    /* Keys added out of order are only sorted once someone enumerates */
+    if (!s->keys_sorted) {
+        g_ptr_array_sort(s->keys, smc_key_compare);
+        s->keys_sorted = true;
     }
-    return NULL;
+    return g_ptr_array_index(s->keys, idx);
 }
 
-static smc_key *smc_create_key(AppleSMCState *s, uint32_t key, uint32_t size,
-                               uint32_t type, uint32_t attr, void *data)
+static smc_key *smc_lookup_or_add_key(AppleSMCState *s, uint32_t key)
 {
     smc_key *k = smc_get_key(s, key);
+
     if (!k) {
         k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
+        k->key = key;
+        if (s->keys->len
+            && ((smc_key *)g_ptr_array_index(s->keys,
+                                             s->keys->len - 1))->key > key) {
+            s->keys_sorted = false;
+        }
+        g_ptr_array_add(s->keys, k);
+        g_hash_table_insert(s->key_table, GUINT_TO_POINTER(key), k);
     }
-    k->key = key;
+    return k;
+}
+
+static smc_key *smc_create_key(AppleSMCState *s, uint32_t key, uint32_t size,
+                               uint32_t type, uint32_t attr, void *data)
+{
+    smc_key *k = smc_lookup_or_add_key(s, key);
+
     k->info.size = size;
     k->info.type = type;
     k->info.attr = attr;
@@ -192,13 +242,8 @@ static smc_key *smc_create_key_func(AppleSMCState *s, uint32_t key,
                                     uint32_t size, uint32_t type, uint32_t attr,
                                     KeyReader reader, KeyWriter writer)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_lookup_or_add_key(s, key);
+
     k->info.size = size;
     k->info.type = type;
     k->info.attr = attr;
@@ -211,13 +256,8 @@ static smc_key *smc_create_key_func(AppleSMCState *s, uint32_t key,
 static smc_key *smc_set_key(AppleSMCState *s, uint32_t key, uint32_t size,
                             void *data)
 {
-    smc_key *k = smc_get_key(s, key);
-    if (!k) {
-        k = g_new0(smc_key, 1);
-        QTAILQ_INSERT_TAIL(&s->keys, k, entry);
-        s->key_count++;
-    }
-    k->key = key;
+    smc_key *k = smc_lookup_or_add_key(s, key);
+
     k->info.size = size;
     k->data = g_realloc(k->data, size);
     memcpy(k->data, data, size);
@@ -236,6 +276,19 @@ static uint8_t smc_key_reject_write(AppleSMCState *s, smc_key *k,
     return kSMCKeyNotWritable;
 }
 
+static smc_key *smc_create_key_dynamic(AppleSMCState *s, uint32_t key,
+                                       uint32_t size, uint32_t type,
+                                       uint32_t attr, AppleSMCKeyGetter get,
+                                       void *opaque)
+{
+    smc_key *k = smc_create_key_func(s, key, size, type, attr,
+                                     NULL, &smc_key_reject_write);
+
+    k->get = get;
+    k->opaque = opaque;
+    return k;
+}
+
 static uint8_t G_GNUC_UNUSED smc_key_noop_read(AppleSMCState *s, smc_key *k,
                                                void *payload, uint8_t length)
 {
@@ -249,13 +302,24 @@ static uint8_t G_GNUC_UNUSED smc_key_copy_write(AppleSMCState *s, smc_key *k,
     return kSMCSuccess;
 }
 
-static uint8_t smc_key_count_read(AppleSMCState *s, smc_key *k,
-                                  void *payload, uint8_t length)
+static bool smc_key_count_get(void *opaque, uint32_t key, void *data,
+                              uint8_t size)
 {
-    k->info.size = 4;
-    k->data = g_realloc(k->data, 4);
-    *(uint32_t *)k->data = s->key_count;
-    return kSMCSuccess;
+    AppleSMCState *s = opaque;
+
+    stl_le_p(data, s->keys->len);
+    return true;
+}
+
+static void smc_send_notification(AppleSMCState *s, uint8_t type,
+                                  uint8_t event)
+{
+    key_response r = { 0 };
+
+    r.status = SMC_NOTIFICATION;
+    r.response[2] = event;
+    r.response[3] = type;
+    apple_mbox_send_message(s->mbox, kSMCKeyEndpoint, r.raw);
 }
 
 static uint8_t smc_key_mbse_write(AppleSMCState *s, smc_key *k,
@@ -286,22 +350,14 @@ static uint8_t smc_key_mbse_write(AppleSMCState *s, smc_key *k,
         return kSMCSuccess;
     case SMC_MAKE_IDENTIFIER('s', 'l', 'p', 'w'):
         return kSMCSuccess;
-    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'b'): {
-        key_response r = { 0 };
-        r.status = SMC_NOTIFICATION;
-        r.response[2] = kSMCNotifySMCPanicProgress;
-        r.response[3] = kSMCSystemStateNotify;
-        apple_mbox_send_message(s->mbox, kSMCKeyEndpoint, r.raw);
+    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'b'):
+        smc_send_notification(s, kSMCSystemStateNotify,
+                              kSMCNotifySMCPanicProgress);
         return kSMCSuccess;
-    }
-    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'e'): {
-        key_response r = { 0 };
-        r.status = SMC_NOTIFICATION;
-        r.response[2] = kSMCNotifySMCPanicDone;
-        r.response[3] = kSMCSystemStateNotify;
-        apple_mbox_send_message(s->mbox, kSMCKeyEndpoint, r.raw);
+    case SMC_MAKE_IDENTIFIER('p', 'a', 'n', 'e'):
+        smc_send_notification(s, kSMCSystemStateNotify,
+                              kSMCNotifySMCPanicDone);
         return kSMCSuccess;
-    }
     default:
         return kSMCBadFuncParameter;
     }
@@ -335,6 +391,82 @@ static uint8_t smc_key_nesn_write(AppleSMCState *s, smc_key *k,
     return kSMCSuccess;
 }
 
+/*
+ * Put the value of @k at @dst. Dynamic keys are evaluated there
+ * directly; static ones are copied out of k->data.
+ */
+static uint8_t smc_key_value(smc_key *k, void *dst)
+{
+    if (k->get) {
+        return k->get(k->opaque, k->key, dst, k->info.size)
+               ? kSMCSuccess : kSMCKeyNotReadable;
+    }
+    memcpy(dst, k->data, k->info.size);
+    return kSMCSuccess;
+}
+
+/*
+ * Run the key's reader and answer @r with its value: in the response
+ * word if it fits, in SRAM otherwise. Readers may resize the key, so
+ * the size is only taken once they ran.
+ */
+static void smc_read_key(AppleSMCState *s, smc_key *k, void *payload,
+                         uint8_t length, key_response *r)
+{
+    if (k->read) {
+        r->status = k->read(s, k, payload, length);
+        if (r->status != kSMCSuccess) {
+            return;
+        }
+    }
+    r->status = smc_key_value(k, k->info.size <= sizeof(r->response)
+                                 ? r->response : s->sram);
+    if (r->status == kSMCSuccess) {
+        r->length = k->info.size;
+    }
+}
+
+static void smc_read_key_batch(AppleSMCState *s, uint8_t count,
+                               key_response *r)
+{
+    uint32_t keys[UINT8_MAX];
+    uint32_t off = 0;
+    int i;
+
+    /* The answers overwrite the names */
+    memcpy(keys, s->sram, count * sizeof(keys[0]));
+    for (i = 0; i < count; i++) {
+        smc_batch_entry *e = (smc_batch_entry *)&s->sram[off];
+        uint32_t avail = sizeof(s->sram) - off;
+        smc_key *k = smc_get_key(s, keys[i]);
+
+        if (avail < sizeof(*e)) {
+            break;
+        }
+        e->key = keys[i];
+        e->size = 0;
+        if (!k) {
+            e->status = kSMCKeyNotFound;
+        } else {
+            e->status = k->read ? k->read(s, k, NULL, 0) : kSMCSuccess;
+            if (e->status == kSMCSuccess) {
+                if (k->info.size > avail - sizeof(*e)) {
+                    break;
+                }
+                e->status = smc_key_value(k, e->data);
+                if (e->status == kSMCSuccess) {
+                    e->size = k->info.size;
+                }
+            }
+        }
+        off += sizeof(*e) + e->size;
+    }
+
+    r->status = kSMCSuccess;
+    r->length = i;
+    stl_le_p(r->response, off);
+}
+
 static void apple_smc_handle_key_endpoint(void *opaque,
                                           uint32_t ep,
                                           uint64_t msg)
@@ -354,23 +486,20 @@ static void apple_smc_handle_key_endpoint(void *opaque,
         if (!k) {
             r.status = kSMCKeyNotFound;
         } else {
-            if (k->read) {
-                r.status = k->read(s, k, s->sram, kmsg->payload_length);
-            }
-            if (r.status == kSMCSuccess) {
-                r.length = k->info.size;
-                if (k->info.size <= 4) {
-                    memcpy(r.response, k->data, k->info.size);
-                } else {
-                    memcpy(s->sram, k->data, k->info.size);
-                }
-                r.status = kSMCSuccess;
-            }
+            smc_read_key(s, k, s->sram, kmsg->payload_length, &r);
         }
         r.ui8TagAndId = kmsg->ui8TagAndId;
         apple_mbox_send_message(s->mbox, ep, r.raw);
         break;
     }
+    case SMC_READ_KEY_BATCH: {
+        key_response r = { 0 };
+
+        smc_read_key_batch(s, kmsg->length, &r);
+        r.ui8TagAndId = kmsg->ui8TagAndId;
+        apple_mbox_send_message(s->mbox, ep, r.raw);
+        break;
+    }
     case SMC_WRITE_KEY: {
         smc_key *k = smc_get_key(s, kmsg->key);
         key_response r = { 0 };
@@ -387,12 +516,7 @@ static void apple_smc_handle_key_endpoint(void *opaque,
     }
     case SMC_GET_KEY_BY_INDEX: {
         key_response r = { 0 };
-        uint32_t idx = kmsg->key;
-        smc_key *k = QTAILQ_FIRST(&s->keys);
-
-        for (int i = 0; i < idx && k; i++) {
-            k = QTAILQ_NEXT(k, entry);
-        }
+        smc_key *k = smc_get_key_by_index(s, kmsg->key);
 
         if (!k) {
             r.status = kSMCKeyIndexRangeError;
@@ -429,6 +553,14 @@ static void apple_smc_handle_key_endpoint(void *opaque,
     }
 }
 
+void apple_smc_add_dynamic_key(SysBusDevice *sbd, uint32_t key, uint8_t size,
+                               uint32_t type, uint8_t attr,
+                               AppleSMCKeyGetter get, void *opaque)
+{
+    smc_create_key_dynamic(APPLE_SMC_IOP(sbd), key, size, type, attr,
+                           get, opaque);
+}
+
 static void ascv2_core_reg_write(void *opaque, hwaddr addr,
                   uint64_t data,
                   unsigned size)
@@ -517,20 +649,141 @@ SysBusDevice *apple_smc_create(DTBNode *node, uint32_t protocol_version)
     set_dtb_prop(child, "pre-loaded", 4, (uint8_t *)&data);
     set_dtb_prop(child, "running", 4, (uint8_t *)&data);
 
-    QTAILQ_INIT(&s->keys);
+    s->keys = g_ptr_array_new_with_free_func(smc_key_free);
+    s->key_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+    s->keys_sorted = true;
 
     return sbd;
 }
 
+/*
+ * An external key database is either a JSON object mapping key names to
+ * { "type": "ui32", "attr": 132, "data": "<hex>" }, or a binary dump:
+ * "SMCK", a little-endian key count, then for every key its name and
+ * type (4 characters each), its size, attr and size bytes of data.
+ */
+#define SMC_KEY_DB_MAGIC    "SMCK"
+
+static bool smc_parse_fourcc(const char *str, uint32_t *out)
+{
+    if (strlen(str) != 4) {
+        return false;
+    }
+    *out = ldl_be_p(str);
+    return true;
+}
+
+static bool apple_smc_load_key_db_json(AppleSMCState *s, const char *buf,
+                                       Error **errp)
+{
+    QObject *obj = qobject_from_json(buf, errp);
+    g_autoptr(QDict) db = NULL;
+    const QDictEntry *e;
+
+    if (!obj) {
+        return false;
+    }
+    db = qobject_to(QDict, obj);
+    if (!db) {
+        qobject_unref(obj);
+        error_setg(errp, "SMC key database must be a JSON object");
+        return false;
+    }
+
+    for (e = qdict_first(db); e; e = qdict_next(db, e)) {
+        const char *name = qdict_entry_key(e);
+        QDict *entry = qobject_to(QDict, qdict_entry_value(e));
+        const char *type, *hex;
+        g_autofree uint8_t *data = NULL;
+        uint32_t key, key_type;
+        size_t size;
+
+        if (!smc_parse_fourcc(name, &key) || !entry) {
+            error_setg(errp, "Invalid SMC key '%s'", name);
+            return false;
+        }
+        type = qdict_get_try_str(entry, "type");
+        hex = qdict_get_try_str(entry, "data");
+        if (!type || !smc_parse_fourcc(type, &key_type) || !hex
+            || strlen(hex) % 2 || strlen(hex) / 2 > UINT8_MAX) {
+            error_setg(errp, "SMC key '%s' needs a 4-character type and "
+                       "up to 255 bytes of hex data", name);
+            return false;
+        }
+
+        size = strlen(hex) / 2;
+        data = g_malloc0(size);
+        for (size_t i = 0; i < size; i++) {
+            int hi = g_ascii_xdigit_value(hex[i * 2]);
+            int lo = g_ascii_xdigit_value(hex[i * 2 + 1]);
+
+            if (hi < 0 || lo < 0) {
+                error_setg(errp, "SMC key '%s' has invalid hex data", name);
+                return false;
+            }
+            data[i] = (hi << 4) | lo;
+        }
+        smc_create_key(s, key, size, key_type,
+                       qdict_get_try_int(entry, "attr",
+                                         SMC_ATTR_LITTLE_ENDIAN),
+                       data);
+    }
+    return true;
+}
+
+static bool apple_smc_load_key_db_bin(AppleSMCState *s, const uint8_t *buf,
+                                      size_t len, Error **errp)
+{
+    uint32_t count = ldl_le_p(buf + 4);
+    size_t off = 8;
+
+    for (uint32_t i = 0; i < count; i++) {
+        uint8_t size;
+
+        if (len - off < 10 || len - off - 10 < buf[off + 8]) {
+            error_setg(errp, "SMC key database is truncated at key %u", i);
+            return false;
+        }
+        size = buf[off + 8];
+        smc_create_key(s, ldl_be_p(buf + off), size, ldl_be_p(buf + off + 4),
+                       buf[off + 9], (void *)(buf + off + 10));
+        off += 10 + size;
+    }
+    return true;
+}
+
+static bool apple_smc_load_key_db(AppleSMCState *s, const char *path,
+                                  Error **errp)
+{
+    g_autoptr(GError) gerr = NULL;
+    g_autofree char *buf = NULL;
+    gsize len;
+
+    if (!g_file_get_contents(path, &buf, &len, &gerr)) {
+        error_setg(errp, "Failed to read SMC key database '%s': %s",
+                   path, gerr->message);
+        return false;
+    }
+
+    if (len >= 8 && !memcmp(buf, SMC_KEY_DB_MAGIC, 4)) {
+        return apple_smc_load_key_db_bin(s, (uint8_t *)buf, len, errp);
+    }
+    return apple_smc_load_key_db_json(s, buf, errp);
+}
+
 static void apple_smc_realize(DeviceState *dev, Error **errp)
 {
     AppleSMCState *s = APPLE_SMC_IOP(dev);
     uint8_t data[8] = {0x00, 0x00, 0x70, 0x80, 0x00, 0x01, 0x19, 0x40};
     uint64_t value;
 
-    smc_create_key_func(s, SmcKeyNKEY, 4, SmcKeyTypeUint32,
-                        SMC_ATTR_LITTLE_ENDIAN,
-                        &smc_key_count_read, &smc_key_reject_write);
+    /* Built-in keys below take precedence over the database */
+    if (s->key_db && !apple_smc_load_key_db(s, s->key_db, errp)) {
+        return;
+    }
+
+    smc_create_key_dynamic(s, SmcKeyNKEY, 4, SmcKeyTypeUint32,
+                           SMC_ATTR_LITTLE_ENDIAN, &smc_key_count_get, s);
 
     smc_create_key(s, SmcKeyCLKH, 8, SmcKeyTypeClh,
                    SMC_ATTR_LITTLE_ENDIAN, data);
@@ -569,6 +822,11 @@ static void apple_smc_unrealize(DeviceState *dev)
     qdev_unrealize(DEVICE(s->mbox));
 }
 
+static Property apple_smc_properties[] = {
+    DEFINE_PROP_STRING("key-db", AppleSMCState, key_db),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_smc_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -578,6 +836,7 @@ static void apple_smc_class_init(ObjectClass *klass, void *data)
     /* dc->reset = apple_smc_reset; */
     dc->desc = "Apple SMC IOP";
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    device_class_set_props(dc, apple_smc_properties);
 }
 
 static const TypeInfo apple_smc_info = {
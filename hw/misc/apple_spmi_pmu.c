@@ -6,6 +6,7 @@
 #include "qemu/lockable.h"
 #include "qemu/log.h"
 #include "qemu/module.h"
+#include "qemu/range.h"
 #include "qemu/timer.h"
 #include "hw/arm/xnu_dtb.h"
 #include "sysemu/sysemu.h"
@@ -120,54 +121,57 @@ static void apple_spmi_pmu_set_alarm(AppleSPMIPMUState *p)
     }
 }
 
+/*
+ * reg[] acts as a write-through register cache: accesses are served from
+ * it with a single copy, and only the ranges with side effects (alarm,
+ * scratchpad tick offset) or live values (RTC) are looked at.
+ */
 static int apple_spmi_pmu_send(SPMISlave *s, uint8_t *data,
                                uint8_t len)
 {
     AppleSPMIPMUState *p = APPLE_SPMI_PMU(s);
-    bool aflg = false;
-    uint16_t addr;
-    for (addr = p->addr; addr < p->addr + len; addr++) {
-        p->reg[addr] = data[addr - p->addr];
-        if (addr == p->reg_alarm_ctrl) {
-            aflg = true;
-        }
-        if (addr >= p->reg_alarm && addr < p->reg_alarm + 4) {
-            aflg = true;
-        }
-        if ((addr >= p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_SECS_OFFSET
-             && addr < p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_SECS_OFFSET + 4)
-            || (addr >= p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_TICKS_OFFSET
-                && addr < p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_TICKS_OFFSET + 2)) {
-            p->tick_offset = apple_spmi_pmu_get_tick_offset(p);
-        }
+    uint32_t n = MIN(len, sizeof(p->reg) - p->addr);
+
+    memcpy(&p->reg[p->addr], data, n);
+    if (ranges_overlap(p->addr, n,
+                       p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_SECS_OFFSET, 4)
+        || ranges_overlap(p->addr, n,
+                          p->reg_leg_scrpad + LEG_SCRPAD_OFFSET_TICKS_OFFSET,
+                          2)) {
+        p->tick_offset = apple_spmi_pmu_get_tick_offset(p);
     }
-    p->addr = addr;
-    if (aflg) {
+    if (ranges_overlap(p->addr, n, p->reg_alarm_ctrl, 1)
+        || ranges_overlap(p->addr, n, p->reg_alarm, 4)) {
         apple_spmi_pmu_set_alarm(p);
     }
-    return len;
+    p->addr += n;
+    return n;
+}
+
+static void apple_spmi_pmu_update_rtc(AppleSPMIPMUState *p)
+{
+    uint64_t now = rtc_get_tick(p, NULL);
+
+    p->reg[p->reg_rtc] = now << 1;
+    p->reg[p->reg_rtc + 1] = now >> 7;
+    p->reg[p->reg_rtc + 2] = now >> 15;
+    p->reg[p->reg_rtc + 3] = now >> 23;
+    p->reg[p->reg_rtc + 4] = now >> 31;
+    p->reg[p->reg_rtc + 5] = now >> 39;
 }
 
 static int apple_spmi_pmu_recv(SPMISlave *s, uint8_t *data,
                                uint8_t len)
 {
     AppleSPMIPMUState *p = APPLE_SPMI_PMU(s);
-    uint16_t addr;
+    uint32_t n = MIN(len, sizeof(p->reg) - p->addr);
 
-    for (addr = p->addr; addr < p->addr + len; addr++) {
-        if (addr >= p->reg_rtc && addr < p->reg_rtc + 6) {
-            uint64_t now = rtc_get_tick(p, NULL);
-            p->reg[p->reg_rtc] = now << 1;
-            p->reg[p->reg_rtc + 1] = now >> 7;
-            p->reg[p->reg_rtc + 2] = now >> 15;
-            p->reg[p->reg_rtc + 3] = now >> 23;
-            p->reg[p->reg_rtc + 4] = now >> 31;
-            p->reg[p->reg_rtc + 5] = now >> 39;
-        }
-        data[addr - p->addr] = p->reg[addr];
+    if (ranges_overlap(p->addr, n, p->reg_rtc, 6)) {
+        apple_spmi_pmu_update_rtc(p);
     }
-    p->addr = addr;
-    return len;
+    memcpy(data, &p->reg[p->addr], n);
+    p->addr += n;
+    return n;
 }
 
 static int apple_spmi_pmu_command(SPMISlave *s, uint8_t opcode,
@@ -248,6 +248,7 @@ static const uint32_t nvme_feature_cap[NVME_FID_MAX] = {
     [NVME_ERROR_RECOVERY]           = NVME_FEAT_CAP_CHANGE | NVME_FEAT_CAP_NS,
     [NVME_VOLATILE_WRITE_CACHE]     = NVME_FEAT_CAP_CHANGE,
     [NVME_NUMBER_OF_QUEUES]         = NVME_FEAT_CAP_CHANGE,
+    [NVME_INTERRUPT_COALESCING]     = NVME_FEAT_CAP_CHANGE,
     [NVME_ASYNCHRONOUS_EVENT_CONF]  = NVME_FEAT_CAP_CHANGE,
     [NVME_TIMESTAMP]                = NVME_FEAT_CAP_CHANGE,
     [NVME_HOST_BEHAVIOR_SUPPORT]    = NVME_FEAT_CAP_CHANGE,
@@ -565,6 +566,51 @@ static void nvme_irq_deassert(NvmeCtrl *n, NvmeCQueue *cq)
     }
 }
 
+/*
+ * Apple ANS: interrupt coalescing. Aggregation is disabled on the admin
+ * queue and whenever no aggregation time is configured, since the
+ * threshold alone could otherwise hold back an interrupt indefinitely.
+ */
+static bool nvme_cq_coalesced(NvmeCtrl *n, NvmeCQueue *cq)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    return n->params.is_apple_ans && cq->cqid && NVME_INTC_TIME(intc) &&
+           NVME_INTC_THR(intc);
+}
+
+static void nvme_cq_aggr_fire(void *opaque)
+{
+    NvmeCQueue *cq = opaque;
+    NvmeCtrl *n = cq->ctrl;
+
+    cq->aggr_count = 0;
+    if (cq->tail != cq->head) {
+        nvme_irq_assert(n, cq);
+    }
+}
+
+static void nvme_cq_notify(NvmeCtrl *n, NvmeCQueue *cq, uint32_t posted)
+{
+    uint32_t intc = n->features.int_coalescing;
+
+    if (!nvme_cq_coalesced(n, cq)) {
+        nvme_irq_assert(n, cq);
+        return;
+    }
+
+    cq->aggr_count += posted;
+    /* Aggregation threshold is 0's based */
+    if (cq->aggr_count > NVME_INTC_THR(intc)) {
+        timer_del(cq->aggr_timer);
+        nvme_cq_aggr_fire(cq);
+    } else if (!timer_pending(cq->aggr_timer)) {
+        /* Aggregation time is in 100 microsecond increments */
+        timer_mod(cq->aggr_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                  NVME_INTC_TIME(intc) * 100 * SCALE_US);
+    }
+}
+
 static void nvme_req_clear(NvmeRequest *req)
 {
     req->aer = false;
@@ -1352,6 +1398,7 @@ static void nvme_post_cqes(void *opaque)
     NvmeCtrl *n = cq->ctrl;
     NvmeRequest *req, *next;
     bool pending = cq->head != cq->tail;
+    uint32_t posted = 0;
     int ret;
 
     QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
@@ -1383,13 +1430,14 @@ static void nvme_post_cqes(void *opaque)
         nvme_inc_cq_tail(cq);
         nvme_sg_unmap(&req->sg);
         QTAILQ_INSERT_TAIL(&sq->req_list, req, entry);
+        posted++;
     }
     if (cq->tail != cq->head) {
         if (cq->irq_enabled && !pending) {
             n->cq_pending++;
         }
 
-        nvme_irq_assert(n, cq);
+        nvme_cq_notify(n, cq, posted);
     }
 }
 
@@ -1409,6 +1457,11 @@ static void nvme_enqueue_req_completion(NvmeCQueue *cq, NvmeRequest *req)
     QTAILQ_REMOVE(&req->sq->out_req_list, req, entry);
     QTAILQ_INSERT_TAIL(&cq->req_list, req, entry);
 
+    if (req->sq->batching) {
+        /* Posted by nvme_process_sq once the doorbell has been drained */
+        return;
+    }
+
     if (req->sq->ioeventfd_enabled) {
         /* Post CQE directly since we are in main loop thread */
         nvme_post_cqes(cq);
@@ -4388,6 +4441,7 @@ static void nvme_init_sq(NvmeSQueue *sq, NvmeCtrl *n, uint64_t dma_addr,
     sq->entry_size = entry_size;
     sq->cqid = cqid;
     sq->head = sq->tail = 0;
+    sq->poll_idle = 0;
     sq->io_req = g_new0(NvmeRequest *, sq->size);
 
     QTAILQ_INIT(&sq->req_list);
@@ -4716,6 +4770,7 @@ static void nvme_free_cq(NvmeCQueue *cq, NvmeCtrl *n)
 
     n->cq[cq->cqid] = NULL;
     timer_free(cq->timer);
+    timer_free(cq->aggr_timer);
     if (cq->ioeventfd_enabled) {
         memory_region_del_eventfd(&n->iomem,
                                   0x1000 + offset, 4, false, 0, &cq->notifier);
@@ -4789,6 +4844,8 @@ static void nvme_init_cq(NvmeCQueue *cq, NvmeCtrl *n, uint64_t dma_addr,
     }
     n->cq[cqid] = cq;
     cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+    cq->aggr_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_cq_aggr_fire, cq);
+    cq->aggr_count = 0;
 }
 
 static uint16_t nvme_create_cq(NvmeCtrl *n, NvmeRequest *req)
@@ -5391,6 +5448,9 @@ static uint16_t nvme_get_feature(NvmeCtrl *n, NvmeRequest *req)
         }
         trace_pci_nvme_getfeat_vwcache(result ? "enabled" : "disabled");
         goto out;
+    case NVME_INTERRUPT_COALESCING:
+        result = n->features.int_coalescing;
+        goto out;
     case NVME_ASYNCHRONOUS_EVENT_CONF:
         result = n->features.async_config;
         goto out;
@@ -5593,6 +5653,13 @@ static uint16_t nvme_set_feature(NvmeCtrl *n, NvmeRequest *req)
         req->cqe.result = cpu_to_le32((n->conf_ioqpairs - 1) |
                                       ((n->conf_ioqpairs - 1) << 16));
         break;
+    case NVME_INTERRUPT_COALESCING:
+        if (!n->params.is_apple_ans) {
+            return NVME_FEAT_NOT_CHANGEABLE | NVME_DNR;
+        }
+
+        n->features.int_coalescing = dw11 & 0xffff;
+        break;
     case NVME_ASYNCHRONOUS_EVENT_CONF:
         n->features.async_config = dw11;
         break;
@@ -6371,11 +6438,15 @@ static uint16_t nvme_admin_cmd(NvmeCtrl *n, NvmeRequest *req)
     return NVME_INVALID_OPCODE | NVME_DNR;
 }
 
+static void nvme_write_sq_eventidx(const NvmeSQueue *sq, uint32_t ei)
+{
+    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &ei, sizeof(ei));
+    trace_pci_nvme_eventidx_sq(sq->sqid, ei);
+}
+
 static void nvme_update_sq_eventidx(const NvmeSQueue *sq)
 {
-    pci_dma_write(&sq->ctrl->parent_obj, sq->ei_addr, &sq->tail,
-                  sizeof(sq->tail));
-    trace_pci_nvme_eventidx_sq(sq->sqid, sq->tail);
+    nvme_write_sq_eventidx(sq, sq->tail);
 }
 
 static void nvme_update_sq_tail(NvmeSQueue *sq)
@@ -6385,11 +6456,73 @@ static void nvme_update_sq_tail(NvmeSQueue *sq)
     trace_pci_nvme_shadow_doorbell_sq(sq->sqid, sq->tail);
 }
 
+/*
+ * Apple ANS: the iOS driver cannot be taught to skip doorbell writes, but a
+ * driver that honours the Doorbell Buffer Config event indexes can. While an
+ * I/O queue is busy the controller polls its shadow tail, and keeps the event
+ * index one entry behind so the host never has to trap on the doorbell. After
+ * NVME_SHADOW_DB_POLL_IDLE empty polls the event index catches up with the
+ * tail again, and the next submission rings the doorbell as usual.
+ */
+#define NVME_SHADOW_DB_POLL_IDLE 16
+
+static bool nvme_sq_shadow_polled(NvmeCtrl *n, NvmeSQueue *sq)
+{
+    return n->params.is_apple_ans && n->params.shadow_db_poll &&
+           n->dbbuf_enabled && sq->sqid;
+}
+
+static void nvme_sq_shadow_poll(NvmeCtrl *n, NvmeSQueue *sq, bool progress)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    sq->poll_idle = progress ? 0 : sq->poll_idle + 1;
+
+    if (sq->poll_idle < NVME_SHADOW_DB_POLL_IDLE) {
+        nvme_write_sq_eventidx(sq, (uint16_t)(sq->tail - 1));
+        timer_mod(sq->timer, now + n->params.shadow_db_poll);
+        return;
+    }
+
+    nvme_update_sq_eventidx(sq);
+    /* Catch a submission that raced with the event index update */
+    nvme_update_sq_tail(sq);
+    if (!nvme_sq_empty(sq)) {
+        sq->poll_idle = 0;
+        timer_mod(sq->timer, now + 500);
+    }
+}
+
+/*
+ * Apple ANS: plug the namespaces' block backends while a doorbell is being
+ * drained, so that an aio=io_uring or aio=native backend submits all of the
+ * commands of the batch to the host with a single syscall.
+ */
+static void nvme_sq_plug(NvmeCtrl *n, bool plug)
+{
+    for (int i = 1; i <= NVME_MAX_NAMESPACES; i++) {
+        NvmeNamespace *ns = nvme_ns(n, i);
+
+        if (!ns) {
+            continue;
+        }
+
+        if (plug) {
+            blk_io_plug(ns->blkconf.blk);
+        } else {
+            blk_io_unplug(ns->blkconf.blk);
+        }
+    }
+}
+
 static void nvme_process_sq(void *opaque)
 {
     NvmeSQueue *sq = opaque;
     NvmeCtrl *n = sq->ctrl;
     NvmeCQueue *cq = n->cq[sq->cqid];
+    bool polled = nvme_sq_shadow_polled(n, sq);
+    bool progress = false;
+    bool plugged = false;
 
     uint16_t status;
     hwaddr addr;
@@ -6400,6 +6533,12 @@ static void nvme_process_sq(void *opaque)
         nvme_update_sq_tail(sq);
     }
 
+    sq->batching = n->params.is_apple_ans;
+    if (n->params.is_apple_ans && sq->sqid && !nvme_sq_empty(sq)) {
+        nvme_sq_plug(n, true);
+        plugged = true;
+    }
+
     while (!(nvme_sq_empty(sq) || QTAILQ_EMPTY(&sq->req_list))) {
         addr = sq->dma_addr + sq->head * sq->entry_size;
         if (nvme_addr_read(n, addr, (void *)&cmd, sizeof(cmd))) {
@@ -6423,12 +6562,30 @@ static void nvme_process_sq(void *opaque)
             req->status = status;
             nvme_enqueue_req_completion(cq, req);
         }
+        progress = true;
 
         if (n->dbbuf_enabled) {
-            nvme_update_sq_eventidx(sq);
+            if (!polled) {
+                nvme_update_sq_eventidx(sq);
+            }
             nvme_update_sq_tail(sq);
         }
     }
+
+    if (plugged) {
+        nvme_sq_plug(n, false);
+    }
+
+    if (polled) {
+        nvme_sq_shadow_poll(n, sq, progress);
+    }
+
+    if (sq->batching) {
+        sq->batching = false;
+        if (!QTAILQ_EMPTY(&cq->req_list)) {
+            nvme_post_cqes(cq);
+        }
+    }
 }
 
 static void nvme_update_msixcap_ts(PCIDevice *pci_dev, uint32_t table_size)
@@ -7071,6 +7228,9 @@ static void nvme_process_db(NvmeCtrl *n, hwaddr addr, int val)
                 n->cq_pending--;
             }
 
+            /* The host reaped everything; nothing left to aggregate */
+            cq->aggr_count = 0;
+            timer_del(cq->aggr_timer);
             nvme_irq_deassert(n, cq);
         }
     } else {
@@ -7347,6 +7507,10 @@ static void nvme_init_state(NvmeCtrl *n)
     n->cq = g_new0(NvmeCQueue *, n->params.max_ioqpairs + 1);
     n->temperature = NVME_TEMPERATURE;
     n->features.temp_thresh_hi = NVME_TEMPERATURE_WARNING;
+    if (n->params.is_apple_ans) {
+        n->features.int_coalescing = n->params.intc_thr |
+                                     (n->params.intc_time << 8);
+    }
     n->starttime_ms = qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL);
     n->num_aer = n->params.aerl + 1;
     n->aer_reqs = g_new0(NvmeRequest *, n->params.aerl + 1);
@@ -7834,6 +7998,9 @@ static Property nvme_props[] = {
     DEFINE_PROP_UINT8("vsl", NvmeCtrl, params.vsl, 7),
     DEFINE_PROP_BOOL("use-intel-id", NvmeCtrl, params.use_intel_id, false),
     DEFINE_PROP_BOOL("is-apple-ans", NvmeCtrl, params.is_apple_ans, false),
+    DEFINE_PROP_UINT8("intc-thr", NvmeCtrl, params.intc_thr, 0),
+    DEFINE_PROP_UINT8("intc-time", NvmeCtrl, params.intc_time, 0),
+    DEFINE_PROP_UINT32("shadow-db-poll", NvmeCtrl, params.shadow_db_poll, 0),
     DEFINE_PROP_BOOL("legacy-cmb", NvmeCtrl, params.legacy_cmb, false),
     DEFINE_PROP_BOOL("ioeventfd", NvmeCtrl, params.ioeventfd, false),
     DEFINE_PROP_UINT8("zoned.zasl", NvmeCtrl, params.zasl, 0),
@@ -7937,6 +8104,8 @@ static int nvme_queues_pre_load(void *opaque)
         QTAILQ_INIT(&cq->req_list);
         QTAILQ_INIT(&cq->sq_list);
         cq->timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_post_cqes, cq);
+        cq->aggr_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvme_cq_aggr_fire,
+                                      cq);
     }
 
     g_free(n->admin_sq);
@@ -7988,14 +8157,29 @@ static int nvme_post_load(void *opaque, int version_id)
             QTAILQ_INSERT_TAIL(&n->cq[n->sq[i]->cqid]->sq_list, n->sq[i], entry);
         }
         if (n->cq[i]) {
-            n->cq[i]->ctrl = n;
-            QTAILQ_FOREACH_SAFE(req, &n->cq[i]->req_list, entry, next) {
+            NvmeCQueue *cq = n->cq[i];
+
+            cq->ctrl = n;
+            QTAILQ_FOREACH_SAFE(req, &cq->req_list, entry, next) {
                 NvmeSQueue *sq = n->sq[req->sqid];
                 sq->io_req[req->id++] = req;
                 sq->restored_size++;
                 req->sq = sq;
                 req->ns = nvme_ns(n, req->nsid);
             }
+
+            /*
+             * The aggregation count and timer are not migrated. Re-arm
+             * the timer so that an interrupt still held back at save time
+             * is delivered once the aggregation time elapses.
+             */
+            cq->aggr_count = 0;
+            if (nvme_cq_coalesced(n, cq) && cq->tail != cq->head) {
+                timer_mod(cq->aggr_timer,
+                          qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                          NVME_INTC_TIME(n->features.int_coalescing) *
+                          100 * SCALE_US);
+            }
         }
     }
 
@@ -8151,6 +8335,8 @@ static void nvme_pci_write_config(PCIDevice *dev, uint32_t address,
 
 static const VMStateDescription vmstate_nvme = {
     .name = "nvme",
+    .version_id = 1,
+    .minimum_version_id = 0,
     .pre_save = nvme_pre_save,
     .post_load = nvme_post_load,
     .fields = (VMStateField[]) {
@@ -8202,6 +8388,7 @@ static const VMStateDescription vmstate_nvme = {
         VMSTATE_UINT16(features.temp_thresh_hi, NvmeCtrl),
         VMSTATE_UINT16(features.temp_thresh_low, NvmeCtrl),
         VMSTATE_UINT32(features.async_config, NvmeCtrl),
+        VMSTATE_UINT32_V(features.int_coalescing, NvmeCtrl, 1),
         VMSTATE_UINT8_ARRAY(id_ctrl.raw, NvmeCtrl, 4096),
         VMSTATE_END_OF_LIST()
     },
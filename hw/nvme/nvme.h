@@ -389,6 +389,8 @@ typedef struct NvmeSQueue {
     NvmeRequest **io_req;
     EventNotifier notifier;
     bool        ioeventfd_enabled;
+    bool        batching;      /* Apple ANS: post CQEs once per doorbell */
+    uint32_t    poll_idle;     /* Apple ANS: idle shadow doorbell polls */
     QTAILQ_HEAD(, NvmeRequest) req_list;
     QTAILQ_HEAD(, NvmeRequest) out_req_list;
     QTAILQ_ENTRY(NvmeSQueue) entry;
@@ -407,6 +409,8 @@ typedef struct NvmeCQueue {
     uint64_t    db_addr;
     uint64_t    ei_addr;
     QEMUTimer   *timer;
+    QEMUTimer   *aggr_timer;   /* Apple ANS: interrupt aggregation time */
+    uint32_t    aggr_count;    /* CQEs posted since the last interrupt */
     EventNotifier notifier;
     bool        ioeventfd_enabled;
     QTAILQ_HEAD(, NvmeSQueue) sq_list;
@@ -429,6 +433,9 @@ typedef struct NvmeParams {
     uint8_t  vsl;
     bool     use_intel_id;
     bool     is_apple_ans;
+    uint8_t  intc_thr;
+    uint8_t  intc_time;
+    uint32_t shadow_db_poll;
     uint8_t  zasl;
     bool     auto_transition_zones;
     bool     legacy_cmb;
@@ -515,6 +522,7 @@ typedef struct NvmeCtrl {
         };
 
         uint32_t                async_config;
+        uint32_t                int_coalescing;
         NvmeHostBehaviorSupport hbs;
     } features;
 
@@ -1,7 +1,11 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
 #include "qemu/error-report.h"
+#include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "sysemu/block-backend.h"
+#include "sysemu/runstate.h"
+#include "hw/qdev-properties.h"
 #include "hw/nvram/apple_nvram.h"
 #include <zlib.h>
 #include "libdecnumber/decNumberLocal.h"
@@ -22,15 +26,25 @@ chrp_checksum(ChrpNvramPartHdr *header)
     return sum & 0xff;
 }
 
-static env_var *find_env(AppleNvramState *s, const char *name)
+static void apple_nvram_mark_dirty(AppleNvramState *s)
 {
-    env_var *v;
-    QTAILQ_FOREACH(v, &s->env, entry) {
-        if (!strcmp(v->name, name)) {
-            return v;
-        }
+    s->dirty = true;
+    if (s->flush_timer && !timer_pending(s->flush_timer)) {
+        timer_mod(s->flush_timer, qemu_clock_get_ms(QEMU_CLOCK_REALTIME)
+                                  + s->flush_interval);
     }
-    return NULL;
+}
+
+static env_var *find_env(AppleNvramState *s, const char *name)
+{
+    return g_hash_table_lookup(s->env_index, name);
+}
+
+/* The common partition has to be rewritten from @pos onwards */
+static void env_invalidate(AppleNvramState *s, size_t pos)
+{
+    s->env_dirty_pos = MIN(s->env_dirty_pos, pos);
+    apple_nvram_mark_dirty(s);
 }
 
 const char *env_get(AppleNvramState *s, const char *name)
@@ -86,6 +100,8 @@ int env_unset(AppleNvramState *s, const char *name)
         return 0;
     }
 
+    env_invalidate(s, v->offset);
+    g_hash_table_remove(s->env_index, v->name);
     QTAILQ_REMOVE(&s->env, v, entry);
 
     g_free(v->str);
@@ -97,34 +113,29 @@ int env_unset(AppleNvramState *s, const char *name)
 int env_set(AppleNvramState *s, const char *name, const char *val,
             uint32_t flags)
 {
-    g_autofree env_var *v;
+    char key[sizeof_field(env_var, name)];
+    env_var *v;
 
-    v = find_env(s, name);
+    g_strlcpy(key, name, sizeof(key));
+    v = find_env(s, key);
 
     if (v) {
-        env_unset(s, name);
-        v = NULL;
-    }
-
-    v = g_malloc0(sizeof(env_var));
-
-    if (!v) {
-        return -1;
+        /* Updated in place, so the variables before it stay put */
+        g_free(v->str);
+        env_invalidate(s, v->offset);
+    } else {
+        v = g_malloc0(sizeof(env_var));
+        g_strlcpy(v->name, key, sizeof(v->name));
+        v->offset = s->env_end;
+        QTAILQ_INSERT_TAIL(&s->env, v, entry);
+        g_hash_table_insert(s->env_index, v->name, v);
+        env_invalidate(s, v->offset);
     }
 
-    g_strlcpy(v->name, name, sizeof(v->name));
     v->str = g_strdup(val);
-
-    if (v->str == NULL) {
-        return -1;
-    }
-
     v->u = strtoul(v->str, NULL, 0);
     v->flags = flags;
-
-    QTAILQ_INSERT_TAIL(&s->env, v, entry);
-
-    g_steal_pointer(&v);
+    v->size = strlen(v->name) + strlen(v->str) + 2;
     return 0;
 }
 
@@ -145,25 +156,42 @@ int env_set_bool(AppleNvramState *s, const char *name, bool val,
     return env_set(s, name, val ? "true" : "false", flags);
 }
 
+/*
+ * Only the variables from env_dirty_pos onwards are written out again;
+ * everything before it is already in @buffer from the previous call.
+ */
 static ssize_t env_serialize(AppleNvramState *s, uint8_t *buffer, size_t len)
 {
     env_var *v;
     size_t pos = 0;
-    g_autofree char *buf = g_malloc0(len);
+    size_t name_len;
+    /* A full rewrite may follow a bank loaded from disk, clear all of it */
+    size_t old_end = s->env_dirty_pos ? s->env_end : len;
 
-    if (buf == NULL) {
-        return -1;
+    if (s->env_dirty_pos == SIZE_MAX) {
+        return s->env_end;
     }
 
     QTAILQ_FOREACH(v, &s->env, entry) {
-       snprintf(buf + pos, len - pos, "%s=%s", v->name, v->str);
-       pos += strlen(buf + pos) + 1;
-
-       if (pos >= len) {
+        if (pos + v->size <= s->env_dirty_pos) {
+            pos += v->size;
+            continue;
+        }
+        if (pos + v->size >= len) {
             return -1;
-       }
-    }
-    memcpy(buffer, buf, len);
+        }
+        name_len = strlen(v->name);
+        v->offset = pos;
+        memcpy(buffer + pos, v->name, name_len);
+        buffer[pos + name_len] = '=';
+        memcpy(buffer + pos + name_len + 1, v->str, v->size - name_len - 1);
+        pos += v->size;
+    }
+    if (pos < old_end) {
+        memset(buffer + pos, 0, old_end - pos);
+    }
+    s->env_end = pos;
+    s->env_dirty_pos = SIZE_MAX;
     return pos;
 }
 
@@ -380,6 +408,7 @@ ssize_t apple_nvram_serialize(AppleNvramState *s, void *buffer, size_t size)
         p->len = 0x7f0;
         p->data = g_malloc0(p->len);
         QTAILQ_INSERT_HEAD(&s->bank->parts, p, entry);
+        s->env_dirty_pos = 0;
     }
 
     if (env_serialize(s, p->data, p->len) < 0) {
@@ -413,23 +442,70 @@ static void apple_nvram_cleanup(AppleNvramState *s)
         v = next;
     }
     QTAILQ_INIT(&s->env);
+    g_hash_table_remove_all(s->env_index);
+    s->env_end = 0;
+    s->env_dirty_pos = 0;
 }
 
-void apple_nvram_save(AppleNvramState *s)
+/*
+ * Writes the bank back until it stays clean. Changes made while a write
+ * is in flight are picked up by the next round rather than by another
+ * coroutine, so at most one write-back is outstanding.
+ */
+static void coroutine_fn apple_nvram_flush_co(void *opaque)
 {
+    AppleNvramState *s = opaque;
     NvmeNamespace *ns = NVME_NS(s);
-    g_autofree void *buf = g_malloc0(s->len);
-    ssize_t len = apple_nvram_serialize(s, buf, s->len);
 
-    if (len < 0) {
-        error_report("%s: Failed to serialize NVRAM", __func__);
-        return;
+    while (s->dirty && s->bank) {
+        g_autofree void *buf = g_malloc0(s->len);
+        ssize_t len;
+
+        s->dirty = false;
+        len = apple_nvram_serialize(s, buf, s->len);
+        if (len < 0) {
+            error_report("%s: Failed to serialize NVRAM", __func__);
+            break;
+        }
+        if (blk_co_pwrite(ns->blkconf.blk, 0, len, buf, 0) < 0) {
+            error_report("%s: Failed to write NVRAM", __func__);
+            break;
+        }
     }
+    s->flushing = false;
+}
 
-    if (blk_pwrite(ns->blkconf.blk, 0, len, buf, 0) < 0) {
-        error_report("%s: Failed to write NVRAM", __func__);
+static void apple_nvram_kick_flush(AppleNvramState *s)
+{
+    if (s->flush_timer) {
+        timer_del(s->flush_timer);
+    }
+    if (!s->dirty || s->flushing) {
         return;
     }
+    s->flushing = true;
+    qemu_coroutine_enter(qemu_coroutine_create(apple_nvram_flush_co, s));
+}
+
+static void apple_nvram_flush_timer(void *opaque)
+{
+    apple_nvram_kick_flush(opaque);
+}
+
+/* Starts writing the bank back without waiting for it */
+void apple_nvram_save(AppleNvramState *s)
+{
+    apple_nvram_kick_flush(s);
+}
+
+/* Writes the bank back and waits until it is on disk */
+void apple_nvram_flush(AppleNvramState *s)
+{
+    NvmeNamespace *ns = NVME_NS(s);
+
+    apple_nvram_kick_flush(s);
+    blk_drain(ns->blkconf.blk);
+    blk_flush(ns->blkconf.blk);
 }
 
 void apple_nvram_load(AppleNvramState *s)
@@ -444,7 +520,8 @@ void apple_nvram_load(AppleNvramState *s)
 
     buffer = g_malloc0(len);
 
-    blk_flush(ns->blkconf.blk);
+    /* Pending changes must land before the bank is read back */
+    apple_nvram_kick_flush(s);
     blk_drain(ns->blkconf.blk);
 
     if (blk_pread(ns->blkconf.blk, 0, len, buffer, 0) < 0) {
@@ -466,6 +543,21 @@ void apple_nvram_load(AppleNvramState *s)
         QTAILQ_INSERT_HEAD(&s->bank->parts, part, entry);
     }
     apple_nvram_load_env(s);
+    /* Loading the env is not a change */
+    s->dirty = false;
+    timer_del(s->flush_timer);
+}
+
+static void apple_nvram_vm_state_change(void *opaque, bool running,
+                                        RunState state)
+{
+    AppleNvramState *s = opaque;
+
+    if (running) {
+        apple_nvram_kick_flush(s);
+    } else {
+        apple_nvram_flush(s);
+    }
 }
 
 static void apple_nvram_realize(DeviceState *dev, Error **errp)
@@ -479,6 +571,10 @@ static void apple_nvram_realize(DeviceState *dev, Error **errp)
         error_propagate(errp, local_err);
         return;
     }
+    s->flush_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                  apple_nvram_flush_timer, s);
+    s->vmstate_entry = qemu_add_vm_change_state_handler(
+                                  apple_nvram_vm_state_change, s);
     apple_nvram_load(s);
 }
 
@@ -487,11 +583,21 @@ static void apple_nvram_unrealize(DeviceState *dev)
     AppleNvramState *s = APPLE_NVRAM(dev);
     AppleNvramClass *anc = APPLE_NVRAM_GET_CLASS(dev);
 
+    apple_nvram_flush(s);
+    qemu_del_vm_change_state_handler(s->vmstate_entry);
+    timer_free(s->flush_timer);
+    s->flush_timer = NULL;
+
     anc->parent_unrealize(dev);
 
     apple_nvram_cleanup(s);
 }
 
+static Property apple_nvram_props[] = {
+    DEFINE_PROP_UINT32("flush-interval", AppleNvramState, flush_interval, 100),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_nvram_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -502,10 +608,15 @@ static void apple_nvram_class_init(ObjectClass *klass, void *data)
     device_class_set_parent_realize(dc, apple_nvram_realize, &anc->parent_realize);
     device_class_set_parent_unrealize(dc, apple_nvram_unrealize, &anc->parent_unrealize);
     dc->desc = "Apple NVRAM";
+    device_class_set_props(dc, apple_nvram_props);
 }
 
 static void apple_nvram_instance_init(Object *obj)
 {
+    AppleNvramState *s = APPLE_NVRAM(obj);
+
+    QTAILQ_INIT(&s->env);
+    s->env_index = g_hash_table_new(g_str_hash, g_str_equal);
 }
 
 static const TypeInfo apple_nvram_info = {
@@ -1,14 +1,17 @@
 #include "qemu/osdep.h"
 #include "qapi/error.h"
+#include "qapi/qmp/qdict.h"
 #include "hw/irq.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/log.h"
+#include "qemu/main-loop.h"
 #include "qemu/module.h"
 #include "sysemu/dma.h"
 #include "hw/arm/xnu.h"
 #include "hw/arm/xnu_dtb.h"
 #include "hw/spmi/apple_spmi.h"
+#include "monitor/monitor.h"
 
 //#define DEBUG_SPMI
 
@@ -159,10 +162,158 @@ static void apple_spmi_set_irq(void *opaque, int irq, int level)
 
 static void apple_spmi_update_queues_status(AppleSPMIState *s)
 {
-    if (!fifo32_is_empty(&s->resp_fifo)) {
-        qemu_irq_raise(s->resp_irq);
+    bool level = !fifo32_is_empty(&s->resp_fifo);
+
+    if (level && !s->resp_irq_level) {
+        s->resp_irqs++;
+    }
+    s->resp_irq_level = level;
+    qemu_set_irq(s->resp_irq, level);
+}
+
+static void apple_spmi_push_resp(AppleSPMIState *s, uint32_t header,
+                                 const uint32_t *data, uint32_t words)
+{
+    if (fifo32_num_free(&s->resp_fifo) < 1 + words) {
+        qemu_log_mask(LOG_GUEST_ERROR, "%s: rsp queue overflow\n",
+                      DEVICE(s)->id);
+        s->resp_overflows++;
+        return;
+    }
+    fifo32_push(&s->resp_fifo, header);
+    for (int i = 0; i < words; i++) {
+        fifo32_push(&s->resp_fifo, data[i]);
+    }
+}
+
+/*
+ * Execute one request word. Returns true once a command carrying
+ * SPMI_REQ_FINAL has completed and its transaction was ended.
+ */
+static bool apple_spmi_exec_req(AppleSPMIState *s, uint32_t value)
+{
+    AppleSPMISlaveStats *stats;
+
+    if (s->data == NULL) {
+        uint8_t sid = SPMI_REQ_SID(value);
+        uint8_t opc = spmi_opcode(value);
+        uint32_t addr = spmi_address(value);
+        uint32_t len = spmi_data_length(value);
+
+        s->command = value;
+        s->commands++;
+        stats = &s->stats[sid];
+#ifdef DEBUG_SPMI
+        qemu_log_mask(LOG_UNIMP, "%s: sid: 0x%x opc: 0x%x addr: 0x%x len: 0x%x\n",
+                      DEVICE(s)->id, sid, opc, addr, len);
+#endif
+
+        if (opc == SPMI_CMD_EXT_WRITE || opc == SPMI_CMD_EXT_WRITEL) {
+            s->data_length = (len + 3) / 4;
+            s->data_filled = 0;
+            s->data = g_new0(uint32_t, s->data_length);
+        }
+        if (spmi_start_transfer(s->bus, sid, opc, addr)) {
+            stats->naks++;
+            return false;
+        }
+        if (s->data == NULL && len) {
+            /* Extended reads carry at most 8 bytes */
+            uint32_t data[2] = { 0 };
+            int count;
+            uint8_t ack = 0;
+
+            assert(opc == SPMI_CMD_EXT_READ || opc == SPMI_CMD_EXT_READL);
+            count = spmi_recv(s->bus, (uint8_t *)data, len);
+            if (count > 0) {
+                ack = ~(-1 << count);
+                stats->read_bytes += count;
+            }
+            stats->reads++;
+            apple_spmi_push_resp(s, (value & 0xFFF) | (ack << SPMI_RSP_ACK_SHIFT),
+                                 data, (len + 3) / 4);
+        }
+        if (s->data == NULL && (value & SPMI_REQ_FINAL)) {
+            spmi_end_transfer(s->bus);
+            return true;
+        }
+        return false;
+    }
+
+    s->data[s->data_filled++] = value;
+    if (s->data_filled >= s->data_length) {
+        uint32_t requested_len = spmi_data_length(s->command);
+        uint32_t count = spmi_send(s->bus, (uint8_t *)s->data,
+                                   requested_len);
+
+        stats = &s->stats[SPMI_REQ_SID(s->command)];
+        stats->writes++;
+        stats->write_bytes += count;
+        apple_spmi_push_resp(s, (s->command & 0xFFF)
+                                | ((count == requested_len) << 15), NULL, 0);
+        g_free(s->data);
+        s->data = NULL;
+        s->data_length = 0;
+        if (s->command & SPMI_REQ_FINAL) {
+            spmi_end_transfer(s->bus);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Run every queued request in one pass. The response interrupt is
+ * evaluated once per pass rather than once per command.
+ */
+static void apple_spmi_run_queue(AppleSPMIState *s)
+{
+    bool done = false;
+
+    if (fifo32_is_empty(&s->req_fifo)) {
+        return;
+    }
+
+    s->batches++;
+    while (!fifo32_is_empty(&s->req_fifo)) {
+        done |= apple_spmi_exec_req(s, fifo32_pop(&s->req_fifo));
+    }
+
+    if (done) {
+        apple_spmi_update_queues_status(s);
+    }
+}
+
+static void apple_spmi_run_bh(void *opaque)
+{
+    apple_spmi_run_queue(APPLE_SPMI(opaque));
+}
+
+/*
+ * Requests are only queued on push. A command carrying SPMI_REQ_FINAL
+ * (the doorbell) schedules a run from a BH, so back-to-back transactions
+ * pushed before it gets to run share one queue status and interrupt
+ * update. The queue is run right away when it fills up or when the
+ * driver looks at the response side.
+ */
+static void apple_spmi_push_req(AppleSPMIState *s, uint32_t value)
+{
+    fifo32_push(&s->req_fifo, value);
+    if (s->req_words) {
+        s->req_words--;
     } else {
-        qemu_irq_lower(s->resp_irq);
+        uint8_t opc = spmi_opcode(value);
+
+        s->req_command = value;
+        if (opc == SPMI_CMD_EXT_WRITE || opc == SPMI_CMD_EXT_WRITEL) {
+            s->req_words = (spmi_data_length(value) + 3) / 4;
+        }
+    }
+
+    if (fifo32_is_full(&s->req_fifo)) {
+        apple_spmi_run_queue(s);
+    } else if (s->req_words == 0 && (s->req_command & SPMI_REQ_FINAL)) {
+        qemu_bh_schedule(s->run_bh);
     }
 }
 
@@ -174,7 +325,6 @@ static void apple_spmi_queue_reg_write(void *opaque, hwaddr addr,
     uint32_t value = data;
     uint32_t *mmio = &s->queue_reg[addr >> 2];
     bool iflg = false;
-    bool qflg = false;
 #ifdef DEBUG_SPMI
     qemu_log_mask(LOG_UNIMP, "%s: %s @ 0x"
     TARGET_FMT_plx " value: 0x" TARGET_FMT_plx "\n", DEVICE(s)->id,
@@ -182,68 +332,9 @@ static void apple_spmi_queue_reg_write(void *opaque, hwaddr addr,
 #endif
 
     switch (addr) {
-    case SPMI_REQ_QUEUE_PUSH: {
-        if (s->data == NULL) {
-            uint8_t sid = SPMI_REQ_SID(value);
-            uint8_t opc = spmi_opcode(value);
-            uint32_t addr = spmi_address(value);
-            bool parity = !(value & SPMI_REQ_FINAL);
-            uint32_t len = spmi_data_length(value);
-
-            s->command = value;
-            #ifdef DEBUG_SPMI
-            qemu_log_mask(LOG_UNIMP, "%s: sid: 0x%x opc: 0x%x addr: 0x%x len: 0x%x\n",
-                                     DEVICE(s)->id, sid, opc, addr, len);
-            #endif
-
-            if (opc == SPMI_CMD_EXT_WRITE || opc == SPMI_CMD_EXT_WRITEL) {
-                s->data_length = (len + 3) / 4;
-                s->data_filled = 0;
-                s->data = g_new0(uint32_t, s->data_length);
-            }
-            if (spmi_start_transfer(s->bus, sid, opc, addr)) {
-                return;
-            }
-            if (s->data == NULL && len) {
-                assert(opc == SPMI_CMD_EXT_READ || opc == SPMI_CMD_EXT_READL);
-                g_autofree uint32_t *data = g_malloc0(len + 3);
-                int count = spmi_recv(s->bus, (uint8_t *)data, len);
-                uint8_t ack = 0;
-                value &= 0xFFF;
-                if (count > 0) {
-                    ack = ~(-1 << count);
-                }
-                value |= (ack << SPMI_RSP_ACK_SHIFT);
-                fifo32_push(&s->resp_fifo, value);
-                for (int i = 0; i < (len + 3) / 4; i++) {
-                    fifo32_push(&s->resp_fifo, data[i]);
-                }
-            }
-            if (s->data == NULL && !parity) {
-                spmi_end_transfer(s->bus);
-                qflg = 1;
-                iflg = 1;
-            }
-        } else {
-            s->data[s->data_filled++] = value;
-            if (s->data_filled >= s->data_length) {
-                uint32_t requested_len = spmi_data_length(s->command);
-                uint32_t count = spmi_send(s->bus, (uint8_t *)s->data,
-                                           requested_len);
-                fifo32_push(&s->resp_fifo, (s->command & 0xFFF)
-                                           | ((count == requested_len) << 15));
-                g_free(s->data);
-                s->data = NULL;
-                s->data_length = 0;
-                if (s->command & SPMI_REQ_FINAL) {
-                    spmi_end_transfer(s->bus);
-                    qflg = 1;
-                    iflg = 1;
-                }
-            }
-        }
+    case SPMI_REQ_QUEUE_PUSH:
+        apple_spmi_push_req(s, value);
         break;
-    }
     case SPMI_INT_ENAB(0) ... SPMI_INT_ENAB(SPMI_NUM_IRQ_BANK - 1):
         iflg = true;
         break;
@@ -255,9 +346,6 @@ static void apple_spmi_queue_reg_write(void *opaque, hwaddr addr,
         break;
     }
     *mmio = value;
-    if (qflg) {
-        apple_spmi_update_queues_status(s);
-    }
     if (iflg) {
         apple_spmi_update_irq(s);
     }
@@ -275,6 +363,7 @@ static uint64_t apple_spmi_queue_reg_read(void *opaque,
 
     switch (addr) {
     case SPMI_RSP_QUEUE_POP:
+        apple_spmi_run_queue(s);
         if (fifo32_is_empty(&s->resp_fifo)) {
             qemu_log_mask(LOG_GUEST_ERROR, "%s: rsp queue empty\n",
                           DEVICE(s)->id);
@@ -286,6 +375,7 @@ static uint64_t apple_spmi_queue_reg_read(void *opaque,
         iflg = true;
         break;
     case SPMI_QUEUE_STATUS:
+        apple_spmi_run_queue(s);
         value &= ~(SPMI_QUEUE_STATUS_REQ_EMPTY | SPMI_QUEUE_STATUS_RSP_EMPTY);
         value |= SPMI_QUEUE_STATUS_REQ_EMPTY;
         if (fifo32_is_empty(&s->resp_fifo)) {
@@ -367,6 +457,13 @@ static void apple_spmi_control_write(void *opaque, hwaddr addr,
             fifo32_reset(&s->resp_fifo);
             value &= ~SPMI_CONTROL_QUEUE_RESET_RSP;
         }
+        if (value & SPMI_CONTROL_QUEUE_RESET_REQ) {
+            fifo32_reset(&s->req_fifo);
+            s->req_words = 0;
+            g_free(s->data);
+            s->data = NULL;
+            s->data_length = 0;
+        }
         value &= ~SPMI_CONTROL_QUEUE_RESET_REQ;
         qflg = true;
         break;
@@ -474,12 +571,15 @@ static void apple_spmi_reset_enter(Object *obj, ResetType type)
     memset(s->queue_reg, 0, sizeof(s->queue_reg));
     memset(s->fault_reg, 0, sizeof(s->fault_reg));
     memset(s->fault_counter_reg, 0, sizeof(s->fault_counter_reg));
+    fifo32_reset(&s->req_fifo);
     fifo32_reset(&s->resp_fifo);
+    s->req_words = 0;
     if (s->data) {
         g_free(s->data);
     }
     s->data = NULL;
     s->data_length = 0;
+    s->resp_irq_level = false;
 }
 
 static void apple_spmi_reset_exit(Object *obj)
@@ -501,6 +601,7 @@ static void apple_spmi_realize(DeviceState *dev, Error **errp)
 
     snprintf(bus_name, sizeof(bus_name), "%s.bus", dev->id);
     s->bus = spmi_init_bus(dev, (const char *)bus_name);
+    s->run_bh = qemu_bh_new(apple_spmi_run_bh, s);
 
     qdev_connect_gpio_out_named(dev, APPLE_SPMI_RESP_IRQ, 0,
                                 qdev_get_gpio_in(dev, s->resp_intr_index));
@@ -515,6 +616,7 @@ static void apple_spmi_init(Object *obj)
     s->reg_vers = 1;
     s->resp_intr_index = SPMI_RESP_IRQ;
 
+    fifo32_create(&s->req_fifo, SPMI_QUEUE_DEPTH);
     fifo32_create(&s->resp_fifo, SPMI_QUEUE_DEPTH);
 
     memory_region_init_io(&s->iomems[0], obj, &apple_spmi_queue_reg_ops,
@@ -591,8 +693,71 @@ SysBusDevice *apple_spmi_create(DTBNode *node)
     return sbd;
 }
 
+static int apple_spmi_device_list(Object *obj, void *opaque)
+{
+    GSList **list = opaque;
+
+    if (object_dynamic_cast(obj, TYPE_APPLE_SPMI)) {
+        *list = g_slist_append(*list, DEVICE(obj));
+    }
+
+    object_child_foreach(obj, apple_spmi_device_list, opaque);
+    return 0;
+}
+
+static void hmp_info_spmi(Monitor *mon, const QDict *qdict)
+{
+    const char *name = qdict_get_try_str(qdict, "name");
+    g_autoptr(GSList) device_list = NULL;
+    bool found = false;
+
+    object_child_foreach(qdev_get_machine(), apple_spmi_device_list,
+                         &device_list);
+
+    for (GSList *ele = device_list; ele; ele = ele->next) {
+        DeviceState *dev = ele->data;
+        AppleSPMIState *s = APPLE_SPMI(dev);
+
+        if (name && strcmp(dev->id, name)) {
+            continue;
+        }
+        found = true;
+        monitor_printf(mon, "%s\tBatches: %" PRIu64 "\tCommands: %" PRIu64
+                       "\tResponse IRQs: %" PRIu64 "\tOverflows: %" PRIu64
+                       "\n", dev->id, s->batches, s->commands, s->resp_irqs,
+                       s->resp_overflows);
+        for (int sid = 0; sid < APPLE_SPMI_MAX_SLAVES; sid++) {
+            AppleSPMISlaveStats *st = &s->stats[sid];
+
+            if (!st->reads && !st->writes && !st->naks) {
+                continue;
+            }
+            monitor_printf(mon, "\tSID %d: reads: %" PRIu64 " (%" PRIu64
+                           " bytes) writes: %" PRIu64 " (%" PRIu64
+                           " bytes) NAKs: %" PRIu64 "\n", sid, st->reads,
+                           st->read_bytes, st->writes, st->write_bytes,
+                           st->naks);
+        }
+    }
+
+    if (name && !found) {
+        monitor_printf(mon, "Cannot find spmi %s\n", name);
+    }
+}
+
+static int apple_spmi_pre_save(void *opaque)
+{
+    AppleSPMIState *s = APPLE_SPMI(opaque);
+
+    apple_spmi_run_queue(s);
+    return 0;
+}
+
 static const VMStateDescription vmstate_apple_spmi = {
     .name = "apple_spmi",
+    .version_id = 1,
+    .minimum_version_id = 0,
+    .pre_save = apple_spmi_pre_save,
     .fields = (VMStateField[]) {
         VMSTATE_FIFO32(resp_fifo, AppleSPMIState),
         VMSTATE_UINT32_ARRAY(control_reg, AppleSPMIState,
@@ -608,6 +773,8 @@ static const VMStateDescription vmstate_apple_spmi = {
         VMSTATE_UINT32(command, AppleSPMIState),
         VMSTATE_VARRAY_UINT32_ALLOC(data, AppleSPMIState, data_length, 0,
                                     vmstate_info_uint32, uint32_t),
+        VMSTATE_UINT32_V(req_command, AppleSPMIState, 1),
+        VMSTATE_UINT32_V(req_words, AppleSPMIState, 1),
 
         VMSTATE_END_OF_LIST()
     }
@@ -641,6 +808,7 @@ static const TypeInfo apple_spmi_info = {
 static void apple_spmi_register_types(void)
 {
     type_register_static(&apple_spmi_info);
+    monitor_register_hmp("spmi", true, hmp_info_spmi);
 }
 
 type_init(apple_spmi_register_types);
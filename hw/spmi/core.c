@@ -138,6 +138,7 @@ void spmi_end_transfer(SPMIBus *bus)
             trace_spmi_finish(s->sid);
             sc->finish(s);
         }
+        bus->current_dev = NULL;
     }
 }
 
@@ -60,6 +60,9 @@
 #define R_FIFO_DEPTH            16
 #define R_FIFO_MAX_DEPTH        (16 * 8)
 
+/* Largest run moved between SIO and the bus in one go in DMA mode */
+#define APPLE_SPI_DMA_CHUNK     (64 * 1024)
+
 #define REG(_s,_v)             ((_s)->regs[(_v)>>2])
 
 struct AppleSPIState {
@@ -82,6 +85,8 @@ struct AppleSPIState {
     int tx_chan_id;
     int rx_chan_id;
     bool dma_capable;
+    uint8_t *dma_tx_buf;
+    uint8_t *dma_rx_buf;
 };
 
 static int apple_spi_word_size(AppleSPIState *s)
@@ -212,6 +217,108 @@ static void apple_spi_cs_set(void *opaque, int pin, int level)
     apple_spi_update_cs(s);
 }
 
+/*
+ * Received words are assembled MSB first, like the FIFO path does before
+ * it stores them to memory.
+ */
+static void apple_spi_swap_rx_words(uint8_t *buf, int len, int word_size)
+{
+    if (word_size == 1) {
+        return;
+    }
+    for (int i = 0; i + word_size <= len; i += word_size) {
+        for (int j = 0; j < word_size / 2; j++) {
+            uint8_t t = buf[i + j];
+            buf[i + j] = buf[i + word_size - 1 - j];
+            buf[i + word_size - 1 - j] = t;
+        }
+    }
+}
+
+/* Hand received words to the Rx DMA buffer, spilling into the FIFO */
+static bool apple_spi_dma_rx(AppleSPIState *s, uint8_t *buf, int len)
+{
+    int word_size = apple_spi_word_size(s);
+    int done = 0;
+
+    apple_spi_swap_rx_words(buf, len, word_size);
+    while (done < len) {
+        int n = apple_sio_dma_write(s->rx_chan, buf + done, len - done);
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+
+    for (; done < len; done += word_size) {
+        uint32_t v = 0;
+
+        if (fifo32_is_full(&s->rx_fifo)) {
+            qemu_log_mask(LOG_GUEST_ERROR, "%s: rx overflow\n", __func__);
+            REG(s, R_STATUS) |= R_STATUS_RXOVERFLOW;
+            return false;
+        }
+        memcpy(&v, buf + done, word_size);
+        fifo32_push(&s->rx_fifo, v);
+        apple_spi_update_xfer_rx(s);
+    }
+    return true;
+}
+
+/*
+ * DMA mode without going through the FIFOs: pull as much of the Tx
+ * buffer as SIO has mapped, move it across the bus in one block and push
+ * the reply straight into the Rx buffer. Whatever is left (no buffer
+ * queued yet, odd sizes) is done by the FIFO path.
+ */
+static bool apple_spi_run_dma(AppleSPIState *s)
+{
+    int word_size = apple_spi_word_size(s);
+    int max_len = APPLE_SPI_DMA_CHUNK - APPLE_SPI_DMA_CHUNK % word_size;
+
+    if (!fifo32_is_empty(&s->tx_fifo) || !fifo32_is_empty(&s->rx_fifo)) {
+        return true;
+    }
+
+    while (REG(s, R_TXCNT)) {
+        int len = MIN((uint64_t)REG(s, R_TXCNT) * word_size, max_len);
+        int rx_words;
+
+        len = MIN(len, apple_sio_dma_remaining(s->tx_chan));
+        len -= len % word_size;
+        if (len == 0) {
+            return true;
+        }
+        len = apple_sio_dma_read(s->tx_chan, s->dma_tx_buf, len);
+        ssi_transfer_block(s->spi, s->dma_tx_buf, s->dma_rx_buf, len);
+        REG(s, R_TXCNT) -= len / word_size;
+
+        rx_words = MIN(len / word_size, REG(s, R_RXCNT));
+        if (rx_words) {
+            REG(s, R_RXCNT) -= rx_words;
+            if (!apple_spi_dma_rx(s, s->dma_rx_buf, rx_words * word_size)) {
+                return false;
+            }
+        }
+    }
+
+    while (REG(s, R_RXCNT) && (REG(s, R_CFG) & R_CFG_AGD)) {
+        int len = MIN((uint64_t)REG(s, R_RXCNT) * word_size, max_len);
+
+        len = MIN(len, apple_sio_dma_remaining(s->rx_chan));
+        len -= len % word_size;
+        if (len == 0) {
+            return true;
+        }
+        ssi_transfer_block(s->spi, NULL, s->dma_rx_buf, len);
+        REG(s, R_RXCNT) -= len / word_size;
+        if (!apple_spi_dma_rx(s, s->dma_rx_buf, len)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void apple_spi_run(AppleSPIState *s)
 {
     uint32_t tx;
@@ -234,6 +341,12 @@ static void apple_spi_run(AppleSPIState *s)
         return;
     }
 
+    if ((R_CFG_MODE(REG(s, R_CFG))) == R_CFG_MODE_DMA) {
+        if (!apple_spi_run_dma(s)) {
+            return;
+        }
+    }
+
     apple_spi_update_xfer_tx(s);
 
     while (REG(s, R_TXCNT) && !fifo32_is_empty(&s->tx_fifo)) {
@@ -459,6 +572,8 @@ static void apple_spi_realize(DeviceState *dev, struct Error **errp)
     } else if (s->dma_capable) {
         s->tx_chan = apple_sio_get_endpoint(sio, s->tx_chan_id);
         s->rx_chan = apple_sio_get_endpoint(sio, s->rx_chan_id);
+        s->dma_tx_buf = g_malloc(APPLE_SPI_DMA_CHUNK);
+        s->dma_rx_buf = g_malloc(APPLE_SPI_DMA_CHUNK);
     }
 }
 
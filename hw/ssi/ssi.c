@@ -46,13 +46,20 @@ static void ssi_cs_default(void *opaque, int n, int level)
     s->cs = cs;
 }
 
+static bool ssi_peripheral_selected(SSIPeripheral *dev)
+{
+    SSIPeripheralClass *ssc = SSI_PERIPHERAL_GET_CLASS(dev);
+
+    return (dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
+           (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
+           ssc->cs_polarity == SSI_CS_NONE;
+}
+
 static uint32_t ssi_transfer_raw_default(SSIPeripheral *dev, uint32_t val)
 {
     SSIPeripheralClass *ssc = SSI_PERIPHERAL_GET_CLASS(dev);
 
-    if ((dev->cs && ssc->cs_polarity == SSI_CS_HIGH) ||
-            (!dev->cs && ssc->cs_polarity == SSI_CS_LOW) ||
-            ssc->cs_polarity == SSI_CS_NONE) {
+    if (ssi_peripheral_selected(dev)) {
         return ssc->transfer(dev, val);
     }
     return 0;
@@ -127,6 +134,37 @@ uint32_t ssi_transfer(SSIBus *bus, uint32_t val)
     return r;
 }
 
+void ssi_transfer_block(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                        size_t len)
+{
+    BusState *b = BUS(bus);
+    BusChild *kid = QTAILQ_FIRST(&b->children);
+    size_t i;
+
+    if (kid && !QTAILQ_NEXT(kid, sibling)) {
+        SSIPeripheral *peripheral = SSI_PERIPHERAL(kid->child);
+        SSIPeripheralClass *ssc = SSI_PERIPHERAL_GET_CLASS(peripheral);
+
+        if (ssc->transfer_block &&
+            ssc->transfer_raw == ssi_transfer_raw_default) {
+            if (ssi_peripheral_selected(peripheral)) {
+                ssc->transfer_block(peripheral, tx, rx, len);
+            } else if (rx) {
+                memset(rx, 0, len);
+            }
+            return;
+        }
+    }
+
+    for (i = 0; i < len; i++) {
+        uint8_t r = ssi_transfer(bus, tx ? tx[i] : 0xff);
+
+        if (rx) {
+            rx[i] = r;
+        }
+    }
+}
+
 const VMStateDescription vmstate_ssi_peripheral = {
     .name = "SSISlave",
     .version_id = 1,
@@ -62,6 +62,8 @@ static void apple_otg_realize(DeviceState *dev, Error **errp)
     }
     assert(object_property_add_const_link(OBJECT(&s->dwc2), "dma-mr",
                                           OBJECT(&s->dma_container_mr)));
+    qdev_prop_set_bit(DEVICE(&s->dwc2), "bulk-unthrottled",
+                      s->bulk_unthrottled);
     sysbus_realize(SYS_BUS_DEVICE(&s->dwc2), errp);
     sysbus_pass_irq(SYS_BUS_DEVICE(s), SYS_BUS_DEVICE(&s->dwc2));
 
@@ -229,6 +231,8 @@ static int apple_otg_post_load(void *opaque, int version_id)
 }
 
 static Property apple_otg_properties[] = {
+    DEFINE_PROP_BOOL("bulk-unthrottled", AppleOTGState, bulk_unthrottled,
+                     false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
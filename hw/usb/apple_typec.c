@@ -36,12 +36,19 @@ static void apple_typec_realize(DeviceState *dev, Error **errp)
     assert(obj);
     assert(object_property_add_const_link(OBJECT(&s->dwc2), "dma-mr", obj));
 
+    qdev_prop_set_bit(DEVICE(&s->dwc2), "bulk-unthrottled",
+                      s->bulk_unthrottled);
+    qdev_prop_set_bit(DEVICE(&s->dwc3), "bulk-unthrottled",
+                      s->bulk_unthrottled);
     sysbus_realize(SYS_BUS_DEVICE(&s->dwc2), errp);
     sysbus_realize(SYS_BUS_DEVICE(&s->dwc3), errp);
     sysbus_pass_irq(SYS_BUS_DEVICE(s), SYS_BUS_DEVICE(&s->dwc3));
     sysbus_init_irq(SYS_BUS_DEVICE(s), &s->dwc2.irq);
 
     s->host = SYS_BUS_DEVICE(qdev_new(TYPE_USB_TCP_HOST));
+    if (s->conn_addr) {
+        qdev_prop_set_string(DEVICE(s->host), "conn-addr", s->conn_addr);
+    }
     sysbus_realize(s->host, errp);
 
     bus = QLIST_FIRST(&DEVICE(s->host)->child_bus);
@@ -157,6 +164,9 @@ static int apple_typec_post_load(void *opaque, int version_id)
 }
 
 static Property apple_typec_properties[] = {
+    DEFINE_PROP_STRING("conn-addr", AppleTypeCState, conn_addr),
+    DEFINE_PROP_BOOL("bulk-unthrottled", AppleTypeCState, bulk_unthrottled,
+                     false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -16,6 +16,12 @@
 #include "dev-tcp-remote.h"
 #include "tcp-usb.h"
 #include "qemu/cutils.h"
+#include "qemu/iov.h"
+#include "qemu/host-utils.h"
+#include "qemu/sockets.h"
+#include "qemu/coroutine.h"
+#include "block/aio.h"
+#include "io/channel-socket.h"
 #include "sysemu/iothread.h"
 
 //#define DEBUG_DEV_TCP_REMOTE
@@ -27,34 +33,81 @@ do { fprintf(stderr, "dev-tcp-remote: " fmt , ## __VA_ARGS__); } while (0)
 #define DPRINTF(fmt, ...) do {} while(0)
 #endif
 
+static guint usb_tcp_remote_inflight_hash(gconstpointer key)
+{
+    const USBTCPInflightPacket *k = key;
+
+    return g_int64_hash(&k->id) ^ ((guint)k->pid << 8) ^ k->ep;
+}
+
+static gboolean usb_tcp_remote_inflight_equal(gconstpointer a, gconstpointer b)
+{
+    const USBTCPInflightPacket *ka = a;
+    const USBTCPInflightPacket *kb = b;
+
+    return ka->pid == kb->pid && ka->ep == kb->ep && ka->id == kb->id;
+}
+
+/* Called with queue_mutex held */
 static USBTCPInflightPacket *usb_tcp_remote_find_inflight_packet(USBTCPRemoteState *s,
                                                                  int pid,
                                                                  uint8_t ep,
                                                                  uint64_t id)
 {
-    USBTCPInflightPacket *p;
+    USBTCPInflightPacket key = { .pid = pid, .ep = ep, .id = id };
+
+    return g_hash_table_lookup(s->inflight, &key);
+}
+
+static void usb_tcp_remote_add_inflight_packet(USBTCPRemoteState *s,
+                                               USBTCPInflightPacket *pkt,
+                                               USBPacket *p)
+{
+    pkt->p = p;
+    pkt->pid = p->pid;
+    pkt->ep = p->ep->nr;
+    pkt->id = p->id;
+    pkt->addr = USB_DEVICE(s)->addr;
+    qatomic_mb_set(&pkt->handled, 0);
+    qemu_event_init(&pkt->done, false);
 
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
-        QTAILQ_FOREACH(p, &s->queue, queue) {
-            if (p->p->pid == pid && p->p->ep->nr == ep && p->p->id == id) {
-                return p;
-            }
+        g_hash_table_add(s->inflight, pkt);
+    }
+}
+
+static void usb_tcp_remote_del_inflight_packet(USBTCPRemoteState *s,
+                                               USBTCPInflightPacket *pkt)
+{
+    WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
+        /* A later submission with the same key may have replaced us */
+        if (g_hash_table_lookup(s->inflight, pkt) == pkt) {
+            g_hash_table_remove(s->inflight, pkt);
+        }
+        if (s->inflight_waiter) {
+            aio_co_wake(s->inflight_waiter);
+            s->inflight_waiter = NULL;
         }
     }
+    qemu_event_destroy(&pkt->done);
+}
+
+static void usb_tcp_remote_clean_inflight_one(gpointer key, gpointer value,
+                                              gpointer opaque)
+{
+    USBTCPInflightPacket *p = value;
 
-    return NULL;
+    p->p->status = USB_RET_STALL;
+    qatomic_mb_set(&p->handled, 1);
+    qemu_event_set(&p->done);
+    /* Will be cleaned by usb_tcp_remote_handle_packet */
 }
 
 static void usb_tcp_remote_clean_inflight_queue(USBTCPRemoteState *s)
 {
-    USBTCPInflightPacket *p;
-
     WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
-        QTAILQ_FOREACH(p, &s->queue, queue) {
-            p->p->status = USB_RET_STALL;
-            qatomic_mb_set(&p->handled, 1);
-            /* Will be cleaned by usb_tcp_remote_handle_packet */
-        }
+        g_hash_table_foreach(s->inflight, usb_tcp_remote_clean_inflight_one,
+                             NULL);
     }
 }
 
@@ -78,19 +131,22 @@ static void usb_tcp_remote_clean_completed_queue(USBTCPRemoteState *s)
     }
 }
 
+/* Runs in the main loop once the reader has stopped using the channel */
 static void usb_tcp_remote_cleanup(void *opaque)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(opaque);
 
-    if (s->fd == -1) {
+    if (s->ioc == NULL) {
         return;
     }
 
-    close(s->fd);
+    qio_channel_close(s->ioc, NULL);
+    object_unref(OBJECT(s->ioc));
+    s->ioc = NULL;
 
-    s->fd = -1;
     s->closed = true;
     s->addr = 0;
+    tcp_usb_shm_destroy(&s->shm);
 
     usb_tcp_remote_clean_completed_queue(s);
 
@@ -98,7 +154,6 @@ static void usb_tcp_remote_cleanup(void *opaque)
         usb_device_detach(USB_DEVICE(s));
     }
 
-    qemu_cond_broadcast(&s->cond);
     migrate_del_blocker(s->migration_blocker);
 }
 
@@ -148,237 +203,368 @@ static void usb_tcp_remote_completed_bh(void *opaque)
     }
 }
 
+/*
+ * Mark the connection dead and wake up everyone waiting on it. The reader
+ * notices the shutdown and schedules usb_tcp_remote_cleanup. Safe to call
+ * from the main loop and from the reader.
+ */
 static void usb_tcp_remote_closed(USBTCPRemoteState *s)
 {
-    if (s->fd == -1) {
+    if (qatomic_xchg(&s->closed, true)) {
         return;
     }
 
-    s->closed = true;
-    smp_wmb();
-
     DPRINTF("%s\n", __func__);
     /* Cleanup inflights, otherwise mainloop is stuck */
     usb_tcp_remote_clean_inflight_queue(s);
-    qemu_bh_schedule(s->cleanup_bh);
+    if (s->ioc) {
+        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
+    }
 }
 
-static int usb_tcp_remote_read(USBTCPRemoteState *s, void *buffer, unsigned int length)
+static bool coroutine_fn usb_tcp_remote_read(USBTCPRemoteState *s,
+                                             void *buffer,
+                                             unsigned int length)
 {
-    int ret = 0;
-    int n = 0;
-    bool locked = qemu_mutex_iothread_locked();
-    if (locked) {
-        qemu_mutex_unlock_iothread();
-    }
+    Error *err = NULL;
 
-    while (n < length) {
-        ret = read(s->fd, (char *)buffer + n, length - n);
-        if (ret <= 0) {
-            if (locked) {
-                qemu_mutex_lock_iothread();
-            }
-            usb_tcp_remote_closed(s);
-            return -errno;
+    if (qio_channel_read_all_eof(s->ioc, buffer, length, &err) <= 0) {
+        if (err && !qatomic_read(&s->closed)) {
+            error_report_err(err);
+        } else {
+            error_free(err);
         }
+        usb_tcp_remote_closed(s);
+        return false;
+    }
 
-        n += ret;
+    return true;
+}
+
+static int usb_tcp_remote_writev(USBTCPRemoteState *s, struct iovec *iov,
+                                 unsigned int niov)
+{
+    Error *err = NULL;
+
+    if (s->ioc == NULL || qatomic_read(&s->closed)) {
+        return -EPIPE;
     }
 
-    if (locked) {
-        qemu_mutex_lock_iothread();
+    if (qio_channel_writev_all(s->ioc, iov, niov, &err) < 0) {
+        error_free(err);
+        usb_tcp_remote_closed(s);
+        return -EIO;
     }
 
-    return n;
+    return iov_size(iov, niov);
 }
 
 static int usb_tcp_remote_write(USBTCPRemoteState *s, void *buffer,
                                 unsigned int length)
 {
-    int ret = 0;
-    int n = 0;
+    struct iovec iov = { .iov_base = buffer, .iov_len = length };
 
-    while (n < length) {
-        ret = write(s->fd, (char *)buffer + n, length - n);
-        if (ret <= 0) {
-            usb_tcp_remote_closed(s);
-            return -errno;
-        }
+    return usb_tcp_remote_writev(s, &iov, 1);
+}
 
-        n += ret;
+/* Whether the endpoint is a Unix socket with a filesystem path */
+static bool usb_tcp_remote_is_unix_path(USBTCPRemoteState *s)
+{
+    if (s->saddr->type != SOCKET_ADDRESS_TYPE_UNIX) {
+        return false;
+    }
+#ifdef CONFIG_LINUX
+    if (s->saddr->u.q_unix.abstract) {
+        return false;
     }
+#endif
+    return true;
+}
 
-    return n;
+static void usb_tcp_remote_init_header(tcp_usb_header_t *hdr, uint8_t type)
+{
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->type = type;
+    hdr->version = TCP_USB_VERSION;
 }
 
-static bool usb_tcp_remote_read_one(USBTCPRemoteState *s)
+/* Create the payload rings and hand them to the host along with TCP_USB_SHM */
+static void usb_tcp_remote_offer_shm(USBTCPRemoteState *s)
 {
-    tcp_usb_header_t hdr = { 0 };
+    tcp_usb_header_t hdr;
+    struct iovec iov = { .iov_base = &hdr, .iov_len = sizeof(hdr) };
+    Error *err = NULL;
 
-    if (usb_tcp_remote_read(s, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-        return false;
+    /* The rings are passed as SCM_RIGHTS, which needs a Unix socket */
+    if (!s->shm_size || s->saddr->type != SOCKET_ADDRESS_TYPE_UNIX) {
+        return;
     }
 
-    switch (hdr.type) {
-    case TCP_USB_RESPONSE: {
-        tcp_usb_response_header rhdr = { 0 };
-        USBPacket *p = NULL;
-        USBTCPInflightPacket *pkt = NULL;
-        bool cancelled = false;
+    if (!tcp_usb_shm_create(&s->shm, s->shm_size, &err)) {
+        warn_reportf_err(err, "%s: falling back to socket transfers: ",
+                         TYPE_USB_TCP_REMOTE);
+        return;
+    }
 
-        if (usb_tcp_remote_read(s, &rhdr, sizeof(rhdr)) < sizeof(rhdr)) {
-            return false;
-        }
+    usb_tcp_remote_init_header(&hdr, TCP_USB_SHM);
+    hdr.length = s->shm_size;
+    tcp_usb_header_to_wire(&hdr);
 
-        smp_rmb();
-        pkt = usb_tcp_remote_find_inflight_packet(s, rhdr.pid, rhdr.ep, rhdr.id);
-        if (pkt == NULL) {
-            p = usb_ep_find_packet_by_id(USB_DEVICE(s), rhdr.pid, rhdr.ep, rhdr.id);
-        } else {
-            p = pkt->p;
-        }
-        DPRINTF("%s: TCP_USB_RESPONSE "
-                    "Received packet pid: 0x%x ep: 0x%x id: 0x%" PRIx64
-                    " status: %d\n",
-                    __func__, rhdr.pid, rhdr.ep, rhdr.id, rhdr.status);
+    if (qio_channel_writev_full_all(s->ioc, &iov, 1, &s->shm.fd, 1, 0,
+                                    &err) < 0) {
+        warn_reportf_err(err, "%s: failed to send shared-memory rings: ",
+                         TYPE_USB_TCP_REMOTE);
+        tcp_usb_shm_destroy(&s->shm);
+    }
+}
 
-        if (p == NULL) {
-            warn_report("%s: TCP_USB_RESPONSE "
-                        "Invalid packet pid: 0x%x ep: 0x%x id: 0x%" PRIx64 "\n",
-                        __func__, rhdr.pid, rhdr.ep, rhdr.id);
-            //__builtin_dump_struct(&rhdr, &printf);
-            /* likely canceled */
-            /* When an EP is aborted, all of its queued packets are removed */ 
-        }
+/*
+ * Apply a response to @p, which is owned by the caller: either through
+ * @pkt, whose submitter is blocked waiting for it, or through the BQL.
+ * Returns false on a protocol error; the caller must then close the
+ * connection once it has dropped its locks.
+ */
+static bool usb_tcp_remote_apply_response(USBTCPRemoteState *s,
+                                          USBPacket *p,
+                                          USBTCPInflightPacket *pkt,
+                                          tcp_usb_header_t *rhdr,
+                                          struct iovec *data, int ndata)
+{
+    bool cancelled = false;
+
+    DPRINTF("%s: TCP_USB_RESPONSE "
+                "Received packet pid: 0x%x ep: 0x%x id: 0x%" PRIx64
+                " status: %d\n",
+                __func__, rhdr->pid, rhdr->ep, rhdr->id, rhdr->status);
+
+    if (p == NULL) {
+        warn_report("%s: TCP_USB_RESPONSE "
+                    "Invalid packet pid: 0x%x ep: 0x%x id: 0x%" PRIx64 "\n",
+                    __func__, rhdr->pid, rhdr->ep, rhdr->id);
+        /* likely canceled */
+        /* When an EP is aborted, all of its queued packets are removed */
+        return true;
+    }
 
-        if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC) {
-            g_autofree void *buffer = g_malloc(rhdr.length);
-            if (rhdr.pid == USB_TOKEN_IN) {
-                if (usb_tcp_remote_read(s, buffer, rhdr.length) < rhdr.length) {
-                    return false;
-                }
-                if (p) {
-                    usb_packet_copy(p, buffer, rhdr.length);
-                }
-            } else if (p) {
-                p->actual_length += rhdr.length;
-            }
+    if (ndata) {
+        for (int i = 0; i < ndata; i++) {
+            usb_packet_copy(p, data[i].iov_base, data[i].iov_len);
         }
-
-        if (!p) {
-            return true;
+    } else if (rhdr->length > 0 && rhdr->status != USB_RET_ASYNC
+               && rhdr->pid != USB_TOKEN_IN) {
+        p->actual_length += rhdr->length;
+    }
+
+    p->status = rhdr->status;
+    if (p->state == USB_PACKET_ASYNC) {
+        if (p->status == USB_RET_NAK || p->status == USB_RET_ASYNC) {
+                fprintf(stderr,
+                        "%s: TCP_USB_RESPONSE "
+                        "USB_RET_NAK|ASYNC an ASYNC packet", __func__);
+                return false;
         }
+    }
+    if (p->state == USB_PACKET_QUEUED) {
+        if (p->status == USB_RET_NAK) {
+            p->status = USB_RET_IOERROR;
+        }
+    }
+    if (p->state == USB_PACKET_CANCELED) {
+        cancelled = true;
+    }
+    if (((p->status != USB_RET_SUCCESS
+        && p->status != USB_RET_ASYNC
+        && p->status != USB_RET_NAK) || cancelled)
+        && p->ep->nr == 0
+        && p->pid == USB_TOKEN_IN) {
+        s->addr = USB_DEVICE(s)->addr;
+    }
+    if (pkt) {
+        pkt->addr = rhdr->addr;
+        qatomic_mb_set(&pkt->handled, 1);
+        qemu_event_set(&pkt->done);
+    } else if (p->status != USB_RET_ASYNC && !cancelled) {
+        USBTCPCompletedPacket *c = g_malloc0(sizeof(USBTCPCompletedPacket));
+        c->p = p;
+        c->addr = rhdr->addr;
+        WITH_QEMU_LOCK_GUARD(&s->completed_queue_mutex) {
+            QTAILQ_INSERT_TAIL(&s->completed_queue, c, queue);
+        }
+        qemu_bh_schedule(s->completed_bh);
+    }
+    return true;
+}
 
-        p->status = rhdr.status;
-        if (p->state == USB_PACKET_ASYNC) {
-            if (p->status == USB_RET_NAK || p->status == USB_RET_ASYNC) {
-                    fprintf(stderr,
-                            "%s: TCP_USB_RESPONSE "
-                            "USB_RET_NAK|ASYNC an ASYNC packet", __func__);
-                    usb_tcp_remote_closed(s);
-                    return false;
-            }
+static bool coroutine_fn usb_tcp_remote_read_one(USBTCPRemoteState *s)
+{
+    tcp_usb_header_t rhdr = { 0 };
+    struct iovec data[2];
+    int ndata = 0;
+    bool ok;
+
+    if (!usb_tcp_remote_read(s, &rhdr, sizeof(rhdr))) {
+        return false;
+    }
+    tcp_usb_header_from_wire(&rhdr);
+
+    if (rhdr.version != TCP_USB_VERSION) {
+        warn_report("%s: unsupported protocol version %u (expected %u)",
+                    __func__, rhdr.version, TCP_USB_VERSION);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    if (rhdr.type != TCP_USB_RESPONSE) {
+        DPRINTF("%s: Invalid header type: 0x%x\n", __func__, rhdr.type);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    if (rhdr.length > TCP_USB_MAX_PAYLOAD) {
+        warn_report("%s: TCP_USB_RESPONSE payload too large: %u",
+                    __func__, rhdr.length);
+        usb_tcp_remote_closed(s);
+        return false;
+    }
+
+    if (rhdr.flags & TCP_USB_FLAG_SHM) {
+        if (tcp_usb_shm_active(&s->shm)) {
+            ndata = tcp_usb_shm_ring_peek(&s->shm.rings[TCP_USB_SHM_TO_REMOTE],
+                                          rhdr.length, data);
         }
-        if (p->state == USB_PACKET_QUEUED) {
-            if (p->status == USB_RET_NAK) {
-                p->status = USB_RET_IOERROR;
-            }
+        if (ndata == 0) {
+            warn_report("%s: TCP_USB_RESPONSE "
+                        "shared ring payload of %u bytes missing",
+                        __func__, rhdr.length);
+            usb_tcp_remote_closed(s);
+            return false;
+        }
+    } else if (rhdr.length > 0 && rhdr.status != USB_RET_ASYNC
+               && rhdr.pid == USB_TOKEN_IN) {
+        /* Read without any lock held, the packet may go away meanwhile */
+        if (s->rx_buffer_size < rhdr.length) {
+            s->rx_buffer = g_realloc(s->rx_buffer, rhdr.length);
+            s->rx_buffer_size = rhdr.length;
         }
-        if (p->state == USB_PACKET_CANCELED) {
-            cancelled = true;
+        if (!usb_tcp_remote_read(s, s->rx_buffer, rhdr.length)) {
+            return false;
         }
-        if (((p->status != USB_RET_SUCCESS
-            && p->status != USB_RET_ASYNC
-            && p->status != USB_RET_NAK) || cancelled)
-            && p->ep->nr == 0
-            && p->pid == USB_TOKEN_IN) {
-            s->addr = USB_DEVICE(s)->addr;
+        data[0].iov_base = s->rx_buffer;
+        data[0].iov_len = rhdr.length;
+        ndata = 1;
+    }
+
+    for (;;) {
+        USBTCPInflightPacket *pkt;
+        USBPacket *p;
+
+        qemu_mutex_lock(&s->queue_mutex);
+        pkt = usb_tcp_remote_find_inflight_packet(s, rhdr.pid, rhdr.ep,
+                                                  rhdr.id);
+        if (pkt && !qatomic_mb_read(&pkt->handled)) {
+            /* The submitter is blocked on pkt->done and owns the packet */
+            ok = usb_tcp_remote_apply_response(s, pkt->p, pkt, &rhdr,
+                                               data, ndata);
+            qemu_mutex_unlock(&s->queue_mutex);
+            break;
         }
+
         if (pkt) {
-            pkt->addr = rhdr.addr;
-            qatomic_mb_set(&pkt->handled, 1);
-        } else if (p->status != USB_RET_ASYNC && !cancelled) {
-            USBTCPCompletedPacket *c = g_malloc0(sizeof(USBTCPCompletedPacket));
-            c->p = p;
-            c->addr = rhdr.addr;
-            smp_wmb();
-            WITH_QEMU_LOCK_GUARD(&s->completed_queue_mutex) {
-                QTAILQ_INSERT_TAIL(&s->completed_queue, c, queue);
-                qemu_cond_broadcast(&s->completed_queue_cond);
-            }
-            smp_wmb();
-            qemu_bh_schedule(s->completed_bh);
+            /*
+             * The submitter got USB_RET_ASYNC and has not yet handed the
+             * packet back to the core; it will be on the endpoint queue
+             * once it drops its entry, which wakes us up. The wakeup is
+             * scheduled in our context, so it cannot run before we yield.
+             */
+            s->inflight_waiter = qemu_coroutine_self();
+            qemu_mutex_unlock(&s->queue_mutex);
+            qemu_coroutine_yield();
+            continue;
         }
-        return true;
+        qemu_mutex_unlock(&s->queue_mutex);
+
+        qemu_mutex_lock_iothread();
+        p = usb_ep_find_packet_by_id(USB_DEVICE(s), rhdr.pid, rhdr.ep,
+                                     rhdr.id);
+        ok = usb_tcp_remote_apply_response(s, p, NULL, &rhdr, data, ndata);
+        qemu_mutex_unlock_iothread();
+        break;
+    }
+
+    if (rhdr.flags & TCP_USB_FLAG_SHM) {
+        tcp_usb_shm_ring_consume(&s->shm.rings[TCP_USB_SHM_TO_REMOTE],
+                                 rhdr.length);
     }
 
-    case TCP_USB_REQUEST:
-    case TCP_USB_RESET:
-    default:
-        DPRINTF("%s: Invalid header type: 0x%x\n", __func__, hdr.type);
+    if (!ok) {
         usb_tcp_remote_closed(s);
-        return false;
     }
+    return ok;
 }
 
-static void *usb_tcp_remote_read_thread(void *opaque)
+static void coroutine_fn usb_tcp_remote_read_co(void *opaque)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(opaque);
 
-    qemu_mutex_lock_iothread();
-    while (usb_tcp_remote_read_one(s) && !s->closed) {
+    while (!qatomic_read(&s->closed) && usb_tcp_remote_read_one(s)) {
         continue;
     }
-    qemu_mutex_unlock_iothread();
 
-    return NULL;
+    usb_tcp_remote_closed(s);
+    qio_channel_detach_aio_context(s->ioc);
+    qemu_bh_schedule(s->cleanup_bh);
+
+    qatomic_set(&s->reader_running, false);
+    qemu_event_set(&s->reader_done);
 }
 
-static void *usb_tcp_remote_thread(void *arg)
+static void usb_tcp_remote_accept(QIONetListener *listener,
+                                  QIOChannelSocket *sioc,
+                                  gpointer opaque)
 {
-    USBTCPRemoteState *s = USB_TCP_REMOTE(arg);
-
-    while (!s->stopped) {
-        if (s->closed) {
-            struct sockaddr_un addr = { 0 };
-            unsigned int addr_sz = sizeof(addr);
-
-            DPRINTF("%s: waiting on accept...\n", __func__);
-
-            s->fd = accept(s->socket, (struct sockaddr *) &addr, &addr_sz);
-            if (s->fd < 0) {
-                DPRINTF("%s: accept error %d.\n", __func__, errno);
-                continue;
-            }
-            migrate_add_blocker(s->migration_blocker, NULL);
-
-            s->closed = 0;
+    USBTCPRemoteState *s = USB_TCP_REMOTE(opaque);
+    Coroutine *co;
 
-            qemu_cond_broadcast(&s->cond);
+    if (s->ioc || s->stopped) {
+        /* One host at a time, the previous one may still be tearing down */
+        warn_report("%s: rejecting connection, device is busy",
+                    TYPE_USB_TCP_REMOTE);
+        return;
+    }
 
-            DPRINTF("%s: USB device accepted!\n", __func__);
+    DPRINTF("%s: USB device accepted!\n", __func__);
 
-            qemu_mutex_lock_iothread();
-            usb_device_attach(USB_DEVICE(s), &error_abort);
-            qemu_mutex_unlock_iothread();
-            qemu_thread_create(&s->read_thread, TYPE_USB_TCP_REMOTE ".read",
-                               usb_tcp_remote_read_thread, s,
-                               QEMU_THREAD_JOINABLE);
-        }
+    object_ref(OBJECT(sioc));
+    s->ioc = QIO_CHANNEL(sioc);
+    qio_channel_set_name(s->ioc, TYPE_USB_TCP_REMOTE ".conn");
+    if (s->saddr->type == SOCKET_ADDRESS_TYPE_INET) {
+        qio_channel_set_delay(s->ioc, false);
+    }
+    migrate_add_blocker(s->migration_blocker, NULL);
 
-        while (!s->closed) {
-            qemu_cond_wait(&s->cond, &s->mutex);
-        }
+    s->closed = false;
+    usb_tcp_remote_offer_shm(s);
 
-        qemu_mutex_unlock(&s->mutex);
+    /*
+     * Bulk OUT transfers carry their data with the request, so let
+     * the host controller keep several of them in flight.
+     */
+    for (int i = 1; i < USB_MAX_ENDPOINTS; i++) {
+        usb_ep_get(USB_DEVICE(s), USB_TOKEN_OUT, i)->pipeline = true;
     }
+    usb_device_attach(USB_DEVICE(s), &error_abort);
 
-    return NULL;
+    qio_channel_set_blocking(s->ioc, false, NULL);
+    qio_channel_attach_aio_context(s->ioc, s->ctx);
+
+    s->reader_running = true;
+    qemu_event_reset(&s->reader_done);
+    co = qemu_coroutine_create(usb_tcp_remote_read_co, s);
+    aio_co_schedule(s->ctx, co);
 }
 
 static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
 {
-    struct sockaddr_un ai;
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
 
     dev->speed = USB_SPEED_HIGH;
@@ -386,94 +572,141 @@ static void usb_tcp_remote_realize(USBDevice *dev, Error **errp)
     dev->flags |= (1 << USB_DEV_FLAG_IS_HOST);
     dev->auto_attach = 0;
 
-    qemu_cond_init(&s->cond);
-    qemu_mutex_init(&s->mutex);
-    qemu_mutex_init(&s->request_mutex);
+    s->closed = true;
+    s->shm.fd = -1;
 
-    qemu_mutex_init(&s->queue_mutex);
-    QTAILQ_INIT(&s->queue);
+    if (s->shm_size && (s->shm_size < TCP_USB_SHM_MIN_RING
+                        || !is_power_of_2(s->shm_size))) {
+        error_setg(errp, "shm-size must be a power of two of at least %u",
+                   (unsigned)TCP_USB_SHM_MIN_RING);
+        return;
+    }
 
-    qemu_mutex_init(&s->completed_queue_mutex);
-    qemu_cond_init(&s->completed_queue_cond);
-    QTAILQ_INIT(&s->completed_queue);
+    s->saddr = tcp_usb_parse_addr(s->conn_addr, errp);
+    if (!s->saddr) {
+        return;
+    }
 
-    s->completed_bh = qemu_bh_new(usb_tcp_remote_completed_bh, s);
-    s->addr_bh = qemu_bh_new(usb_tcp_remote_update_addr_bh, s);
-    s->cleanup_bh = qemu_bh_new(usb_tcp_remote_cleanup, s);
+    if (usb_tcp_remote_is_unix_path(s)) {
+        const char *path = s->saddr->u.q_unix.path;
+        struct stat fst;
 
-    s->socket = -1;
-    s->fd = -1;
-    s->closed = true;
+        if (stat(path, &fst) == 0 && !S_ISSOCK(fst.st_mode)) {
+            error_setg(errp, "File '%s' already exists and is not a socket "
+                       "file. Refusing to continue.", path);
+            goto fail;
+        }
+    }
 
-    struct stat fst;
-    if (stat(socket_path, &fst) == 0) {
-        if (!S_ISSOCK(fst.st_mode)) {
-            qemu_log_mask(LOG_GUEST_ERROR,
-                          "File '%s' already exists and is not a socket file. "
-                          "Refusing to continue.", socket_path);
-            return;
+    if (s->iothread) {
+        s->ctx = iothread_get_aio_context(s->iothread);
+    } else {
+        static int instance;
+        g_autofree char *id = g_strdup_printf("%s.rx%d", TYPE_USB_TCP_REMOTE,
+                                              instance++);
+
+        s->internal_iothread = iothread_create(id, errp);
+        if (!s->internal_iothread) {
+            goto fail;
         }
+        s->ctx = iothread_get_aio_context(s->internal_iothread);
     }
 
-    if (unlink(socket_path) == -1 && errno != ENOENT) {
-        qemu_log_mask(LOG_GUEST_ERROR, "%s: unlink(%s) failed: %s", __func__,
-                      socket_path, strerror(errno));
-        return;
+    s->listener = qio_net_listener_new();
+    qio_net_listener_set_name(s->listener, TYPE_USB_TCP_REMOTE ".listener");
+    if (qio_net_listener_open_sync(s->listener, s->saddr, 1, errp) < 0) {
+        goto fail;
     }
 
-    s->socket = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (s->socket < 0) {
-        error_setg(errp, "Cannot open socket: %d", s->socket);
-        return;
+    if (usb_tcp_remote_is_unix_path(s)) {
+        chmod(s->saddr->u.q_unix.path, 0666);
     }
 
-    ai.sun_family = AF_UNIX;
-    strncpy(ai.sun_path, socket_path, sizeof(ai.sun_path));
-    ai.sun_path[sizeof(ai.sun_path) - 1] = '\0';
+    qemu_mutex_init(&s->request_mutex);
+    qemu_mutex_init(&s->queue_mutex);
+    s->inflight = g_hash_table_new(usb_tcp_remote_inflight_hash,
+                                   usb_tcp_remote_inflight_equal);
 
-    if (bind(s->socket, (struct sockaddr *)&ai, sizeof(ai)) < 0) {
-        error_setg(errp, "Cannot bind socket");
-        return;
-    }
-    chmod(socket_path, 0666);
+    qemu_mutex_init(&s->completed_queue_mutex);
+    QTAILQ_INIT(&s->completed_queue);
 
-    if (listen(s->socket, 5) < 0) {
-        error_setg(errp, "Cannot listen on socket");
-        return;
-    }
+    qemu_event_init(&s->reader_done, true);
+    s->completed_bh = qemu_bh_new(usb_tcp_remote_completed_bh, s);
+    s->addr_bh = qemu_bh_new(usb_tcp_remote_update_addr_bh, s);
+    s->cleanup_bh = qemu_bh_new(usb_tcp_remote_cleanup, s);
 
     error_setg(&s->migration_blocker, "%s does not support migration "
                                       "while connected", TYPE_USB_TCP_REMOTE);
-    qemu_thread_create(&s->thread, TYPE_USB_TCP_REMOTE ".thread",
-                       &usb_tcp_remote_thread, s, QEMU_THREAD_JOINABLE);
+    qio_net_listener_set_client_func(s->listener, usb_tcp_remote_accept, s,
+                                     NULL);
+    return;
+
+fail:
+    if (s->listener) {
+        object_unref(OBJECT(s->listener));
+        s->listener = NULL;
+    }
+    if (s->internal_iothread) {
+        iothread_destroy(s->internal_iothread);
+        s->internal_iothread = NULL;
+    }
+    qapi_free_SocketAddress(s->saddr);
+    s->saddr = NULL;
 }
 
 static void usb_tcp_remote_unrealize(USBDevice *dev)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
+    bool locked = qemu_mutex_iothread_locked();
+
+    s->stopped = true;
 
-    if (s->socket >= 0) {
-        close(s->socket);
-        s->socket = -1;
+    qio_net_listener_disconnect(s->listener);
+    object_unref(OBJECT(s->listener));
+    s->listener = NULL;
+
+    usb_tcp_remote_closed(s);
+
+    /* The reader may need the BQL to finish the response it is handling */
+    if (qatomic_read(&s->reader_running)) {
+        if (locked) {
+            qemu_mutex_unlock_iothread();
+        }
+        qemu_event_wait(&s->reader_done);
+        if (locked) {
+            qemu_mutex_lock_iothread();
+        }
     }
+    usb_tcp_remote_cleanup(s);
+    usb_tcp_remote_clean_completed_queue(s);
 
-    if (s->fd >= 0) {
-        close(s->fd);
-        s->fd = -1;
+    qemu_bh_delete(s->completed_bh);
+    qemu_bh_delete(s->addr_bh);
+    qemu_bh_delete(s->cleanup_bh);
+    qemu_event_destroy(&s->reader_done);
+    error_free(s->migration_blocker);
+    s->migration_blocker = NULL;
+
+    if (s->internal_iothread) {
+        iothread_destroy(s->internal_iothread);
+        s->internal_iothread = NULL;
     }
 
-    s->closed = true;
+    g_hash_table_destroy(s->inflight);
+    s->inflight = NULL;
 
-    qemu_cond_broadcast(&s->cond);
+    g_free(s->rx_buffer);
+    s->rx_buffer = NULL;
+    s->rx_buffer_size = 0;
+    tcp_usb_shm_destroy(&s->shm);
 
-    s->stopped = true;
-    usb_tcp_remote_clean_inflight_queue(s);
-    usb_tcp_remote_clean_completed_queue(s);
+    qapi_free_SocketAddress(s->saddr);
+    s->saddr = NULL;
 }
 
 static void usb_tcp_remote_handle_reset(USBDevice *dev)
 {
-    tcp_usb_header_t hdr = { 0 };
+    tcp_usb_header_t hdr;
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
 
     if (s->closed) {
@@ -484,7 +717,8 @@ static void usb_tcp_remote_handle_reset(USBDevice *dev)
     usb_tcp_remote_clean_inflight_queue(s);
     usb_tcp_remote_clean_completed_queue(s);
     s->addr = 0;
-    hdr.type = TCP_USB_RESET;
+    usb_tcp_remote_init_header(&hdr, TCP_USB_RESET);
+    tcp_usb_header_to_wire(&hdr);
 
     WITH_QEMU_LOCK_GUARD(&s->request_mutex) {
         usb_tcp_remote_write(s, &hdr, sizeof(hdr));
@@ -495,10 +729,8 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
     USBTCPInflightPacket inflightPacket = { 0 };
-    tcp_usb_header_t hdr = { 0 };
-    tcp_usb_cancel_header pkt = { 0 };
+    tcp_usb_header_t hdr;
     bool locked = qemu_mutex_iothread_locked();
-    int64_t start;
 
     if (p->combined) {
         usb_combined_packet_cancel(dev, p);
@@ -509,127 +741,163 @@ static void usb_tcp_remote_cancel_packet(USBDevice *dev, USBPacket *p)
         return;
     }
 
-    hdr.type = TCP_USB_CANCEL;
-    pkt.addr = s->addr;
-    pkt.pid = p->pid;
-    pkt.ep = p->ep->nr;
-    pkt.id = p->id;
+    usb_tcp_remote_init_header(&hdr, TCP_USB_CANCEL);
+    hdr.addr = s->addr;
+    hdr.pid = p->pid;
+    hdr.ep = p->ep->nr;
+    hdr.id = p->id;
 
-    DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx\n", __func__, pkt.pid, pkt.ep, pkt.id);
+    DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx\n", __func__, hdr.pid, hdr.ep, hdr.id);
 
-    inflightPacket.p = p;
-    inflightPacket.addr = dev->addr;
-    qatomic_mb_set(&inflightPacket.handled, 0);
-
-    WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
-        QTAILQ_INSERT_TAIL(&s->queue, &inflightPacket, queue);
-    }
+    usb_tcp_remote_add_inflight_packet(s, &inflightPacket, p);
+    tcp_usb_header_to_wire(&hdr);
 
     WITH_QEMU_LOCK_GUARD(&s->request_mutex) {
-        usb_tcp_remote_write(s, &hdr, sizeof(hdr));
-        usb_tcp_remote_write(s, &pkt, sizeof(pkt));
+        if (usb_tcp_remote_write(s, &hdr, sizeof(hdr)) < 0) {
+            goto out;
+        }
     }
-    /* TODO: wait for status */
 
+    /*
+     * The reader coroutine sets inflightPacket.done once the remote end
+     * has answered the cancel, or when the connection goes away.
+     */
     DPRINTF("%s: waiting for response\n", __func__);
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
 
-    start = get_clock_realtime();
-    while ((qatomic_mb_read(&inflightPacket.handled) & 1) == 0) {
-        if (start + NANOSECONDS_PER_SECOND < get_clock_realtime()) {
-            break;
-        }
-    }
+    qemu_event_wait(&inflightPacket.done);
 
     if (locked) {
         qemu_mutex_lock_iothread();
     }
 
-    WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
-        QTAILQ_REMOVE(&s->queue, &inflightPacket, queue);
+out:
+    usb_tcp_remote_del_inflight_packet(s, &inflightPacket);
+}
+
+/*
+ * Send a request frame. @iov[0] is the frame header, the rest is the
+ * OUT/SETUP payload, which goes into the shared ring when there is room.
+ * Must be called with request_mutex held so that ring order matches
+ * frame order. @hdr is converted to wire byte order.
+ */
+static int usb_tcp_remote_send_request(USBTCPRemoteState *s,
+                                       tcp_usb_header_t *hdr,
+                                       struct iovec *iov, unsigned int niov)
+{
+    if (niov > 1 && tcp_usb_shm_active(&s->shm)) {
+        TCPUSBShmRing *ring = &s->shm.rings[TCP_USB_SHM_TO_HOST];
+        struct iovec dst[2];
+        size_t off = 0;
+        int n;
+
+        n = tcp_usb_shm_ring_reserve(ring, hdr->length, dst);
+        if (n > 0) {
+            for (int i = 0; i < n; i++) {
+                iov_to_buf(iov + 1, niov - 1, off, dst[i].iov_base,
+                           dst[i].iov_len);
+                off += dst[i].iov_len;
+            }
+            tcp_usb_shm_ring_commit(ring, hdr->length);
+            hdr->flags |= TCP_USB_FLAG_SHM;
+            niov = 1;
+        }
     }
+
+    tcp_usb_header_to_wire(hdr);
+    return usb_tcp_remote_writev(s, iov, niov);
 }
 
 static void usb_tcp_remote_handle_packet(USBDevice *dev, USBPacket *p)
 {
     USBTCPRemoteState *s = USB_TCP_REMOTE(dev);
-    tcp_usb_header_t hdr = { 0 };
-    tcp_usb_request_header pkt = { 0 };
+    tcp_usb_header_t hdr;
     USBTCPInflightPacket inflightPacket = { 0 };
-    g_autofree void *buffer = NULL;
+    g_autofree struct iovec *iov = NULL;
+    unsigned int niov = 1;
     bool locked = qemu_mutex_iothread_locked();
+    bool pipelined = p->ep->pipeline && p->pid == USB_TOKEN_OUT;
 
     if (s->closed) {
-        p->status = USB_RET_STALL;
+        /*
+         * A pipelined endpoint must never complete synchronously; the
+         * packet is cancelled when the device is detached.
+         */
+        p->status = pipelined ? USB_RET_ASYNC : USB_RET_STALL;
         return;
     }
 
-    hdr.type = TCP_USB_REQUEST;
-    pkt.addr = s->addr;
-    pkt.pid = p->pid;
-    pkt.ep = p->ep->nr;
-    pkt.stream = p->stream;
-    pkt.id = p->id;
-    pkt.short_not_ok = p->short_not_ok;
-    pkt.int_req = p->int_req;
-    pkt.length = p->iov.size - p->actual_length;
-
-    DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx len 0x%x\n", __func__, pkt.pid, pkt.ep, pkt.id, pkt.length);
-
-    if (p->pid != USB_TOKEN_IN && pkt.length) {
-        buffer = g_malloc0(pkt.length);
-        usb_packet_copy(p, buffer, pkt.length);
-        p->actual_length -= pkt.length;
-        if (p->pid == USB_TOKEN_SETUP && p->ep->nr == 0 && buffer) {
-            struct usb_control_packet *setup = (struct usb_control_packet *)buffer;
+    usb_tcp_remote_init_header(&hdr, TCP_USB_REQUEST);
+    hdr.addr = s->addr;
+    hdr.pid = p->pid;
+    hdr.ep = p->ep->nr;
+    hdr.stream = p->stream;
+    hdr.id = p->id;
+    hdr.length = p->iov.size - p->actual_length;
+    if (p->short_not_ok) {
+        hdr.flags |= TCP_USB_FLAG_SHORT_NOT_OK;
+    }
+    if (p->int_req) {
+        hdr.flags |= TCP_USB_FLAG_INT_REQ;
+    }
+    if (pipelined) {
+        hdr.flags |= TCP_USB_FLAG_PIPELINED;
+    }
+
+    DPRINTF("%s: pid: 0x%x ep 0x%x id 0x%llx len 0x%x\n", __func__, hdr.pid, hdr.ep, hdr.id, hdr.length);
+
+    /* Send the frame and the OUT/SETUP payload straight from the packet */
+    iov = g_new(struct iovec, p->iov.niov + 1);
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    if (p->pid != USB_TOKEN_IN && hdr.length) {
+        niov += iov_copy(iov + 1, p->iov.niov, p->iov.iov, p->iov.niov,
+                         p->actual_length, hdr.length);
+        if (p->pid == USB_TOKEN_SETUP && p->ep->nr == 0) {
+            struct usb_control_packet setup = { 0 };
+
+            iov_to_buf(p->iov.iov, p->iov.niov, p->actual_length,
+                       &setup, sizeof(setup));
             #ifdef DEBUG_DEV_TCP_REMOTE
-            qemu_hexdump(stderr, __func__, buffer, pkt.length);
+            qemu_hexdump(stderr, __func__, &setup, sizeof(setup));
             #endif
 
-            if (setup->bmRequestType == 0
-                && setup->bRequest == USB_REQ_SET_ADDRESS) {
-                s->addr = setup->wValue;
+            if (setup.bmRequestType == 0
+                && setup.bRequest == USB_REQ_SET_ADDRESS) {
+                s->addr = setup.wValue;
             }
         }
     }
 
-    inflightPacket.p = p;
-    inflightPacket.addr = dev->addr;
-    qatomic_mb_set(&inflightPacket.handled, 0);
-
-    WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
-        QTAILQ_INSERT_TAIL(&s->queue, &inflightPacket, queue);
+    if (pipelined) {
+        /*
+         * Completed from usb_tcp_remote_completed_bh once the response
+         * comes back. The reader takes the BQL we hold to look the packet
+         * up, so it is queued on the endpoint before it can complete.
+         */
+        p->status = USB_RET_ASYNC;
+        WITH_QEMU_LOCK_GUARD(&s->request_mutex) {
+            usb_tcp_remote_send_request(s, &hdr, iov, niov);
+        }
+        return;
     }
-    /* Retire the writes so that the read thread can find it */
-    smp_wmb();
 
-    WITH_QEMU_LOCK_GUARD(&s->request_mutex) {
-        if (usb_tcp_remote_write(s, &hdr, sizeof(hdr)) < sizeof(hdr)) {
-            p->status = USB_RET_STALL;
-            goto out;
-        }
+    usb_tcp_remote_add_inflight_packet(s, &inflightPacket, p);
 
-        if (usb_tcp_remote_write(s, &pkt, sizeof(pkt)) < sizeof(pkt)) {
+    WITH_QEMU_LOCK_GUARD(&s->request_mutex) {
+        if (usb_tcp_remote_send_request(s, &hdr, iov, niov) < 0) {
             p->status = USB_RET_STALL;
             goto out;
         }
-
-        if (buffer) {
-            if (usb_tcp_remote_write(s, buffer, pkt.length) < pkt.length) {
-                p->status = USB_RET_STALL;
-                goto out;
-            }
-        }
     }
 
     if (locked) {
         qemu_mutex_unlock_iothread();
     }
 
-    while ((qatomic_mb_read(&inflightPacket.handled) & 1) == 0) {
-    }
+    qemu_event_wait(&inflightPacket.done);
 
     if (locked) {
         qemu_mutex_lock_iothread();
@@ -644,12 +912,14 @@ out:
         trace_usb_set_addr(dev->addr);
     }
 
-    WITH_QEMU_LOCK_GUARD(&s->queue_mutex) {
-        QTAILQ_REMOVE(&s->queue, &inflightPacket, queue);
-    }
+    usb_tcp_remote_del_inflight_packet(s, &inflightPacket);
 }
 
 static Property usb_tcp_remote_properties[] = {
+        DEFINE_PROP_STRING("conn-addr", USBTCPRemoteState, conn_addr),
+        DEFINE_PROP_SIZE32("shm-size", USBTCPRemoteState, shm_size, 0),
+        DEFINE_PROP_LINK("iothread", USBTCPRemoteState, iothread,
+                         TYPE_IOTHREAD, IOThread *),
         DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -5,13 +5,23 @@
 #include "hw/usb.h"
 #include "qom/object.h"
 #include "tcp-usb.h"
+#include "tcp-usb-shm.h"
 #include "qemu/main-loop.h"
+#include "qemu/thread.h"
+#include "qemu/coroutine.h"
 #include "qapi/error.h"
+#include "io/channel.h"
+#include "io/net-listener.h"
+#include "sysemu/iothread.h"
 
 typedef struct USBTCPInflightPacket {
     USBPacket *p;
+    /* Lookup key, copied from @p when the packet is submitted */
+    int pid;
+    uint8_t ep;
+    uint64_t id;
     uint64_t handled;
-    QTAILQ_ENTRY(USBTCPInflightPacket) queue;
+    QemuEvent done;
     uint8_t addr;
 } USBTCPInflightPacket;
 
@@ -25,25 +35,46 @@ typedef struct USBTCPCompletedPacket {
 typedef struct USBTCPRemoteState {
     USBDevice parent_obj;
 
-    QemuThread thread;
-    QemuThread read_thread;
-    QemuCond cond;
-    QemuMutex mutex;
+    QIONetListener *listener;
+    QIOChannel *ioc;
+
+    /*
+     * Responses are received by a coroutine in this context. It cannot be
+     * the main loop, which blocks in handle_packet until they arrive.
+     */
+    IOThread *iothread;
+    IOThread *internal_iothread;
+    AioContext *ctx;
+    QemuEvent reader_done;
+    bool reader_running;
+
     QemuMutex request_mutex;
 
+    /* Synchronous submissions waiting for a response, keyed by pid/ep/id */
     QemuMutex queue_mutex;
-    QTAILQ_HEAD(, USBTCPInflightPacket) queue;
+    GHashTable *inflight;
+    /* Reader waiting for a handled entry to be dropped, under queue_mutex */
+    Coroutine *inflight_waiter;
 
     QemuMutex completed_queue_mutex;
-    QemuCond completed_queue_cond;
     QTAILQ_HEAD(, USBTCPCompletedPacket) completed_queue;
     QEMUBH *completed_bh;
     QEMUBH *addr_bh;
     QEMUBH *cleanup_bh;
     Error *migration_blocker;
 
-    int socket;
-    int fd;
+    /* Bounce buffer for IN payloads, grown on demand by the reader */
+    void *rx_buffer;
+    uint32_t rx_buffer_size;
+
+    /* Shared payload rings, only used when shm_size is non-zero */
+    TCPUSBShm shm;
+    uint32_t shm_size;
+
+    /* Listening endpoint, see TCP_USB_DEFAULT_ADDR for the syntax */
+    char *conn_addr;
+    SocketAddress *saddr;
+
     uint8_t addr;
     bool closed;
     bool stopped;
@@ -43,6 +43,7 @@
 #include "qemu/main-loop.h"
 #include "hw/qdev-properties.h"
 #include "qemu/cutils.h"
+#include "qemu/iov.h"
 
 #define USB_HZ_FS       12000000
 #define USB_HZ_HS       96000000
@@ -638,6 +639,63 @@ out:
     return fr;
 }
 
+/*
+ * Unthrottled mode: keep making passes over the bulk channels while they
+ * are moving data rather than waiting for the next frame-timer tick.
+ * Interrupt, control and isochronous channels keep their per-frame
+ * pacing: they are only serviced in the first pass, and at most once per
+ * frame interval. Returns true if any channel was serviced; *@busy is set
+ * when the budget ran out with data still flowing.
+ */
+static bool dwc2_work_unthrottled(DWC2State *s, int64_t t_now, bool *busy)
+{
+    bool periodic = t_now >= s->periodic_due;
+    bool found = false;
+
+    if (periodic) {
+        s->periodic_due = t_now + NANOSECONDS_PER_SECOND / 4000;
+    }
+
+    *busy = false;
+    for (int pass = 0; pass < DWC2_BULK_BUDGET; pass++) {
+        bool moved = false;
+
+        for (int chan = 0; chan < DWC2_NB_CHAN; chan++) {
+            DWC2Packet *p = &s->packet[chan];
+            USBDevice *dev;
+            USBEndpoint *ep;
+            uint32_t hctsiz;
+            bool bulk;
+
+            if (!p->needs_service) {
+                continue;
+            }
+            bulk = get_field(s->hreg1[p->index], HCCHAR_EPTYPE)
+                   == USB_ENDPOINT_XFER_BULK;
+            if (!bulk && (pass > 0 || !periodic)) {
+                /* Still pending: keep the frame timer running for it */
+                found = true;
+                continue;
+            }
+            hctsiz = s->hreg1[p->index + 4];
+            dev = dwc2_find_device(s, p->devadr);
+            ep = usb_ep_get(dev, p->pid, p->epnum);
+            trace_usb_dwc2_work_bh_service(s->next_chan, chan, dev, p->epnum);
+            dwc2_handle_packet(s, p->devadr, dev, ep, p->index, true);
+            found = true;
+            if (bulk && p->needs_service && s->hreg1[p->index + 4] != hctsiz) {
+                moved = true;
+            }
+        }
+        if (!moved) {
+            return found;
+        }
+    }
+
+    *busy = true;
+    return found;
+}
+
 static void dwc2_work_bh(void *opaque)
 {
     DWC2State *s = opaque;
@@ -655,6 +713,23 @@ static void dwc2_work_bh(void *opaque)
     s->working = true;
 
     t_now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+
+    if (s->bulk_unthrottled) {
+        bool busy;
+
+        if (dwc2_work_unthrottled(s, t_now, &busy)) {
+            if (busy) {
+                /* Let the main loop breathe, then carry on immediately */
+                qemu_bh_schedule(s->async_bh);
+            } else {
+                timer_mod(s->frame_timer,
+                          t_now + NANOSECONDS_PER_SECOND / 4000);
+            }
+        }
+        s->working = false;
+        return;
+    }
+
     chan = s->next_chan;
 
     do {
@@ -1200,6 +1275,131 @@ static void dwc2_update_out_ep(DWC2State *s, int ep)
     qemu_bh_schedule(s->device_async_bh);
 }
 
+/* Number of device-mode DMA descriptors fetched per guest memory access */
+#define DWC2_DESC_BATCH     8
+
+/*
+ * Move @len bytes between guest memory at @addr and @p, in the direction
+ * given by the packet pid. Guest memory is mapped and copied straight
+ * into or out of the packet iovec; only memory that cannot be mapped
+ * (e.g. MMIO) goes through a bounce buffer.
+ */
+static MemTxResult dwc2_device_dma_packet(DWC2State *s, USBPacket *p,
+                                          dma_addr_t addr, dma_addr_t len)
+{
+    DMADirection dir = p->pid == USB_TOKEN_IN ? DMA_DIRECTION_TO_DEVICE
+                                              : DMA_DIRECTION_FROM_DEVICE;
+
+    while (len > 0) {
+        dma_addr_t xlen = len;
+        void *mem = dma_memory_map(&s->dma_as, addr, &xlen, dir,
+                                   MEMTXATTRS_UNSPECIFIED);
+
+        if (mem == NULL) {
+            g_autofree void *buffer = g_malloc0(len);
+            MemTxResult res;
+
+            if (dir == DMA_DIRECTION_TO_DEVICE) {
+                res = dma_memory_read(&s->dma_as, addr, buffer, len,
+                                      MEMTXATTRS_UNSPECIFIED);
+                usb_packet_copy(p, buffer, len);
+            } else {
+                usb_packet_copy(p, buffer, len);
+                res = dma_memory_write(&s->dma_as, addr, buffer, len,
+                                       MEMTXATTRS_UNSPECIFIED);
+            }
+            return res;
+        }
+
+        usb_packet_copy(p, mem, xlen);
+        dma_memory_unmap(&s->dma_as, mem, xlen, dir, xlen);
+        addr += xlen;
+        len -= xlen;
+    }
+    return MEMTX_OK;
+}
+
+/*
+ * Run a descriptor-DMA transfer of up to @pktsize bytes for @p, starting
+ * at the descriptor *@dma and advancing it past every descriptor that was
+ * consumed. Descriptors are prefetched and written back DWC2_DESC_BATCH
+ * at a time. Returns the number of bytes transferred.
+ */
+static uint32_t dwc2_device_desc_xfer(DWC2State *s, USBPacket *p,
+                                      uint32_t *dma, uint32_t pktsize,
+                                      int mps)
+{
+    struct dwc2_dma_desc desc[DWC2_DESC_BATCH];
+    uint32_t done = 0;
+    bool last = false;
+
+    while (!last) {
+        int n = DWC2_DESC_BATCH;
+        int i;
+
+        /* A full batch may run past the end of the ring's memory */
+        while (n > 0 && dma_memory_read(&s->dma_as, *dma, desc,
+                                        n * sizeof(desc[0]),
+                                        MEMTXATTRS_UNSPECIFIED) != MEMTX_OK) {
+            n >>= 1;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        for (i = 0; i < n && !last; i++) {
+            uint32_t nbytes, amtDone;
+
+            if (DEV_DMA_BUFF_STS_GET(desc[i].status)) {
+                last = true;
+                break;
+            }
+            nbytes = desc[i].status & DEV_DMA_NBYTES_MASK;
+            if (done + nbytes >= pktsize) {
+                amtDone = pktsize - done;
+                nbytes -= amtDone;
+                if (p->pid != USB_TOKEN_IN) {
+                    if ((done + amtDone) % mps || (done + amtDone) == 0) {
+                        desc[i].status |= DEV_DMA_SHORT;
+                    }
+                    if (p->pid == USB_TOKEN_SETUP) {
+                        desc[i].status |= DEV_DMA_SR;
+                    }
+                }
+                desc[i].status |= DEV_DMA_L;
+            } else {
+                amtDone = nbytes;
+                nbytes = 0;
+            }
+            if (amtDone > 0
+                && dwc2_device_dma_packet(s, p, desc[i].buf,
+                                          amtDone) != MEMTX_OK) {
+                qemu_log_mask(LOG_GUEST_ERROR,
+                              "%s: DMA to/from 0x%x failed\n",
+                              __func__, desc[i].buf);
+            }
+            done += amtDone;
+
+            desc[i].status &= ~DEV_DMA_NBYTES_MASK;
+            desc[i].status |= nbytes & DEV_DMA_NBYTES_MASK;
+            desc[i].status &= ~DEV_DMA_BUFF_STS_MASK;
+            desc[i].status |= DEV_DMA_BUFF_STS_DMADONE
+                              << DEV_DMA_BUFF_STS_SHIFT;
+            if (desc[i].status & DEV_DMA_L) {
+                last = true;
+            }
+        }
+
+        if (i > 0) {
+            dma_memory_write(&s->dma_as, *dma, desc, i * sizeof(desc[0]),
+                             MEMTXATTRS_UNSPECIFIED);
+            *dma += i * sizeof(desc[0]);
+        }
+    }
+
+    return done;
+}
+
 static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
 {
     int ep = p->ep->nr;
@@ -1220,7 +1420,6 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
         }
         if (s->diepctl(ep) & DXEPCTL_EPENA) {
             int sz, amtDone, pktcnt, txfz, mps, fifo;
-            g_autofree void *buffer = NULL;
             // IN transfer
             fifo = DXEPCTL_TXFNUM_GET(s->diepctl(ep));
             if (ep == 0) {
@@ -1250,56 +1449,14 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
             }
 
             if (s->dcfg & DCFG_DESCDMA_EN) {
-                struct dwc2_dma_desc desc;
-                dma_addr_t residual;
-                QEMUSGList sglist;
-                bool ioc = false;
-                qemu_sglist_init(&sglist, DEVICE(s),
-                                 MAX_DMA_DESC_NUM_GENERIC, &s->dma_as);
-                while (dma_memory_read(&s->dma_as, s->diepdma(ep), &desc,
-                                       sizeof(desc),
-                                       MEMTXATTRS_UNSPECIFIED) == MEMTX_OK) {
-                    uint32_t amtDone = 0;
-                    if (DEV_DMA_BUFF_STS_GET(desc.status)) {
-                        break;
-                    }
-                    dma_addr_t nbytes = desc.status & DEV_DMA_NBYTES_MASK;
-                    if (sglist.size + nbytes >= pktsize) {
-                        amtDone += pktsize - sglist.size;
-                        nbytes -= pktsize - sglist.size;
-                        desc.status |= DEV_DMA_L;
-                    } else {
-                        amtDone += nbytes;
-                        nbytes = 0;
-                    }
-                    desc.status &= ~DEV_DMA_NBYTES_MASK;
-                    desc.status |= nbytes & DEV_DMA_NBYTES_MASK;
-                    qemu_sglist_add(&sglist, desc.buf, amtDone);
-                    ioc |= (desc.status & DEV_DMA_IOC) != 0;
-                    desc.status &= ~DEV_DMA_BUFF_STS_MASK;
-                    desc.status |= DEV_DMA_BUFF_STS_DMADONE << DEV_DMA_BUFF_STS_SHIFT;
-                    dma_memory_write(&s->dma_as, s->diepdma(ep), &desc,
-                                     sizeof(desc), MEMTXATTRS_UNSPECIFIED);
-                    s->diepdma(ep) += sizeof(desc);
-                    if (desc.status & DEV_DMA_L) {
-                        break;
-                    }
-                }
-                #if 0
-                qemu_log_mask(LOG_UNIMP, "%s: starting IN transfer on EP %d (%zu/%d)...\n",
-                                __func__, ep, sglist.size, pktsize);
-                #endif
-                buffer = g_malloc0(sglist.size);
-                dma_buf_write(buffer, sglist.size, &residual, &sglist,
-                              MEMTXATTRS_UNSPECIFIED);
-                amtDone = sglist.size - residual;
-                usb_packet_copy(p, buffer, amtDone);
+                amtDone = dwc2_device_desc_xfer(s, p, &s->diepdma(ep),
+                                                pktsize, mps);
                 #if 0
-                qemu_hexdump(stderr, __func__, buffer, sglist.size);
+                qemu_log_mask(LOG_UNIMP, "%s: IN transfer on EP %d (%d/%d)\n",
+                              __func__, ep, amtDone, pktsize);
                 #endif
                 s->diepctl(ep) &= ~DXEPCTL_EPENA;
                 s->diepint(ep) |= DXEPINT_XFERCOMPL;
-                qemu_sglist_destroy(&sglist);
             } else {
                 amtDone = sz;
                 txfz = dwc2_tx_fifo_size(s, fifo);
@@ -1320,16 +1477,13 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
                                     p->iov.size, sz, pktcnt);
                 #endif
                 if (amtDone > 0) {
-                    g_autofree void *buffer = g_malloc0(amtDone);
                     if (s->diepdma(ep)) {
-                        dma_memory_read(&s->dma_as, s->diepdma(ep), buffer,
-                                        amtDone, MEMTXATTRS_UNSPECIFIED);
+                        dwc2_device_dma_packet(s, p, s->diepdma(ep), amtDone);
                         s->diepdma(ep) += amtDone;
+                    } else {
+                        g_autofree void *buffer = g_malloc0(amtDone);
+                        usb_packet_copy(p, buffer, amtDone);
                     }
-                #if 0
-                    qemu_hexdump(stderr, __func__, buffer, amtDone);
-                #endif
-                    usb_packet_copy(p, buffer, amtDone);
                     pktcnt -= (amtDone - 1 + mps) / mps;
                 } else if (pktsize == 0) {
                     pktcnt -= 1;
@@ -1382,7 +1536,7 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
         if (s->doepctl(ep) & DXEPCTL_EPENA) {
             int sz, pktcnt, supcnt, mps;
             uint32_t amtDone = 0;
-            g_autofree void *buffer = NULL;
+            size_t start = p->actual_length;
 
             if (ep == 0) {
                 sz = DOEPTSIZ0_XFERSIZE_GET(s->doeptsiz(ep));
@@ -1413,62 +1567,12 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
             }
 
             if (s->dcfg & DCFG_DESCDMA_EN) {
-                struct dwc2_dma_desc desc;
-                QEMUSGList sglist;
-                bool ioc = false;
-                dma_addr_t residual;
-                qemu_sglist_init(&sglist, DEVICE(s),
-                                 MAX_DMA_DESC_NUM_GENERIC, &s->dma_as);
-                while (dma_memory_read(&s->dma_as, s->doepdma(ep), &desc,
-                                       sizeof(desc),
-                                       MEMTXATTRS_UNSPECIFIED) == MEMTX_OK) {
-                    uint32_t amtDone = 0;
-                    if (DEV_DMA_BUFF_STS_GET(desc.status)) {
-                        break;
-                    }
-                    dma_addr_t nbytes = desc.status & DEV_DMA_NBYTES_MASK;
-                    if (sglist.size + nbytes >= pktsize) {
-                        amtDone += pktsize - sglist.size;
-                        nbytes -= pktsize - sglist.size;
-                        if ((sglist.size + amtDone) % mps
-                            || (sglist.size + amtDone) == 0) {
-                            desc.status |= DEV_DMA_SHORT;
-                        }
-                        if (p->pid == USB_TOKEN_SETUP) {
-                            desc.status |= DEV_DMA_SR;
-                        }
-                        desc.status |= DEV_DMA_L;
-                    } else {
-                        amtDone += nbytes;
-                        nbytes = 0;
-                    }
-                    qemu_sglist_add(&sglist, desc.buf, amtDone);
-                    desc.status &= ~DEV_DMA_NBYTES_MASK;
-                    desc.status |= nbytes & DEV_DMA_NBYTES_MASK;
-                    desc.status &= ~DEV_DMA_BUFF_STS_MASK;
-                    desc.status |= DEV_DMA_BUFF_STS_DMADONE << DEV_DMA_BUFF_STS_SHIFT;
-                    dma_memory_write(&s->dma_as, s->doepdma(ep), &desc,
-                                     sizeof(desc), MEMTXATTRS_UNSPECIFIED);
-                    ioc |= (desc.status & DEV_DMA_IOC) != 0;
-
-                    s->doepdma(ep) += sizeof(desc);
-                    if (desc.status & DEV_DMA_L) {
-                        break;
-                    }
-                }
+                amtDone = dwc2_device_desc_xfer(s, p, &s->doepdma(ep),
+                                                pktsize, mps);
                 #if 0
-                qemu_log_mask(LOG_UNIMP, "%s: starting OUT transfer on EP %d (%zu/%d)...\n",
-                                __func__, ep, sglist.size, pktsize);
+                qemu_log_mask(LOG_UNIMP, "%s: OUT transfer on EP %d (%d/%d)\n",
+                              __func__, ep, amtDone, pktsize);
                 #endif
-                buffer = g_malloc0(sglist.size);
-                usb_packet_copy(p, buffer, sglist.size);
-                dma_buf_read(buffer, sglist.size, &residual, &sglist,
-                             MEMTXATTRS_UNSPECIFIED);
-                amtDone = sglist.size - residual;
-                #if 0
-                qemu_hexdump(stderr, __func__, buffer, sglist.size);
-                #endif
-                qemu_sglist_destroy(&sglist);
             } else {
                 amtDone = sz;
                 if (amtDone > pktsize) {
@@ -1479,18 +1583,12 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
                 qemu_log_mask(LOG_UNIMP, "%s: starting OUT transfer on EP %d (%d/%d/%zu/%d/%d)...\n", __func__, ep, amtDone, pktsize, p->iov.size, sz, pktcnt);
                 #endif
                 if (amtDone > 0) {
-                    // TODO: is this copy correct?
-                    buffer = g_malloc0(amtDone);
-                    usb_packet_copy(p, buffer, amtDone);
-
                     if (s->doepdma(ep)) {
-                        dma_memory_write(&s->dma_as, s->doepdma(ep), buffer,
-                                         amtDone, MEMTXATTRS_UNSPECIFIED);
+                        dwc2_device_dma_packet(s, p, s->doepdma(ep), amtDone);
                         s->doepdma(ep) += amtDone;
+                    } else {
+                        usb_packet_skip(p, amtDone);
                     }
-                    #if 0
-                    qemu_hexdump(stderr, __func__, buffer, amtDone);
-                    #endif
                     pktcnt -= (amtDone - 1 + mps) / mps;
                 } else if (pktsize == 0) {
                     pktcnt -= 1;
@@ -1519,7 +1617,8 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
             if (p->pid == USB_TOKEN_SETUP && amtDone >= 8) {
                 struct usb_control_packet setup;
 
-                memcpy(&setup, buffer, sizeof(setup));
+                iov_to_buf(p->iov.iov, p->iov.niov, start, &setup,
+                           sizeof(setup));
 
                 #if 0
                 qemu_log_mask(LOG_UNIMP, "%s: SETUP {%02x,%02x,%04x,%04x,%04x}\n",
@@ -1559,19 +1658,20 @@ static void dwc2_device_process_packet(DWC2State *s, USBPacket *p)
     dwc2_update_ep_irq(s, ep);
 }
 
-static void dwc2_device_process_async(DWC2State *s, USBEndpoint *ep)
+/* Returns true if the packet at the head of @ep was completed */
+static bool dwc2_device_process_async(DWC2State *s, USBEndpoint *ep)
 {
     USBPacket *p = NULL;
     if (unlikely(ep == NULL)) {
-        return;
+        return false;
     }
 
     assert(qemu_mutex_iothread_locked());
     if ((p = QTAILQ_FIRST(&ep->queue)) == NULL) {
-        return;
+        return false;
     }
     if (p->state != USB_PACKET_ASYNC) {
-        return;
+        return false;
     }
 
     dwc2_device_process_packet(s, p);
@@ -1581,21 +1681,47 @@ static void dwc2_device_process_async(DWC2State *s, USBEndpoint *ep)
     }
     if (p->status != USB_RET_ASYNC) {
         usb_packet_complete(USB_DEVICE(s->device), p);
+        return true;
     }
+    return false;
+}
+
+/*
+ * Process the head of @ep; in unthrottled mode keep going on bulk
+ * endpoints while packets complete. Returns true if the budget ran out
+ * with packets still completing.
+ */
+static bool dwc2_device_drain_ep(DWC2State *s, int pid, int nr)
+{
+    USBEndpoint *ep = usb_ep_get(USB_DEVICE(s->device), pid, nr);
+    uint32_t ctl = pid == USB_TOKEN_IN ? s->diepctl(nr) : s->doepctl(nr);
+    int budget = 1;
+
+    if (s->bulk_unthrottled
+        && (ctl & DXEPCTL_EPTYPE_MASK) == DXEPCTL_EPTYPE_BULK) {
+        budget = DWC2_BULK_BUDGET;
+    }
+
+    while (budget > 0 && dwc2_device_process_async(s, ep)) {
+        budget--;
+    }
+    return budget == 0 && s->bulk_unthrottled;
 }
 
 static void dwc2_device_work_bh(void *opaque)
 {
     DWC2State *s = opaque;
+    bool busy = false;
 
-    dwc2_device_process_async(s, usb_ep_get(USB_DEVICE(s->device),
-                              USB_TOKEN_SETUP, 0));
+    dwc2_device_drain_ep(s, USB_TOKEN_SETUP, 0);
 
     for (int i = 1; i < DWC2_NB_EP; i++) {
-        dwc2_device_process_async(s, usb_ep_get(USB_DEVICE(s->device),
-                                  USB_TOKEN_OUT, i));
-        dwc2_device_process_async(s, usb_ep_get(USB_DEVICE(s->device),
-                                  USB_TOKEN_IN, i));
+        busy |= dwc2_device_drain_ep(s, USB_TOKEN_OUT, i);
+        busy |= dwc2_device_drain_ep(s, USB_TOKEN_IN, i);
+    }
+
+    if (busy) {
+        qemu_bh_schedule(s->device_async_bh);
     }
 
 }
@@ -2205,6 +2331,7 @@ static void dwc2_reset_enter(Object *obj, ResetType type)
     s->frame_number = 0;
     s->fi = USB_FRMINTVL - 1;
     s->next_chan = 0;
+    s->periodic_due = 0;
     s->working = false;
 
     for (i = 0; i < DWC2_NB_CHAN; i++) {
@@ -2428,6 +2555,7 @@ const VMStateDescription vmstate_dwc2_state = {
 
 static Property dwc2_usb_properties[] = {
     DEFINE_PROP_UINT32("usb_version", DWC2State, usb_version, 2),
+    DEFINE_PROP_BOOL("bulk-unthrottled", DWC2State, bulk_unthrottled, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1416,7 +1416,8 @@ static void usb_dwc3_init(Object *obj)
     }
 }
 
-static void dwc3_process_packet(DWC3State *s, DWC3Endpoint *ep, USBPacket *p)
+/* Returns true if @p was completed */
+static bool dwc3_process_packet(DWC3State *s, DWC3Endpoint *ep, USBPacket *p)
 {
     USBDevice *udev = USB_DEVICE(&s->device);
     DWC3BufferDesc *desc = NULL;
@@ -1429,14 +1430,13 @@ static void dwc3_process_packet(DWC3State *s, DWC3Endpoint *ep, USBPacket *p)
     if (ep->stalled && p->actual_length == 0) {
         p->status = USB_RET_STALL;
         goto complete;
-        return;
     }
 
     if (ep->xfer == NULL) {
         struct dwc3_event_depevt event = {0, ep->epid, DEPEVT_XFERNOTREADY, 0, 0};
         dwc3_ep_event(s, ep->epid, event);
         p->status = USB_RET_ASYNC;
-        return;
+        return false;
     }
 
     xfer = ep->xfer;
@@ -1446,7 +1446,7 @@ static void dwc3_process_packet(DWC3State *s, DWC3Endpoint *ep, USBPacket *p)
         event.status |= DEPEVT_STATUS_TRANSFER_ACTIVE;
         p->status = USB_RET_ASYNC;
         dwc3_ep_event(s, ep->epid, event);
-        return;
+        return false;
     }
 
     dwc3_bd_copy(s, desc, p);
@@ -1465,7 +1465,9 @@ static void dwc3_process_packet(DWC3State *s, DWC3Endpoint *ep, USBPacket *p)
         if (usb_packet_is_inflight(p)) {
             usb_packet_complete(udev, p);
         }
+        return true;
     }
+    return false;
 }
 
 static void dwc3_usb_device_realize(USBDevice *dev, Error **errp)
@@ -1567,13 +1569,28 @@ static void dwc3_usb_device_handle_packet(USBDevice *dev, USBPacket *p)
 static void dwc3_ep_run(DWC3State *s, DWC3Endpoint *ep)
 {
     USBPacket *p;
+    int budget = 1;
+
     if (!ep->uep) {
         return;
     }
 
-    p = QTAILQ_FIRST(&ep->uep->queue);
-    if (p) {
-        dwc3_process_packet(s, ep, p);
+    /*
+     * In unthrottled mode, keep feeding a bulk endpoint from the TRBs
+     * that are already queued instead of one packet per doorbell.
+     */
+    if (s->bulk_unthrottled && ep->uep->type == USB_ENDPOINT_XFER_BULK) {
+        budget = DWC3_BULK_BUDGET;
+    }
+
+    while ((p = QTAILQ_FIRST(&ep->uep->queue)) != NULL) {
+        if (!dwc3_process_packet(s, ep, p) || --budget == 0) {
+            break;
+        }
+        /* Don't report XferNotReady again for an endpoint we drained */
+        if (ep->xfer == NULL || QTAILQ_EMPTY(&ep->xfer->buffers)) {
+            break;
+        }
     }
 }
 
@@ -1700,6 +1717,7 @@ static const VMStateDescription vmstate_usb_dwc3 = {
 };
 
 static Property usb_dwc3_properties[] = {
+    DEFINE_PROP_BOOL("bulk-unthrottled", DWC3State, bulk_unthrottled, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -3,17 +3,20 @@
 #include "qemu/lockable.h"
 #include "hw/usb.h"
 #include "tcp-usb.h"
+#include "tcp-usb-shm.h"
 #include "hw/usb/hcd-tcp.h"
 #include "qemu/cutils.h"
 #include "hw/qdev-properties.h"
 #include "qemu/main-loop.h"
 #include "qemu/coroutine.h"
 #include "io/channel.h"
-#include "io/channel-util.h"
+#include "io/channel-socket.h"
 #include "qapi/error.h"
 #include "sysemu/iothread.h"
 #include "qemu/error-report.h"
 #include "migration/blocker.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
 
 //#define DEBUG_HCD_TCP
 
@@ -24,10 +27,25 @@ do { fprintf(stderr, "hcd-tcp: " fmt , ## __VA_ARGS__); } while (0)
 #define DPRINTF(fmt, ...) do {} while(0)
 #endif
 
+/* Retry interval for pipelined requests the device NAKed: one microframe */
+#define TCP_USB_NAK_RETRY_NS (125 * SCALE_US)
+
+static void usb_tcp_host_schedule_reconnect(USBTCPHostState *s);
+
+static void usb_tcp_host_free_packet(USBTCPPacket *pkt)
+{
+    g_free(pkt->buffer);
+    usb_packet_cleanup(&pkt->p);
+    g_free(pkt);
+}
+
 static void usb_tcp_host_closed(USBTCPHostState *s)
 {
+    USBTCPPacket *pkt;
+
     DPRINTF("%s\n", __func__);
     if (s->ioc) {
+        usb_tcp_host_schedule_reconnect(s);
         qio_channel_detach_aio_context(s->ioc);
         qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
         qio_channel_close(s->ioc, NULL);
@@ -35,14 +53,40 @@ static void usb_tcp_host_closed(USBTCPHostState *s)
         s->ioc = NULL;
     }
     s->closed = true;
+
+    while (!QTAILQ_EMPTY(&s->responses)) {
+        pkt = QTAILQ_FIRST(&s->responses);
+        QTAILQ_REMOVE(&s->responses, pkt, next);
+        pkt->queued = false;
+        /* Packets still owned by the device are freed when they complete */
+        if (!usb_packet_is_inflight(&pkt->p)) {
+            usb_tcp_host_free_packet(pkt);
+        }
+    }
+
+    timer_del(s->nak_timer);
+    while (!QTAILQ_EMPTY(&s->naks)) {
+        pkt = QTAILQ_FIRST(&s->naks);
+        QTAILQ_REMOVE(&s->naks, pkt, next);
+        usb_tcp_host_free_packet(pkt);
+    }
+
+    tcp_usb_shm_destroy(s->shm);
     migrate_del_blocker(s->migration_blocker);
 }
 
-static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
+/*
+ * Read exactly @len bytes. If @fd is not NULL, the first file descriptor
+ * passed along with the data is returned there and any others are closed.
+ */
+static ssize_t tcp_usb_read_full(QIOChannel *ioc, void *buf, size_t len,
+                                 int *fd)
 {
     struct iovec iov = { .iov_base = buf, .iov_len = len };
     bool iolock = qemu_mutex_iothread_locked();
     bool iothread = qemu_in_iothread();
+    g_autofree int *fds = NULL;
+    size_t nfds = 0;
     ssize_t ret = -1;
     Error *err = NULL;
 
@@ -56,21 +100,38 @@ static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
         qemu_mutex_unlock_iothread();
     }
 
-    ret = qio_channel_readv_full_all_eof(ioc, &iov, 1, NULL, 0, &err);
+    ret = qio_channel_readv_full_all_eof(ioc, &iov, 1,
+                                         fd ? &fds : NULL,
+                                         fd ? &nfds : NULL, &err);
 
     if (iolock && !iothread && !qemu_in_coroutine()) {
         qemu_mutex_lock_iothread();
     }
 
+    if (fd) {
+        *fd = -1;
+        for (size_t i = 0; i < nfds; i++) {
+            if (*fd == -1) {
+                *fd = fds[i];
+            } else {
+                close(fds[i]);
+            }
+        }
+    }
+
     if (err) {
         error_report_err(err);
     }
     return (ret <= 0) ? ret : iov.iov_len;
 }
 
-static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
+static ssize_t tcp_usb_read(QIOChannel *ioc, void *buf, size_t len)
+{
+    return tcp_usb_read_full(ioc, buf, len, NULL);
+}
+
+static bool tcp_usb_writev(QIOChannel *ioc, struct iovec *iov, size_t niov)
 {
-    struct iovec iov = { .iov_base = buf, .iov_len = len };
     bool iolock = qemu_mutex_iothread_locked();
     bool iothread = qemu_in_iothread();
     bool ret = false;
@@ -86,7 +147,7 @@ static bool tcp_usb_write(QIOChannel *ioc, void *buf, ssize_t len)
         qemu_mutex_unlock_iothread();
     }
 
-    if (!qio_channel_writev_full_all(ioc, &iov, 1, NULL, 0, 0, &err)) {
+    if (!qio_channel_writev_full_all(ioc, iov, niov, NULL, 0, 0, &err)) {
         ret = true;
     }
 
@@ -110,70 +171,216 @@ static USBPort *usb_tcp_host_find_active_port(USBTCPHostState *s)
     return &s->uports[0];
 }
 
-static void coroutine_fn usb_tcp_host_respond_packet_co(void *opaque)
+/*
+ * Drain the response queue, coalescing up to TCP_USB_MAX_BATCH frames
+ * and their payloads into a single writev. IN payloads are sent straight
+ * from the packet buffer.
+ */
+static void coroutine_fn usb_tcp_host_flush_co(void *opaque)
 {
-    USBTCPPacket *pkt = (USBTCPPacket *)opaque;
-    USBTCPHostState *s = USB_TCP_HOST(pkt->s);
-    USBPacket *p = &pkt->p;
-    tcp_usb_header_t hdr = { 0 };
-    tcp_usb_response_header resp = { 0 };
-    g_autofree void *buffer = NULL;
+    USBTCPHostState *s = USB_TCP_HOST(opaque);
     USBPort *uport = usb_tcp_host_find_active_port(s);
+    tcp_usb_header_t hdrs[TCP_USB_MAX_BATCH];
+    struct iovec iov[TCP_USB_MAX_BATCH * 2];
+    USBTCPPacket *batch[TCP_USB_MAX_BATCH];
 
     WITH_QEMU_LOCK_GUARD(&s->write_mutex) {
-        if (!s->closed) {
-            hdr.type = TCP_USB_RESPONSE;
-            resp.addr = uport->dev->addr;
-            resp.pid = p->pid;
-            resp.ep = p->ep->nr;
-            resp.id = p->id;
-            resp.status = p->status;
-            resp.length = p->iov.size;
-
-            if (resp.length > p->actual_length) {
-                resp.length = p->actual_length;
-            }
-
-            if (p->pid == USB_TOKEN_IN && p->status != USB_RET_ASYNC) {
-                buffer = g_malloc(resp.length);
-                iov_to_buf(p->iov.iov, p->iov.niov, 0, buffer, resp.length);
-            }
+        while (!QTAILQ_EMPTY(&s->responses)) {
+            QIOChannel *ioc = s->ioc;
+            int n = 0;
+            int niov = 0;
+
+            while (n < TCP_USB_MAX_BATCH && !QTAILQ_EMPTY(&s->responses)) {
+                USBTCPPacket *pkt = QTAILQ_FIRST(&s->responses);
+                USBPacket *p = &pkt->p;
+                tcp_usb_header_t *hdr = &hdrs[n];
+
+                QTAILQ_REMOVE(&s->responses, pkt, next);
+                pkt->queued = false;
+                batch[n++] = pkt;
+
+                if (pkt->pipelined && p->status == USB_RET_ASYNC
+                    && usb_packet_is_inflight(p)) {
+                    /* The remote does not wait for the interim status */
+                    continue;
+                }
 
-            if (!tcp_usb_write(s->ioc, &hdr, sizeof(hdr))) {
-                usb_tcp_host_closed(s);
-                return;
+                memset(hdr, 0, sizeof(*hdr));
+                hdr->type = TCP_USB_RESPONSE;
+                hdr->version = TCP_USB_VERSION;
+                hdr->addr = uport->dev->addr;
+                hdr->pid = p->pid;
+                hdr->ep = p->ep->nr;
+                hdr->id = p->id;
+                hdr->status = p->status;
+                hdr->length = MIN(p->iov.size, p->actual_length);
+
+                iov[niov].iov_base = hdr;
+                iov[niov].iov_len = sizeof(*hdr);
+                niov++;
+
+                if (p->pid == USB_TOKEN_IN && p->status != USB_RET_ASYNC
+                    && hdr->length) {
+                    TCPUSBShmRing *ring = &s->shm->rings[TCP_USB_SHM_TO_REMOTE];
+                    struct iovec dst[2];
+                    int nr = 0;
+
+                    if (tcp_usb_shm_active(s->shm)) {
+                        nr = tcp_usb_shm_ring_reserve(ring, hdr->length, dst);
+                    }
+                    if (nr > 0) {
+                        iov_from_buf(dst, nr, 0, pkt->buffer, hdr->length);
+                        tcp_usb_shm_ring_commit(ring, hdr->length);
+                        hdr->flags |= TCP_USB_FLAG_SHM;
+                    } else {
+                        iov[niov].iov_base = pkt->buffer;
+                        iov[niov].iov_len = hdr->length;
+                        niov++;
+                    }
+                }
+                tcp_usb_header_to_wire(hdr);
             }
 
-            if (!tcp_usb_write(s->ioc, &resp, sizeof(resp))) {
-                usb_tcp_host_closed(s);
-                return;
+            if (niov && !s->closed) {
+                object_ref(OBJECT(ioc));
+                if (!tcp_usb_writev(ioc, iov, niov)) {
+                    usb_tcp_host_closed(s);
+                }
+                object_unref(OBJECT(ioc));
             }
 
-            if (buffer) {
-                if (!tcp_usb_write(s->ioc, buffer, resp.length)) {
-                    usb_tcp_host_closed(s);
-                    return;
+            for (int i = 0; i < n; i++) {
+                /* Completed again while we were writing: freed next round */
+                if (!batch[i]->queued && !usb_packet_is_inflight(&batch[i]->p)) {
+                    usb_tcp_host_free_packet(batch[i]);
                 }
             }
         }
     }
 
-    if (!usb_packet_is_inflight(p)) {
-        if (pkt->buffer) {
-            g_free(pkt->buffer);
-        }
-        usb_packet_cleanup(p);
-        g_free(pkt);
-    }
+    s->flushing = false;
 }
 
-static void usb_tcp_host_respond_packet(USBTCPHostState *s, USBTCPPacket *pkt)
+static void usb_tcp_host_flush_bh(void *opaque)
 {
+    USBTCPHostState *s = USB_TCP_HOST(opaque);
     Coroutine *co = NULL;
-    co = qemu_coroutine_create(usb_tcp_host_respond_packet_co, pkt);
+
+    if (s->flushing || QTAILQ_EMPTY(&s->responses)) {
+        return;
+    }
+
+    s->flushing = true;
+    co = qemu_coroutine_create(usb_tcp_host_flush_co, s);
     qemu_coroutine_enter(co);
 }
 
+/*
+ * Queue a response for @pkt. Responses produced in the same main loop
+ * iteration are sent together from usb_tcp_host_flush_bh.
+ */
+static void usb_tcp_host_respond_packet(USBTCPHostState *s, USBTCPPacket *pkt)
+{
+    if (s->closed) {
+        if (!pkt->queued && !usb_packet_is_inflight(&pkt->p)) {
+            usb_tcp_host_free_packet(pkt);
+        }
+        return;
+    }
+
+    if (!pkt->queued) {
+        pkt->queued = true;
+        QTAILQ_INSERT_TAIL(&s->responses, pkt, next);
+    }
+
+    if (!s->flushing) {
+        qemu_bh_schedule(s->flush_bh);
+    }
+}
+
+static bool usb_tcp_host_ep_parked(USBTCPHostState *s, USBEndpoint *ep)
+{
+    USBTCPPacket *pkt;
+
+    QTAILQ_FOREACH(pkt, &s->naks, next) {
+        if (pkt->p.ep == ep) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void usb_tcp_host_handle_request(USBTCPHostState *s, USBTCPPacket *pkt)
+{
+    USBPacket *p = &pkt->p;
+
+    /* Keep pipelined requests in order behind earlier NAKed ones */
+    if (pkt->pipelined && usb_tcp_host_ep_parked(s, p->ep)) {
+        QTAILQ_INSERT_TAIL(&s->naks, pkt, next);
+        return;
+    }
+
+    usb_handle_packet(pkt->dev, p);
+
+    if (pkt->pipelined && p->status == USB_RET_NAK) {
+        /*
+         * The remote has already returned USB_RET_ASYNC to its host
+         * controller and will not resubmit, so retry on its behalf.
+         */
+        QTAILQ_INSERT_TAIL(&s->naks, pkt, next);
+        if (!timer_pending(s->nak_timer)) {
+            timer_mod(s->nak_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                    + TCP_USB_NAK_RETRY_NS);
+        }
+        return;
+    }
+
+    usb_tcp_host_respond_packet(s, pkt);
+}
+
+static void usb_tcp_host_nak_retry(void *opaque)
+{
+    USBTCPHostState *s = USB_TCP_HOST(opaque);
+    USBTCPPacket *pkt, *next;
+    uint32_t blocked = 0;
+
+    QTAILQ_FOREACH_SAFE(pkt, &s->naks, next, next) {
+        USBPacket *p = &pkt->p;
+        uint32_t bit = 1U << (p->ep->nr + (p->pid == USB_TOKEN_IN ? 16 : 0));
+
+        if (blocked & bit) {
+            continue;
+        }
+
+        usb_handle_packet(pkt->dev, p);
+        if (p->status == USB_RET_NAK) {
+            blocked |= bit;
+            continue;
+        }
+
+        QTAILQ_REMOVE(&s->naks, pkt, next);
+        usb_tcp_host_respond_packet(s, pkt);
+    }
+
+    if (!QTAILQ_EMPTY(&s->naks)) {
+        timer_mod(s->nak_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                + TCP_USB_NAK_RETRY_NS);
+    }
+}
+
+static USBTCPPacket *usb_tcp_host_find_parked(USBTCPHostState *s, int pid,
+                                              uint8_t ep, uint64_t id)
+{
+    USBTCPPacket *pkt;
+
+    QTAILQ_FOREACH(pkt, &s->naks, next) {
+        if (pkt->p.pid == pid && pkt->p.ep->nr == ep && pkt->p.id == id) {
+            return pkt;
+        }
+    }
+    return NULL;
+}
+
 static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
 {
     USBTCPHostState *s = USB_TCP_HOST(opaque);
@@ -182,8 +389,25 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
 
     for(;;) {
         tcp_usb_header_t hdr = { 0 };
+        int fd = -1;
 
-        if (unlikely((tcp_usb_read(ioc, &hdr, sizeof(hdr)) != sizeof(hdr)))) {
+        if (unlikely((tcp_usb_read_full(ioc, &hdr, sizeof(hdr), &fd) != sizeof(hdr)))) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            usb_tcp_host_closed(s);
+            return;
+        }
+        tcp_usb_header_from_wire(&hdr);
+
+        if (fd >= 0 && hdr.type != TCP_USB_SHM) {
+            close(fd);
+            fd = -1;
+        }
+
+        if (unlikely(hdr.version != TCP_USB_VERSION)) {
+            error_report("%s: unsupported protocol version %u (expected %u)",
+                         __func__, hdr.version, TCP_USB_VERSION);
             usb_tcp_host_closed(s);
             return;
         }
@@ -191,61 +415,82 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
         switch (hdr.type) {
             case TCP_USB_REQUEST: {
                 /* fprintf(stderr, "%s: TCP_USB_REQUEST\n", __func__); */
-                tcp_usb_request_header pkt_hdr = {0};
                 g_autofree void *buffer = NULL;
                 g_autofree USBTCPPacket *pkt = (USBTCPPacket *) g_malloc0(sizeof(USBTCPPacket));
                 USBEndpoint *ep = NULL;
 
-                if (unlikely(tcp_usb_read(ioc, &pkt_hdr, sizeof(pkt_hdr)) != sizeof(pkt_hdr))) {
-                    usb_tcp_host_closed(s);
-                    return;
-                }
-
                 #if 0
-                DPRINTF("%s: TCP_USB_REQUEST pid: 0x%x ep: %d id: 0x%lx\n", __func__, pkt_hdr.pid, pkt_hdr.ep, pkt_hdr.id);
+                DPRINTF("%s: TCP_USB_REQUEST pid: 0x%x ep: %d id: 0x%lx\n", __func__, hdr.pid, hdr.ep, hdr.id);
                 #endif
-                ep = usb_ep_get(uport->dev, pkt_hdr.pid, pkt_hdr.ep);
+                ep = usb_ep_get(uport->dev, hdr.pid, hdr.ep);
                 if (ep == NULL) {
                     DPRINTF("%s: TCP_USB_REQUEST unknown EP\n", __func__);
                     usb_tcp_host_closed(s);
                     return;
                 }
 
+                if (hdr.length > TCP_USB_MAX_PAYLOAD) {
+                    error_report("%s: TCP_USB_REQUEST payload too large: %u",
+                                 __func__, hdr.length);
+                    usb_tcp_host_closed(s);
+                    return;
+                }
+
                 usb_packet_init(&pkt->p);
-                usb_packet_setup(&pkt->p, pkt_hdr.pid, ep, pkt_hdr.stream, pkt_hdr.id, pkt_hdr.short_not_ok, pkt_hdr.int_req);
+                usb_packet_setup(&pkt->p, hdr.pid, ep, hdr.stream, hdr.id,
+                                 hdr.flags & TCP_USB_FLAG_SHORT_NOT_OK,
+                                 hdr.flags & TCP_USB_FLAG_INT_REQ);
+
+                if (hdr.length > 0) {
+                    buffer = g_malloc(hdr.length);
 
-                if (pkt_hdr.length > 0) {
-                    buffer = g_malloc0(pkt_hdr.length);
+                    if (hdr.flags & TCP_USB_FLAG_SHM) {
+                        TCPUSBShmRing *ring = &s->shm->rings[TCP_USB_SHM_TO_HOST];
+                        struct iovec src[2];
+                        int n = 0;
 
-                    if (pkt_hdr.pid != USB_TOKEN_IN) {
-                        if (unlikely(tcp_usb_read(s->ioc, buffer, pkt_hdr.length) != pkt_hdr.length)) {
+                        if (tcp_usb_shm_active(s->shm)) {
+                            n = tcp_usb_shm_ring_peek(ring, hdr.length, src);
+                        }
+                        if (unlikely(n == 0)) {
+                            error_report("%s: TCP_USB_REQUEST shared ring "
+                                         "payload of %u bytes missing",
+                                         __func__, hdr.length);
                             usb_tcp_host_closed(s);
                             usb_packet_cleanup(&pkt->p);
                             return;
                         }
-                        /* qemu_hexdump(stderr, __func__, buffer, pkt_hdr.length); */
+                        iov_to_buf(src, n, 0, buffer, hdr.length);
+                        tcp_usb_shm_ring_consume(ring, hdr.length);
+                    } else if (hdr.pid != USB_TOKEN_IN) {
+                        if (unlikely(tcp_usb_read(s->ioc, buffer, hdr.length) != hdr.length)) {
+                            usb_tcp_host_closed(s);
+                            usb_packet_cleanup(&pkt->p);
+                            return;
+                        }
+                        /* qemu_hexdump(stderr, __func__, buffer, hdr.length); */
                     }
 
-                    usb_packet_addbuf(&pkt->p, buffer, pkt_hdr.length);
+                    usb_packet_addbuf(&pkt->p, buffer, hdr.length);
                     pkt->buffer = buffer;
                     g_steal_pointer(&buffer);
                 }
 
-                if (pkt_hdr.addr != uport->dev->addr) {
+                if (hdr.addr != uport->dev->addr) {
                     /*
                      * fprintf(stderr,
-                     *         "%s: USB_RET_NODEV: pkt_hdr.addr != uport->dev->addr: %d != %d\n",
-                     *         __func__, pkt_hdr.addr, uport->dev->addr);
+                     *         "%s: USB_RET_NODEV: hdr.addr != uport->dev->addr: %d != %d\n",
+                     *         __func__, hdr.addr, uport->dev->addr);
                      */
                     /* Can't enforce this check because dwc2 address transition time is slow */
                 }
                 pkt->dev = ep->dev;
                 pkt->s = s;
-                pkt->addr = pkt_hdr.addr;
+                pkt->addr = hdr.addr;
+                pkt->pipelined = !!(hdr.flags & TCP_USB_FLAG_PIPELINED);
                 assert(qemu_mutex_iothread_locked());
 
-                usb_handle_packet(pkt->dev, &pkt->p);
-                usb_tcp_host_respond_packet(s, pkt);
+                usb_tcp_host_handle_request(s, pkt);
                 g_steal_pointer(&pkt);
                 break;
             }
@@ -255,42 +500,74 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
                 return;
             case TCP_USB_CANCEL: {
                 /* DPRINTF("%s: TCP_USB_CANCEL\n", __func__); */
-                tcp_usb_cancel_header pkt_hdr = {0};
                 USBTCPPacket *pkt = NULL;
                 USBPacket *p = NULL;
 
-                if (unlikely(tcp_usb_read(ioc, &pkt_hdr, sizeof(pkt_hdr)) != sizeof(pkt_hdr))) {
-                    usb_tcp_host_closed(s);
-                    return;
-                }
-
                 #if 1
-                DPRINTF("%s: TCP_USB_CANCEL pid: 0x%x ep: %d\n", __func__, pkt_hdr.pid, pkt_hdr.ep);
+                DPRINTF("%s: TCP_USB_CANCEL pid: 0x%x ep: %d\n", __func__, hdr.pid, hdr.ep);
                 #endif
 
-                if (pkt_hdr.addr != uport->dev->addr) {
+                if (hdr.addr != uport->dev->addr) {
                     /*
                      * fprintf(stderr,
-                     *         "%s: USB_RET_NODEV: pkt_hdr.addr != uport->dev->addr: %d != %d\n",
-                     *         __func__, pkt_hdr.addr, uport->dev->addr);
+                     *         "%s: USB_RET_NODEV: hdr.addr != uport->dev->addr: %d != %d\n",
+                     *         __func__, hdr.addr, uport->dev->addr);
                      */
                     /* Can't enforce this check because dwc2 address transition time is slow */
                 }
                 assert(qemu_mutex_iothread_locked());
-                p = usb_ep_find_packet_by_id(uport->dev, pkt_hdr.pid,
-                                             pkt_hdr.ep, pkt_hdr.id);
+                p = usb_ep_find_packet_by_id(uport->dev, hdr.pid,
+                                             hdr.ep, hdr.id);
                 if (p) {
                     pkt = container_of(p, USBTCPPacket, p);
                     usb_cancel_packet(&pkt->p);
                     DPRINTF("%s: TCP_USB_CANCEL: packet"
                                 " pid: 0x%x ep: %d id: 0x%lx len: 0x%x\n",
-                                __func__, pkt_hdr.pid, pkt_hdr.ep, pkt_hdr.id, p->actual_length);
+                                __func__, hdr.pid, hdr.ep, hdr.id, p->actual_length);
+                    usb_tcp_host_respond_packet(s, pkt);
+                } else if ((pkt = usb_tcp_host_find_parked(s, hdr.pid, hdr.ep,
+                                                           hdr.id))) {
+                    QTAILQ_REMOVE(&s->naks, pkt, next);
+                    pkt->p.status = USB_RET_IOERROR;
                     usb_tcp_host_respond_packet(s, pkt);
                 } else {
+                    USBEndpoint *ep = usb_ep_get(uport->dev, hdr.pid, hdr.ep);
+
                     warn_report("%s: TCP_USB_CANCEL: packet"
                                 " pid: 0x%x ep: %d id: 0x%lx not found",
-                                __func__, pkt_hdr.pid, pkt_hdr.ep, pkt_hdr.id);
+                                __func__, hdr.pid, hdr.ep, hdr.id);
+                    if (ep == NULL) {
+                        usb_tcp_host_closed(s);
+                        return;
+                    }
+                    /* The remote waits for an answer to every cancel */
+                    pkt = g_new0(USBTCPPacket, 1);
+                    usb_packet_init(&pkt->p);
+                    usb_packet_setup(&pkt->p, hdr.pid, ep, hdr.stream, hdr.id,
+                                     false, false);
+                    pkt->dev = ep->dev;
+                    pkt->p.status = USB_RET_IOERROR;
+                    usb_tcp_host_respond_packet(s, pkt);
+                }
+                break;
+            }
+            case TCP_USB_SHM: {
+                Error *err = NULL;
+
+                tcp_usb_shm_destroy(s->shm);
+                if (fd < 0) {
+                    error_report("%s: TCP_USB_SHM without a memory fd",
+                                 __func__);
+                    usb_tcp_host_closed(s);
+                    return;
+                }
+                if (!tcp_usb_shm_map(s->shm, fd, hdr.length, &err)) {
+                    error_report_err(err);
+                    close(fd);
+                    usb_tcp_host_closed(s);
+                    return;
                 }
+                DPRINTF("%s: TCP_USB_SHM ring size 0x%x\n", __func__, hdr.length);
                 break;
             }
             case TCP_USB_RESET:
@@ -308,15 +585,95 @@ static void coroutine_fn usb_tcp_host_msg_loop_co(void *opaque)
     return;
 }
 
+static bool usb_tcp_host_port_ready(USBTCPHostState *s)
+{
+    USBPort *uport = usb_tcp_host_find_active_port(s);
+
+    return uport->dev && uport->dev->attached;
+}
+
+static void usb_tcp_host_schedule_reconnect(USBTCPHostState *s)
+{
+    if (s->reconnect && !s->stopped) {
+        timer_mod(s->reconnect_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  s->reconnect * 1000);
+    }
+}
+
+static void usb_tcp_host_connected(QIOTask *task, gpointer opaque)
+{
+    USBTCPHostState *s = USB_TCP_HOST(opaque);
+    QIOChannelSocket *sioc = s->connecting;
+    Coroutine *co;
+    Error *err = NULL;
+
+    s->connecting = NULL;
+    if (qio_task_propagate_error(task, &err)) {
+        /* Only complain once while waiting for the remote to come up */
+        if (!s->connect_failed) {
+            error_report_err(err);
+        } else {
+            error_free(err);
+        }
+        s->connect_failed = true;
+        object_unref(OBJECT(sioc));
+        usb_tcp_host_schedule_reconnect(s);
+        return;
+    }
+
+    /* Detached or unrealized while connecting */
+    if (s->stopped || !s->closed || !usb_tcp_host_port_ready(s)) {
+        object_unref(OBJECT(sioc));
+        return;
+    }
+
+    s->ioc = QIO_CHANNEL(sioc);
+    qio_channel_set_name(s->ioc, TYPE_USB_TCP_HOST ".conn");
+    if (s->saddr->type == SOCKET_ADDRESS_TYPE_INET) {
+        qio_channel_set_delay(s->ioc, false);
+    }
+    qio_channel_set_blocking(s->ioc, false, NULL);
+    s->connect_failed = false;
+    s->closed = 0;
+
+    migrate_add_blocker(s->migration_blocker, NULL);
+    co = qemu_coroutine_create(usb_tcp_host_msg_loop_co, s);
+    qemu_coroutine_enter(co);
+}
+
+/*
+ * Connect in the background, the message loop is started from
+ * usb_tcp_host_connected() once the remote has accepted. The device is
+ * kept alive until then.
+ */
+static void usb_tcp_host_connect(USBTCPHostState *s)
+{
+    if (s->connecting) {
+        return;
+    }
+
+    s->connecting = qio_channel_socket_new();
+    object_ref(OBJECT(s));
+    qio_channel_socket_connect_async(s->connecting, s->saddr,
+                                     usb_tcp_host_connected, s,
+                                     object_unref, NULL);
+}
+
+static void usb_tcp_host_reconnect(void *opaque)
+{
+    USBTCPHostState *s = USB_TCP_HOST(opaque);
+
+    if (!s->closed || !usb_tcp_host_port_ready(s)) {
+        return;
+    }
+
+    usb_tcp_host_connect(s);
+}
+
 static void usb_tcp_host_attach(USBPort *uport)
 {
-    struct sockaddr_un server_addr;
     USBTCPHostState *s = USB_TCP_HOST(uport->opaque);
-    int sock = -1;
-    Coroutine *co = NULL;
-    QIOChannel *ioc = NULL;
-    int ret;
-    Error *err = NULL;
 
     if (uport->index >= G_N_ELEMENTS(s->uports) - 1) {
         error_report("%s: attached to unused port\n", __func__);
@@ -334,44 +691,21 @@ static void usb_tcp_host_attach(USBPort *uport)
         return;
     }
 
-    sock = socket(AF_UNIX, SOCK_STREAM, 0);
-
-    if (socket < 0) {
-        error_report("%s: cannot open socket", __func__);
-    }
-
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sun_family = AF_UNIX;
-    strncpy(server_addr.sun_path, socket_path, sizeof(server_addr.sun_path));
-    server_addr.sun_path[sizeof(server_addr.sun_path) - 1] = '\0';
-
-    ret = connect(sock, (const struct sockaddr *) &server_addr, sizeof(server_addr));
-    if (ret < 0) {
-        error_report("%s: failed to connect to server: %d\n", __func__, ret);
-        close(sock);
+    if (!s->closed) {
         return;
     }
 
-    ioc = qio_channel_new_fd(sock, &err);
-    if (!ioc) {
-        error_report_err(err);
-        close(sock);
-        return;
-    }
-    qio_channel_set_blocking(ioc, false, NULL);
-    s->closed = 0;
-    s->ioc = ioc;
-
-    migrate_add_blocker(s->migration_blocker, NULL);
-    co = qemu_coroutine_create(usb_tcp_host_msg_loop_co, s);
-    qemu_coroutine_enter(co);
+    usb_tcp_host_connect(s);
 }
 
 static void usb_tcp_host_detach(USBPort *uport)
 {
     USBTCPHostState *s = USB_TCP_HOST(uport->opaque);
 
+    timer_del(s->reconnect_timer);
     usb_tcp_host_closed(s);
+    /* Closing may have re-armed the timer, nothing to reconnect for now */
+    timer_del(s->reconnect_timer);
 }
 
 static void usb_tcp_host_async_packet_complete(USBPort *port, USBPacket *p)
@@ -394,6 +728,11 @@ static void usb_tcp_host_realize(DeviceState *dev, Error **errp)
 {
     USBTCPHostState *s = USB_TCP_HOST(dev);
 
+    s->saddr = tcp_usb_parse_addr(s->conn_addr, errp);
+    if (!s->saddr) {
+        return;
+    }
+
     usb_bus_new(&s->bus, sizeof(s->bus), &usb_tcp_bus_ops, dev);
     for (int i = 0; i < G_N_ELEMENTS(s->uports); i++) {
         usb_register_port(&s->bus, &s->uports[i], s, i, &usb_tcp_host_port_ops,
@@ -403,20 +742,30 @@ static void usb_tcp_host_realize(DeviceState *dev, Error **errp)
 
     s->closed = 1;
     qemu_co_mutex_init(&s->write_mutex);
+    QTAILQ_INIT(&s->responses);
+    QTAILQ_INIT(&s->naks);
+    s->shm = g_new0(TCPUSBShm, 1);
+    s->shm->fd = -1;
+    s->flush_bh = qemu_bh_new(usb_tcp_host_flush_bh, s);
+    s->nak_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, usb_tcp_host_nak_retry, s);
+    s->reconnect_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                      usb_tcp_host_reconnect, s);
 }
 
 static void usb_tcp_host_unrealize(DeviceState *dev)
 {
     USBTCPHostState *s = USB_TCP_HOST(dev);
 
-    if (s->ioc) {
-        qio_channel_shutdown(s->ioc, QIO_CHANNEL_SHUTDOWN_BOTH, NULL);
-        qio_channel_close(s->ioc, NULL);
-        s->ioc = NULL;
-    }
-
-    s->closed = 1;
     s->stopped = 1;
+    usb_tcp_host_closed(s);
+
+    qemu_bh_delete(s->flush_bh);
+    timer_free(s->nak_timer);
+    timer_free(s->reconnect_timer);
+    qapi_free_SocketAddress(s->saddr);
+    s->saddr = NULL;
+    g_free(s->shm);
+    s->shm = NULL;
 }
 
 static void usb_tcp_host_init(Object *obj)
@@ -428,6 +777,8 @@ static void usb_tcp_host_init(Object *obj)
 }
 
 static Property usb_tcp_host_properties[] = {
+    DEFINE_PROP_STRING("conn-addr", USBTCPHostState, conn_addr),
+    DEFINE_PROP_UINT32("conn-reconnect", USBTCPHostState, reconnect, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
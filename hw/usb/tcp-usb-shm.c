@@ -0,0 +1,153 @@
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/atomic.h"
+#include "qemu/host-utils.h"
+#include "qemu/memfd.h"
+#include "qapi/error.h"
+#include "tcp-usb-shm.h"
+
+static size_t tcp_usb_shm_total_size(uint32_t ring_size)
+{
+    return 2 * (sizeof(tcp_usb_shm_ring_t) + (size_t)ring_size);
+}
+
+static void tcp_usb_shm_setup(TCPUSBShm *shm, uint32_t ring_size)
+{
+    uint8_t *p = shm->base;
+
+    for (int i = 0; i < ARRAY_SIZE(shm->rings); i++) {
+        shm->rings[i].ctl = (tcp_usb_shm_ring_t *)p;
+        shm->rings[i].data = p + sizeof(tcp_usb_shm_ring_t);
+        shm->rings[i].size = ring_size;
+        p += sizeof(tcp_usb_shm_ring_t) + ring_size;
+    }
+}
+
+static bool tcp_usb_shm_check_size(uint32_t ring_size, Error **errp)
+{
+    if (ring_size < TCP_USB_SHM_MIN_RING || !is_power_of_2(ring_size)) {
+        error_setg(errp, "shared-memory ring size must be a power of two "
+                   "of at least %u bytes, got %u",
+                   (unsigned)TCP_USB_SHM_MIN_RING, ring_size);
+        return false;
+    }
+    return true;
+}
+
+bool tcp_usb_shm_create(TCPUSBShm *shm, uint32_t ring_size, Error **errp)
+{
+    size_t size = tcp_usb_shm_total_size(ring_size);
+
+    if (!tcp_usb_shm_check_size(ring_size, errp)) {
+        return false;
+    }
+
+    shm->base = qemu_memfd_alloc("usb-tcp-shm", size,
+                                 F_SEAL_GROW | F_SEAL_SHRINK | F_SEAL_SEAL,
+                                 &shm->fd, errp);
+    if (!shm->base) {
+        shm->fd = -1;
+        return false;
+    }
+    shm->size = size;
+    memset(shm->base, 0, size);
+    tcp_usb_shm_setup(shm, ring_size);
+    return true;
+}
+
+bool tcp_usb_shm_map(TCPUSBShm *shm, int fd, uint32_t ring_size,
+                     Error **errp)
+{
+    size_t size = tcp_usb_shm_total_size(ring_size);
+    struct stat st;
+    void *base;
+
+    if (!tcp_usb_shm_check_size(ring_size, errp)) {
+        return false;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < size) {
+        error_setg(errp, "shared-memory ring file is too small");
+        return false;
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        error_setg_errno(errp, errno, "failed to map shared-memory ring");
+        return false;
+    }
+
+    shm->base = base;
+    shm->size = size;
+    shm->fd = fd;
+    tcp_usb_shm_setup(shm, ring_size);
+    return true;
+}
+
+void tcp_usb_shm_destroy(TCPUSBShm *shm)
+{
+    if (shm->base) {
+        qemu_memfd_free(shm->base, shm->size, shm->fd);
+    }
+    memset(shm, 0, sizeof(*shm));
+    shm->fd = -1;
+}
+
+/* Split @len bytes starting at free-running index @pos into @iov */
+static int tcp_usb_shm_ring_split(TCPUSBShmRing *r, uint32_t pos,
+                                  uint32_t len, struct iovec iov[2])
+{
+    uint32_t off = pos & (r->size - 1);
+    uint32_t first = MIN(len, r->size - off);
+
+    iov[0].iov_base = r->data + off;
+    iov[0].iov_len = first;
+    if (first == len) {
+        return 1;
+    }
+    iov[1].iov_base = r->data;
+    iov[1].iov_len = len - first;
+    return 2;
+}
+
+/*
+ * Producer side: return the ring space for @len bytes, or 0 if the ring
+ * does not currently have room and the caller should send inline.
+ */
+int tcp_usb_shm_ring_reserve(TCPUSBShmRing *r, uint32_t len,
+                             struct iovec iov[2])
+{
+    uint32_t head = r->ctl->head;
+    uint32_t tail = qatomic_load_acquire(&r->ctl->tail);
+
+    if (len == 0 || len > r->size - (head - tail)) {
+        return 0;
+    }
+    return tcp_usb_shm_ring_split(r, head, len, iov);
+}
+
+void tcp_usb_shm_ring_commit(TCPUSBShmRing *r, uint32_t len)
+{
+    qatomic_store_release(&r->ctl->head, r->ctl->head + len);
+}
+
+/*
+ * Consumer side: return the next @len bytes, or 0 if the producer has
+ * not published that much, which is a protocol error.
+ */
+int tcp_usb_shm_ring_peek(TCPUSBShmRing *r, uint32_t len,
+                          struct iovec iov[2])
+{
+    uint32_t tail = r->ctl->tail;
+    uint32_t head = qatomic_load_acquire(&r->ctl->head);
+
+    if (len == 0 || len > head - tail) {
+        return 0;
+    }
+    return tcp_usb_shm_ring_split(r, tail, len, iov);
+}
+
+void tcp_usb_shm_ring_consume(TCPUSBShmRing *r, uint32_t len)
+{
+    qatomic_store_release(&r->ctl->tail, r->ctl->tail + len);
+}
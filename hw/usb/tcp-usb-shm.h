@@ -0,0 +1,63 @@
+#ifndef HW_USB_TCP_USB_SHM_H
+#define HW_USB_TCP_USB_SHM_H
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qapi/error.h"
+
+/*
+ * Shared-memory payload rings for the USB bridge.
+ *
+ * The memfd holds two single-producer/single-consumer byte rings, one per
+ * direction. Payloads are consumed in the same order as the socket frames
+ * that announce them, so frames only need to carry the length.
+ */
+
+#define TCP_USB_SHM_MIN_RING    (64 * KiB)
+
+enum {
+    /* OUT/SETUP data, produced by usb-tcp-remote */
+    TCP_USB_SHM_TO_HOST   = 0,
+    /* IN data, produced by usb-tcp-host */
+    TCP_USB_SHM_TO_REMOTE = 1,
+};
+
+typedef struct tcp_usb_shm_ring {
+    /* Producer and consumer indices live on separate cache lines */
+    uint32_t head;
+    uint32_t reserved0[15];
+    uint32_t tail;
+    uint32_t reserved1[15];
+} tcp_usb_shm_ring_t;
+
+typedef struct TCPUSBShmRing {
+    tcp_usb_shm_ring_t *ctl;
+    uint8_t *data;
+    uint32_t size;
+} TCPUSBShmRing;
+
+typedef struct TCPUSBShm {
+    void *base;
+    size_t size;
+    int fd;
+    TCPUSBShmRing rings[2];
+} TCPUSBShm;
+
+static inline bool tcp_usb_shm_active(TCPUSBShm *shm)
+{
+    return shm->base != NULL;
+}
+
+bool tcp_usb_shm_create(TCPUSBShm *shm, uint32_t ring_size, Error **errp);
+bool tcp_usb_shm_map(TCPUSBShm *shm, int fd, uint32_t ring_size,
+                     Error **errp);
+void tcp_usb_shm_destroy(TCPUSBShm *shm);
+
+int tcp_usb_shm_ring_reserve(TCPUSBShmRing *r, uint32_t len,
+                             struct iovec iov[2]);
+void tcp_usb_shm_ring_commit(TCPUSBShmRing *r, uint32_t len);
+int tcp_usb_shm_ring_peek(TCPUSBShmRing *r, uint32_t len,
+                          struct iovec iov[2]);
+void tcp_usb_shm_ring_consume(TCPUSBShmRing *r, uint32_t len);
+
+#endif /* HW_USB_TCP_USB_SHM_H */
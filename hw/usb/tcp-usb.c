@@ -0,0 +1,40 @@
+#include "qemu/osdep.h"
+#include "qemu/cutils.h"
+#include "qemu/sockets.h"
+#include "qapi/error.h"
+#include "tcp-usb.h"
+
+SocketAddress *tcp_usb_parse_addr(const char *str, Error **errp)
+{
+    const char *rest;
+
+    if (!str || !*str) {
+        str = TCP_USB_DEFAULT_ADDR;
+    }
+
+    if (strstart(str, "abstract:", &rest)) {
+#ifdef CONFIG_LINUX
+        SocketAddress *addr = g_new0(SocketAddress, 1);
+
+        if (!*rest) {
+            error_setg(errp, "abstract socket name must not be empty");
+            g_free(addr);
+            return NULL;
+        }
+        addr->type = SOCKET_ADDRESS_TYPE_UNIX;
+        addr->u.q_unix.path = g_strdup(rest);
+        addr->u.q_unix.has_abstract = true;
+        addr->u.q_unix.abstract = true;
+        return addr;
+#else
+        error_setg(errp, "abstract sockets are only supported on Linux");
+        return NULL;
+#endif
+    }
+
+    if (strstart(str, "tcp:", &rest)) {
+        str = rest;
+    }
+
+    return socket_parse(str, errp);
+}
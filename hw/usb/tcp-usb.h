@@ -2,47 +2,97 @@
 #define HW_USB_TCP_USB_H
 
 #include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "qemu/units.h"
 #include "hw/usb.h"
+#include "qapi/qapi-types-sockets.h"
 
-static const char *socket_path = "/tmp/usbqemu";
+/*
+ * Default endpoint of the bridge. Other endpoints are given as
+ * "unix:<path>", "abstract:<name>" (Linux only), "tcp:<host>:<port>",
+ * "<host>:<port>", "vsock:<cid>:<port>" or "fd:<name>".
+ */
+#define TCP_USB_DEFAULT_ADDR "unix:/tmp/usbqemu"
+
+#define TCP_USB_VERSION     (2)
+
+/* Maximum number of frames coalesced into a single writev */
+#define TCP_USB_MAX_BATCH   (32)
+
+/* Upper bound on a single payload, anything larger is a protocol error */
+#define TCP_USB_MAX_PAYLOAD (16 * MiB)
 
 enum {
     TCP_USB_REQUEST  = (1 << 0),
     TCP_USB_RESPONSE = (1 << 1),
     TCP_USB_RESET    = (1 << 2),
-    TCP_USB_CANCEL   = (1 << 3)
+    TCP_USB_CANCEL   = (1 << 3),
+    /*
+     * Sent once by usb-tcp-remote after accepting a connection, with the
+     * memfd of the shared payload rings attached as SCM_RIGHTS. @length
+     * is the size of each ring.
+     */
+    TCP_USB_SHM      = (1 << 4),
+};
+
+enum {
+    TCP_USB_FLAG_SHORT_NOT_OK = (1 << 0),
+    TCP_USB_FLAG_INT_REQ      = (1 << 1),
+    /*
+     * The sender did not wait for this request to complete and may have
+     * more requests outstanding on the same endpoint. The receiver must
+     * not answer with USB_RET_NAK or USB_RET_ASYNC, only with the final
+     * status of the transfer.
+     */
+    TCP_USB_FLAG_PIPELINED    = (1 << 2),
+    /* The payload was placed in the shared ring instead of the socket */
+    TCP_USB_FLAG_SHM          = (1 << 3),
 };
 
+/*
+ * Every message is a single fixed-size frame, optionally followed by
+ * @length bytes of payload: OUT/SETUP data for requests, IN data for
+ * responses. Fields that do not apply to a message type are zero.
+ * Multi-byte fields are little-endian on the wire, since the two ends
+ * may run on hosts of different byte order.
+ */
 typedef struct QEMU_PACKED tcp_usb_header {
     uint8_t type;
-} tcp_usb_header_t;
-
-typedef struct QEMU_PACKED tcp_usb_request_header {
+    uint8_t version;
     uint8_t addr;
-    int pid;
     uint8_t ep;
-    unsigned int stream;
+    int32_t pid;
     uint64_t id;
-    uint8_t short_not_ok;
-    uint8_t int_req;
-    uint16_t length;
-} tcp_usb_request_header;
+    uint32_t stream;
+    int32_t status;
+    uint32_t length;
+    uint32_t flags;
+} tcp_usb_header_t;
 
-typedef struct QEMU_PACKED tcp_usb_response_header {
-    uint8_t addr;
-    int pid;
-    uint8_t ep;
-    uint64_t id;
-    uint32_t status;
-    uint16_t length;
-} tcp_usb_response_header;
+QEMU_BUILD_BUG_ON(sizeof(tcp_usb_header_t) != 32);
 
-typedef struct QEMU_PACKED tcp_usb_cancel_header {
-    uint8_t addr;
-    int pid;
-    uint8_t ep;
-    uint64_t id;
+/* Convert a frame header in place before sending it */
+static inline void tcp_usb_header_to_wire(tcp_usb_header_t *hdr)
+{
+    hdr->pid = cpu_to_le32(hdr->pid);
+    hdr->id = cpu_to_le64(hdr->id);
+    hdr->stream = cpu_to_le32(hdr->stream);
+    hdr->status = cpu_to_le32(hdr->status);
+    hdr->length = cpu_to_le32(hdr->length);
+    hdr->flags = cpu_to_le32(hdr->flags);
+}
+
+/* Convert a frame header in place after receiving it */
+static inline void tcp_usb_header_from_wire(tcp_usb_header_t *hdr)
+{
+    hdr->pid = le32_to_cpu(hdr->pid);
+    hdr->id = le64_to_cpu(hdr->id);
+    hdr->stream = le32_to_cpu(hdr->stream);
+    hdr->status = le32_to_cpu(hdr->status);
+    hdr->length = le32_to_cpu(hdr->length);
+    hdr->flags = le32_to_cpu(hdr->flags);
+}
 
-} tcp_usb_cancel_header;
+SocketAddress *tcp_usb_parse_addr(const char *str, Error **errp);
 
 #endif //HW_USB_TCP_USB_H
@@ -2,9 +2,11 @@
 #include "qapi/error.h"
 #include "hw/watchdog/apple_wdt.h"
 #include "hw/irq.h"
+#include "hw/qdev-properties.h"
 #include "migration/vmstate.h"
 #include "qemu/bitops.h"
 #include "qemu/log.h"
+#include "qemu/host-utils.h"
 #include "qemu/module.h"
 #include "qemu/timer.h"
 #include "hw/arm/xnu.h"
@@ -15,8 +17,6 @@
 #define TYPE_APPLE_WDT "apple.wdt"
 OBJECT_DECLARE_SIMPLE_TYPE(AppleWDTState, APPLE_WDT)
 
-#define min(_a,_b) ((_a) < (_b) ? (_a) : (_b))
-
 #define rCHIP_WDOG_TMR		    (0x0)
 #define rCHIP_WDOG_RST_CNT		(0x4)
 #define rCHIP_WDOG_INTR_CNT	    (0x8)
@@ -39,6 +39,8 @@ struct AppleWDTState {
     QEMUTimer *timer;
     uint64_t cnt_period_ns;
     uint64_t cntfrq_hz;
+    /* Deadlines are rounded up to this, so they can share wakeups */
+    uint64_t deadline_slack_ns;
 #pragma pack(push, 1)
     union {
         #define REG_SIZE 0x20
@@ -78,9 +80,14 @@ static void wdt_set_irq(AppleWDTState *s, int level)
     }
 }
 
+static inline uint64_t wdt_ns_to_ticks(AppleWDTState *s, int64_t ns)
+{
+    return muldiv64(ns, s->cntfrq_hz, NANOSECONDS_PER_SECOND);
+}
+
 static inline uint32_t wdt_get_clock(AppleWDTState *s)
 {
-    return qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) / s->cnt_period_ns;
+    return wdt_ns_to_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
 }
 
 static inline uint32_t wdt_get_chip_timer(AppleWDTState *s)
@@ -93,12 +100,19 @@ static inline uint32_t wdt_get_sys_timer(AppleWDTState *s)
     return wdt_get_clock(s) - s->reg.sys_timer;
 }
 
+/*
+ * Act on the compare registers that have been reached, then arm the
+ * timer for the exact virtual time of the earliest one still ahead. The
+ * timer is left off while no reset or interrupt is pending.
+ */
 static void wdt_update(void *opaque)
 {
     AppleWDTState *s = APPLE_WDT(opaque);
-    uint64_t expiry = 0xffffffff;
-    uint32_t chip_tmr = wdt_get_chip_timer(s);
-    uint32_t sys_tmr = wdt_get_sys_timer(s);
+    uint64_t ticks = wdt_ns_to_ticks(s, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    uint32_t chip_tmr = (uint32_t)ticks - s->reg.chip_timer;
+    uint32_t sys_tmr = (uint32_t)ticks - s->reg.sys_timer;
+    uint64_t expiry = UINT64_MAX;
+    int64_t deadline;
 
     if (s->reg.chip_control & WDOG_CTL_EN_RESET) {
         if (chip_tmr >= s->reg.chip_reset_counter) {
@@ -108,7 +122,7 @@ static void wdt_update(void *opaque)
             return;
         } else {
             uint32_t d = s->reg.chip_reset_counter - chip_tmr;
-            expiry = min(expiry, d);
+            expiry = MIN(expiry, d);
         }
     }
 
@@ -120,7 +134,7 @@ static void wdt_update(void *opaque)
             return;
         } else {
             uint32_t d = s->reg.sys_reset_counter - sys_tmr;
-            expiry = min(expiry, d);
+            expiry = MIN(expiry, d);
         }
     }
 
@@ -132,11 +146,22 @@ static void wdt_update(void *opaque)
             }
         } else {
             uint32_t d = s->reg.chip_interrupt_counter - chip_tmr;
-            expiry = min(expiry, d);
+            expiry = MIN(expiry, d);
         }
     }
-    expiry *= s->cnt_period_ns;
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + expiry);
+
+    if (expiry == UINT64_MAX) {
+        timer_del(s->timer);
+        return;
+    }
+
+    /* First nanosecond at which the counter has reached the compare */
+    deadline = muldiv64(ticks + expiry, NANOSECONDS_PER_SECOND,
+                        s->cntfrq_hz) + 1;
+    if (s->deadline_slack_ns) {
+        deadline = QEMU_ALIGN_UP(deadline, s->deadline_slack_ns);
+    }
+    timer_mod_ns(s->timer, deadline);
 }
 
 static void wdt_reg_write(void *opaque, hwaddr addr,
@@ -181,7 +206,7 @@ static void wdt_reg_write(void *opaque, hwaddr addr,
     }
 
     trace_apple_wdt_write(addr, data, old, val);
-    timer_mod_ns(s->timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL));
+    wdt_update(s);
 }
 
 static uint64_t wdt_reg_read(void *opaque,
@@ -221,6 +246,9 @@ static void apple_wdt_reset(DeviceState *dev)
 {
     AppleWDTState *s = APPLE_WDT(dev);
     memset(s->reg.raw, 0, REG_SIZE);
+    if (s->timer) {
+        timer_del(s->timer);
+    }
 }
 
 static const MemoryRegionOps wdt_reg_ops = {
@@ -312,6 +340,11 @@ static const VMStateDescription vmstate_apple_wdt = {
     }
 };
 
+static Property apple_wdt_properties[] = {
+    DEFINE_PROP_UINT64("deadline-slack-ns", AppleWDTState, deadline_slack_ns, 0),
+    DEFINE_PROP_END_OF_LIST(),
+};
+
 static void apple_wdt_class_init(ObjectClass *klass, void *data)
 {
     DeviceClass *dc = DEVICE_CLASS(klass);
@@ -322,6 +355,7 @@ static void apple_wdt_class_init(ObjectClass *klass, void *data)
     dc->desc = "Apple Watch Dog Timer";
     dc->vmsd = &vmstate_apple_wdt;
     set_bit(DEVICE_CATEGORY_MISC, dc->categories);
+    device_class_set_props(dc, apple_wdt_properties);
 }
 
 static const TypeInfo apple_wdt_info = {
@@ -40,6 +40,7 @@ typedef struct AppleA13State {
     MemoryRegion coresight_reg;
     MemoryRegion memory;
     MemoryRegion sysmem;
+    bool shared_sysmem;
     uint32_t cpu_id;
     uint32_t phys_id;
     uint32_t cluster_id;
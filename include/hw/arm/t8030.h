@@ -73,6 +73,8 @@ typedef struct
     video_boot_args video;
     char *trustcache_filename;
     char *ticket_filename;
+    char *usb_conn_addr;
+    char *smc_keys_filename;
     BootMode boot_mode;
     uint32_t rtbuddyv2_protocol_version;
     uint32_t build_version;
@@ -84,5 +86,9 @@ typedef struct
     MemoryRegion amcc;
     uint8_t amcc_reg[0x100000];
     bool kaslr_off;
+    bool usb_bulk_unthrottled;
+    bool shared_sysmem;
+    bool display_pipe;
+    uint8_t battery_level;
 } T8030MachineState;
 #endif
@@ -0,0 +1,73 @@
+#ifndef HW_DISPLAY_APPLE_DISPLAYPIPE_H
+#define HW_DISPLAY_APPLE_DISPLAYPIPE_H
+
+#include "qemu/osdep.h"
+#include "hw/sysbus.h"
+#include "qom/object.h"
+#include "qemu/timer.h"
+#include "ui/console.h"
+#include "hw/arm/xnu_dtb.h"
+
+#define TYPE_APPLE_DISPLAYPIPE "apple.displaypipe"
+OBJECT_DECLARE_SIMPLE_TYPE(AppleDisplayPipeState, APPLE_DISPLAYPIPE)
+
+#define DISP_NUM_BUFFERS            (4)
+#define DISP_VSYNC_HZ               (60)
+
+/*
+ * Minimal scanout pipe: up to DISP_NUM_BUFFERS surfaces, addressed by IOVA
+ * through the display DART. A buffer is only read when it is flipped to.
+ *
+ * This register layout is defined by QEMU, it is not the one of the real
+ * display controller. Only a guest driver written for it can use it, so
+ * the T8030 machine only maps it at disp0 when "display-pipe" is set.
+ */
+#define rDISP_CTRL                  (0x00)
+#define  DISP_CTRL_ENABLE           (1 << 0)
+#define  DISP_CTRL_VSYNC_IRQ_EN     (1 << 1)
+#define  DISP_CTRL_FLIP_IRQ_EN      (1 << 2)
+#define rDISP_STATUS                (0x04)  /* write 1 to clear */
+#define  DISP_STATUS_VSYNC          (1 << 0)
+#define  DISP_STATUS_FLIP_DONE      (1 << 1)
+#define  DISP_STATUS_DMA_ERROR      (1 << 2)
+#define rDISP_SIZE                  (0x08)  /* width | height << 16 */
+#define rDISP_STRIDE                (0x0c)
+#define rDISP_FORMAT                (0x10)
+#define  DISP_FORMAT_XRGB8888       (0)
+#define rDISP_CUR_BUF               (0x14)
+#define rDISP_FLIP                  (0x18)  /* buffer to show at next vsync */
+#define  DISP_FLIP_PENDING          (1 << 31)
+#define rDISP_VSYNC_COUNT           (0x1c)
+#define rDISP_BUF_ADDR_LO(i)        (0x40 + (i) * 8)
+#define rDISP_BUF_ADDR_HI(i)        (0x44 + (i) * 8)
+#define DISP_REG_SIZE               (rDISP_BUF_ADDR_HI(DISP_NUM_BUFFERS - 1) \
+                                     + 4)
+
+struct AppleDisplayPipeState {
+    SysBusDevice parent_obj;
+
+    MemoryRegion iomem;
+    MemoryRegion *dma_mr;
+    AddressSpace dma_as;
+    qemu_irq irq;
+    QEMUTimer *vsync_timer;
+    QemuConsole *console;
+
+    uint32_t ctrl;
+    uint32_t status;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t format;
+    uint32_t cur_buf;
+    uint32_t flip;
+    uint32_t vsync_count;
+    uint64_t buf_addr[DISP_NUM_BUFFERS];
+
+    /* The surface holds a fresh copy of cur_buf that the UI has not seen */
+    bool dirty;
+};
+
+SysBusDevice *apple_displaypipe_create(DTBNode *node);
+
+#endif /* HW_DISPLAY_APPLE_DISPLAYPIPE_H */
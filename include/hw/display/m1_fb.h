@@ -26,6 +26,10 @@ struct M1FBState {
 
     /* Configuration data for the FB */
     uint32_t width, height;
+
+    /* The console surface points straight into vram */
+    bool mapped;
+    bool full_update;
 };
 
 #endif /* HW_FB_M1_FB_H */
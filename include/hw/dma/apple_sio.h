@@ -5,6 +5,7 @@
 #include "hw/sysbus.h"
 #include "qom/object.h"
 #include "qemu/iov.h"
+#include "qemu/queue.h"
 #include "sysemu/dma.h"
 #include "hw/misc/apple_mbox.h"
 #include "hw/arm/xnu_dtb.h"
@@ -13,6 +14,9 @@
 OBJECT_DECLARE_SIMPLE_TYPE(AppleSIOState, APPLE_SIO)
 
 #define SIO_NUM_EPS         (0xdb)
+#define SIO_MAX_QUEUED_DMA  (8)
+/* Segments that fit in a 4 KiB handle descriptor after its 0x48 byte head */
+#define SIO_MAX_SEGMENTS    ((0x1000 - 0x48) / 12)
 
 typedef struct QEMU_PACKED sio_dma_config {
     uint32_t xfer;
@@ -30,17 +34,30 @@ typedef struct QEMU_PACKED sio_dma_segment {
 
 typedef void AppleSIODMAHandler(void *opaque, uint32_t ep, uint32_t length);
 
-typedef struct AppleSIODMAEndpoint {
-    struct sio_dma_config config;
-    struct sio_dma_segment *segments;
-    QEMUSGList sgl;
-    QEMUIOVector iov;
+/*
+ * Segment table of a DMA handle, cached across transfers. It is checked
+ * against the descriptor on every START_DMA and dropped when the shim is
+ * reconfigured or the segment area moves.
+ */
+typedef struct AppleSIOSegmentTable {
     uint32_t count;
+    sio_dma_segment segments[];
+} AppleSIOSegmentTable;
+
+typedef struct AppleSIODMARequest {
+    QEMUIOVector iov;
     uint32_t actual_length;
+    uint32_t tag;
+    QTAILQ_ENTRY(AppleSIODMARequest) next;
+} AppleSIODMARequest;
+
+typedef struct AppleSIODMAEndpoint {
+    struct sio_dma_config config;
+    /* Head is the running transfer, the rest are mapped and ready to go */
+    QTAILQ_HEAD(, AppleSIODMARequest) requests;
+    uint32_t queued;
     AppleSIODMAHandler *handler;
     uint32_t id;
-    uint32_t tag;
-    bool mapped;
     DMADirection dir;
 } AppleSIODMAEndpoint;
 
@@ -52,6 +69,7 @@ typedef struct AppleSIOState {
     AddressSpace dma_as;
 
     AppleSIODMAEndpoint eps[SIO_NUM_EPS];
+    GHashTable *segment_tables;
     uint32_t params[0x100];
 } AppleSIOState;
 
@@ -13,6 +13,14 @@ typedef struct {
     bool interrupted;
 } AppleGPIOPinState;
 
+/* Pins of one 32-pin word routed to one interrupt group, by trigger */
+typedef struct {
+    uint32_t lvl_hi;
+    uint32_t lvl_lo;
+    uint32_t rise;
+    uint32_t fall;
+} AppleGPIOIntMasks;
+
 struct AppleGPIOState {
     SysBusDevice parent_obj;
     MemoryRegion *iomem;
@@ -24,9 +32,21 @@ struct AppleGPIOState {
     uint32_t **int_cfg;
     uint32_t *in;
     uint32_t *old_in;
+    uint32_t nwords;
+    /* [irqgrp * nwords + word] */
+    AppleGPIOIntMasks *int_masks;
+    /* Number of pending bits in each interrupt group */
+    uint32_t *int_pending;
     uint32_t npl;
     uint32_t phandle;
 };
 
 DeviceState *apple_gpio_create(DTBNode* node);
+
+/*
+ * Drive the input pins selected by @mask in 32-pin word @word to the
+ * matching bits of @level, evaluating their interrupts in one go.
+ */
+void apple_gpio_set_word(DeviceState *dev, unsigned int word, uint32_t mask,
+                         uint32_t level);
 #endif
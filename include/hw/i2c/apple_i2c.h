@@ -21,6 +21,18 @@ typedef struct AppleHWI2CClass {
     /*< public >*/
 } AppleHWI2CClass;
 
+/* Tx FIFO entries held back until the transaction's Stop */
+#define APPLE_I2C_CMD_QUEUE  (256)
+
+typedef struct AppleI2CTraceEntry {
+    int64_t start_ns;
+    int64_t end_ns;
+    uint32_t tx_len;
+    uint32_t rx_len;
+    uint8_t addr;
+    bool nak;
+} AppleI2CTraceEntry;
+
 typedef struct AppleI2CState {
     /*< private >*/
     SysBusDevice parent_obj;
@@ -36,6 +48,23 @@ typedef struct AppleI2CState {
     bool nak;
     bool xip;
     bool is_recv;
+    uint8_t addr;
+
+    uint32_t cmds[APPLE_I2C_CMD_QUEUE];
+    uint32_t ncmds;
+    /* When the first of the queued entries was written */
+    int64_t cmds_ns;
+
+    /* Transaction trace, read with qom-get <path> trace */
+    AppleI2CTraceEntry *trace;
+    uint32_t trace_depth;
+    uint32_t trace_head;
+    uint64_t trace_count;
+    int64_t xfer_start_ns;
+    uint32_t xfer_tx;
+    uint32_t xfer_rx;
+    uint64_t total_bytes;
+    uint64_t busy_ns;
 } AppleI2CState;
 
 SysBusDevice *apple_i2c_create(const char *name);
@@ -26,6 +26,8 @@ struct AppleAICState {
     SysBusDevice parent_obj;
     QEMUTimer *timer;
     QemuMutex mutex;
+    /* MMIO region numCPU, dispatching on the accessing CPU */
+    MemoryRegion iomem_banked;
     uint32_t phandle;
     uint32_t base_size;
     uint32_t numEIR;
@@ -6,6 +6,26 @@
 #include "qom/object.h"
 #include "hw/arm/xnu_dtb.h"
 
+#define SMC_MAKE_IDENTIFIER(A, B, C, D)  \
+((uint32_t)(((uint32_t)(A) << 24U) | ((uint32_t)(B) << 16U) | \
+                                     ((uint32_t)(C) << 8U) | (uint32_t)(D)))
+#define SMC_MAKE_KEY_TYPE(A, B, C, D) SMC_MAKE_IDENTIFIER ((A), (B), (C), (D))
+
+enum smc_attr {
+    SMC_ATTR_LITTLE_ENDIAN = (1 << 2),
+};
+
+/*
+ * Computes the current value of a dynamic key into @data, which is @size
+ * bytes of the guest-visible response. Returns false if the key cannot
+ * be read right now.
+ */
+typedef bool (*AppleSMCKeyGetter)(void *opaque, uint32_t key,
+                                  void *data, uint8_t size);
+
 SysBusDevice *apple_smc_create(DTBNode *node, uint32_t protocol_version);
+void apple_smc_add_dynamic_key(SysBusDevice *sbd, uint32_t key, uint8_t size,
+                               uint32_t type, uint8_t attr,
+                               AppleSMCKeyGetter get, void *opaque);
 
 #endif /* APPLE_SMC_H */
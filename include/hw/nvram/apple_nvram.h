@@ -32,6 +32,9 @@ typedef struct env_var {
     char *str;
     size_t u;
     uint32_t flags;
+    /* Position and length of "name=str\0" in the common partition */
+    size_t offset;
+    size_t size;
 } env_var;
 
 typedef struct NvramPartition {
@@ -56,7 +59,18 @@ typedef struct AppleNvramState {
 
    NvramBank *bank;
    QTAILQ_HEAD(, env_var) env;
+   GHashTable *env_index;
+   /* End of the serialized env, and where it first differs from env */
+   size_t env_end;
+   size_t env_dirty_pos;
    size_t len;
+
+   /* Write-back: the bank is dirty until a flush has written it out */
+   QEMUTimer *flush_timer;
+   VMChangeStateEntry *vmstate_entry;
+   uint32_t flush_interval;
+   bool dirty;
+   bool flushing;
 } AppleNvramState;
 
 struct AppleNvramClass {
@@ -73,6 +87,7 @@ NvramPartition *nvram_find_part(NvramBank *bank, const char *name);
 NvramBank *nvram_parse(void *buf, size_t len);
 void apple_nvram_load(AppleNvramState *s);
 void apple_nvram_save(AppleNvramState *s);
+void apple_nvram_flush(AppleNvramState *s);
 ssize_t apple_nvram_serialize(AppleNvramState *s, void *buffer, size_t size);
 
 const char *env_get(AppleNvramState *s, const char *name);
@@ -12,6 +12,7 @@
 #define TYPE_APPLE_SPMI     "apple.spmi"
 OBJECT_DECLARE_TYPE(AppleSPMIState, AppleSPMIClass, APPLE_SPMI)
 #define APPLE_SPMI_MMIO_SIZE    (0x4000)
+#define APPLE_SPMI_MAX_SLAVES   (16)
 
 typedef struct AppleSPMIClass {
     /*< private >*/
@@ -21,6 +22,14 @@ typedef struct AppleSPMIClass {
     /*< public >*/
 } AppleSPMIClass;
 
+typedef struct AppleSPMISlaveStats {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t read_bytes;
+    uint64_t write_bytes;
+    uint64_t naks;
+} AppleSPMISlaveStats;
+
 struct AppleSPMIState {
     SysBusDevice parent_obj;
     MemoryRegion container;
@@ -28,6 +37,7 @@ struct AppleSPMIState {
     SPMIBus *bus;
     qemu_irq irq;
     qemu_irq resp_irq;
+    Fifo32 req_fifo;
     Fifo32 resp_fifo;
     uint32_t control_reg[0x100 / sizeof(uint32_t)];
     uint32_t queue_reg[0x100 / sizeof(uint32_t)];
@@ -39,6 +49,19 @@ struct AppleSPMIState {
     uint32_t data_length;
     uint32_t data_filled;
     uint32_t command;
+    /* Push-side view of the request queue, to spot the doorbell */
+    uint32_t req_command;
+    uint32_t req_words;
+    /* Runs the queue after a doorbell, see apple_spmi_push_req() */
+    QEMUBH *run_bh;
+    bool resp_irq_level;
+
+    uint64_t batches;
+    uint64_t commands;
+    /* Times the response interrupt was raised */
+    uint64_t resp_irqs;
+    uint64_t resp_overflows;
+    AppleSPMISlaveStats stats[APPLE_SPMI_MAX_SLAVES];
 };
 
 SysBusDevice *apple_spmi_create(DTBNode *node);
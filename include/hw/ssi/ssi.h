@@ -54,6 +54,14 @@ struct SSIPeripheralClass {
      * always be called for the device for every txrx access to the parent bus
      */
     uint32_t (*transfer_raw)(SSIPeripheral *dev, uint32_t val);
+
+    /* Optional: move @len bytes in one call instead of one transfer per
+     * byte. @tx may be NULL to clock out 0xff, @rx may be NULL to discard
+     * the reply. Only used with the default CS behaviour, and only while
+     * the device is the sole peripheral on its bus.
+     */
+    void (*transfer_block)(SSIPeripheral *dev, const uint8_t *tx,
+                           uint8_t *rx, size_t len);
 };
 
 struct SSIPeripheral {
@@ -106,4 +114,10 @@ SSIBus *ssi_create_bus(DeviceState *parent, const char *name);
 
 uint32_t ssi_transfer(SSIBus *bus, uint32_t val);
 
+/* Transfer @len bytes, byte by byte unless the peripheral provides
+ * transfer_block. @tx may be NULL to clock out 0xff, @rx may be NULL.
+ */
+void ssi_transfer_block(SSIBus *bus, const uint8_t *tx, uint8_t *rx,
+                        size_t len);
+
 #endif
@@ -29,6 +29,7 @@ struct AppleOTGState {
     };
     char *fuzz_input;
     bool dart;
+    bool bulk_unthrottled;
 };
 
 DeviceState *apple_otg_create(DTBNode *node);
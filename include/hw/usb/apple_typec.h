@@ -26,6 +26,8 @@ typedef struct AppleTypeCState {
     DWC2State    dwc2;
     DWC3State    dwc3;
     SysBusDevice *host;
+    char         *conn_addr;
+    bool         bulk_unthrottled;
 } AppleTypeCState;
 
 DeviceState *apple_typec_create(DTBNode *node);
@@ -31,6 +31,7 @@
 #define DWC2_NB_CHAN        16      /* Number of host channels */
 #define DWC2_MAX_XFER_SIZE  0x1000  /* Max transfer size expected in HCTSIZ */
 #define DWC2_NB_EP          16      /* Number of device endpoints */
+#define DWC2_BULK_BUDGET    64      /* Bulk packets per BH when unthrottled */
 
 typedef struct DWC2Packet DWC2Packet;
 typedef struct DWC2DeviceState DWC2DeviceState;
@@ -221,6 +222,10 @@ uint32_t diepreg[DWC2_DIEPREG_SIZE / sizeof(uint32_t)];
     uint16_t fi;
     uint16_t next_chan;
     bool working;
+    /* Service bulk endpoints as fast as data flows, not once per frame */
+    bool bulk_unthrottled;
+    /* Unthrottled mode: when non-bulk channels may next be serviced */
+    int64_t periodic_due;
     USBPort uport;
     DWC2Packet packet[DWC2_NB_CHAN];                   /* one packet per chan */
     union {
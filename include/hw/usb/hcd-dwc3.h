@@ -33,6 +33,7 @@
 #define DWC3_MMIO_SIZE   0x10000
 #define DWC3_NUM_INTRS   (16)
 #define DWC3_NUM_EPS     (16)
+#define DWC3_BULK_BUDGET (64)    /* Bulk packets per doorbell when unthrottled */
 
 typedef struct DWC3EventRing {
     uint32_t size;
@@ -106,6 +107,8 @@ typedef struct DWC3State {
     uint32_t numintrs;
     DWC3Endpoint eps[DWC3_NUM_EPS];
     bool host_intr_state[DWC3_NUM_INTRS];
+    /* Drain queued bulk packets per doorbell instead of one at a time */
+    bool bulk_unthrottled;
 
     union {
         #define DWC3_GLBREG_SIZE    0x504
@@ -5,9 +5,14 @@
 #include "hw/sysbus.h"
 #include "qom/object.h"
 #include "hw/usb.h"
-#include "io/channel.h"
+#include "io/channel-socket.h"
 #include "qemu/coroutine.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
 #include "qapi/error.h"
+#include "qapi/qapi-types-sockets.h"
+
+typedef struct TCPUSBShm TCPUSBShm;
 
 #define TYPE_USB_TCP_HOST "usb-tcp-host"
 OBJECT_DECLARE_SIMPLE_TYPE(USBTCPHostState, USB_TCP_HOST)
@@ -17,7 +22,10 @@ typedef struct USBTCPPacket {
     void *buffer;
     USBDevice *dev;
     USBTCPHostState *s;
+    QTAILQ_ENTRY(USBTCPPacket) next;
     uint8_t addr;
+    bool pipelined;
+    bool queued;
 } USBTCPPacket;
 
 struct USBTCPHostState {
@@ -27,6 +35,22 @@ struct USBTCPHostState {
     USBPort uports[3];
     QIOChannel *ioc;
     CoMutex write_mutex;
+    QTAILQ_HEAD(, USBTCPPacket) responses;
+    QTAILQ_HEAD(, USBTCPPacket) naks;
+    QEMUBH *flush_bh;
+    QEMUTimer *nak_timer;
+    /* Payload rings shared by usb-tcp-remote, if it offered them */
+    TCPUSBShm *shm;
+    /* Remote endpoint, see TCP_USB_DEFAULT_ADDR for the syntax */
+    char *conn_addr;
+    SocketAddress *saddr;
+    /* Seconds between connection attempts, 0 disables reconnecting */
+    uint32_t reconnect;
+    QEMUTimer *reconnect_timer;
+    /* Pending qio_channel_socket_connect_async(), if any */
+    QIOChannelSocket *connecting;
+    bool connect_failed;
+    bool flushing;
     Error *migration_blocker;
     bool closed;
     bool stopped;
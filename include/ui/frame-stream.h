@@ -0,0 +1,59 @@
+/*
+ * Shared-memory frame stream of a graphic console
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#ifndef UI_FRAME_STREAM_H
+#define UI_FRAME_STREAM_H
+
+/*
+ * Layout of a frame stream, as seen by clients. The stream starts with a
+ * FrameStreamHeader padded to FRAME_STREAM_HEADER_SIZE bytes. All fields
+ * are in host byte order.
+ *
+ * Pixels are XRGB8888 (BGRA in memory), @stride bytes per row. When
+ * @data_fd is -1 they follow in the stream itself at @data_offset.
+ * Otherwise they are the guest's own framebuffer, found at @data_offset
+ * in /proc/@pid/fd/@data_fd.
+ *
+ * @sequence works as a seqlock. It is odd while a frame is being
+ * written and is bumped to the next even value once the frame and
+ * @rects are complete. Readers should copy what they need and retry if
+ * @sequence changed or was odd.
+ */
+
+#define FRAME_STREAM_MAGIC          0x4d525446  /* "FTRM" */
+#define FRAME_STREAM_VERSION        1
+#define FRAME_STREAM_HEADER_SIZE    4096
+#define FRAME_STREAM_MAX_RECTS      32
+#define FRAME_STREAM_FOURCC_XR24    0x34325258  /* DRM_FORMAT_XRGB8888 */
+
+/* The stream was replaced (e.g. resolution change); reopen it */
+#define FRAME_STREAM_F_STALE        (1U << 0)
+
+typedef struct FrameStreamRect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t w;
+    uint32_t h;
+} FrameStreamRect;
+
+typedef struct FrameStreamHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t sequence;
+    uint32_t width;
+    uint32_t height;
+    uint32_t stride;
+    uint32_t fourcc;
+    int32_t pid;
+    int32_t data_fd;
+    uint64_t data_offset;
+    uint32_t flags;
+    /* Rectangles changed by the last frame, 0 means the whole frame */
+    uint32_t nrects;
+    FrameStreamRect rects[FRAME_STREAM_MAX_RECTS];
+} FrameStreamHeader;
+
+#endif /* UI_FRAME_STREAM_H */
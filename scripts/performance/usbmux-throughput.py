@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+
+#  Measure USB bulk throughput to an emulated iOS device over usbmux.
+#
+#  The device must be reachable through usbmuxd (e.g. the guest's USB is
+#  bridged to the host with usb-tcp-remote) and run an SSH server. The
+#  script forwards a local port with iproxy and streams a file to the
+#  guest's /dev/null over SSH, then reads the same amount back, printing
+#  the rate of each direction.
+#
+#  Syntax:
+#  usbmux-throughput.py [-h] [-f FILE] [-s SIZE_MIB] [-p DEVICE_PORT]
+#                       [-l LOCAL_PORT] [-u UDID] [--user USER]
+#
+#  Example of usage:
+#  usbmux-throughput.py -s 512
+#
+#  Run it once with the machine's usb-bulk-unthrottled property off and
+#  once with it on to compare the paced and unthrottled bulk paths.
+#
+#  SPDX-License-Identifier: GPL-2.0-or-later
+
+import argparse
+import os
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+
+def wait_for_port(port, timeout):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        try:
+            with socket.create_connection(("127.0.0.1", port), timeout=1):
+                return True
+        except OSError:
+            time.sleep(0.2)
+    return False
+
+
+def ssh_command(args, remote):
+    return ["ssh", "-p", str(args.local_port),
+            "-o", "StrictHostKeyChecking=no",
+            "-o", "UserKnownHostsFile=/dev/null",
+            "-o", "LogLevel=ERROR",
+            "-o", "Compression=no",
+            "{}@127.0.0.1".format(args.user), remote]
+
+
+def report(direction, size, elapsed):
+    mib = size / (1024 * 1024)
+    print("{:>4}: {:8.1f} MiB in {:6.2f} s = {:7.2f} MiB/s".format(
+        direction, mib, elapsed, mib / elapsed))
+
+
+def push(args, path, size):
+    with open(path, "rb") as f:
+        start = time.monotonic()
+        subprocess.run(ssh_command(args, "cat > /dev/null"),
+                       stdin=f, check=True)
+        report("push", size, time.monotonic() - start)
+
+
+def pull(args, size):
+    remote = "head -c {} /dev/zero".format(size)
+    start = time.monotonic()
+    with subprocess.Popen(ssh_command(args, remote),
+                          stdout=subprocess.PIPE) as proc:
+        received = 0
+        while True:
+            chunk = proc.stdout.read(1024 * 1024)
+            if not chunk:
+                break
+            received += len(chunk)
+    if proc.returncode != 0:
+        sys.exit("pull failed with exit code {}".format(proc.returncode))
+    report("pull", received, time.monotonic() - start)
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Measure usbmux bulk throughput to an emulated device")
+    parser.add_argument("-f", "--file",
+                        help="file to push (default: random data)")
+    parser.add_argument("-s", "--size", type=int, default=256,
+                        help="size in MiB of the generated payload")
+    parser.add_argument("-p", "--device-port", type=int, default=22,
+                        help="SSH port on the device")
+    parser.add_argument("-l", "--local-port", type=int, default=2222,
+                        help="local port forwarded by iproxy")
+    parser.add_argument("-u", "--udid", help="device UDID for iproxy")
+    parser.add_argument("--user", default="root", help="SSH user")
+    args = parser.parse_args()
+
+    for tool in ("iproxy", "ssh"):
+        if shutil.which(tool) is None:
+            sys.exit("{} not found in PATH".format(tool))
+
+    iproxy = ["iproxy", str(args.local_port), str(args.device_port)]
+    if args.udid:
+        iproxy += ["-u", args.udid]
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        path = args.file
+        if path is None:
+            path = os.path.join(tmpdir, "payload")
+            with open(path, "wb") as f:
+                for _ in range(args.size):
+                    f.write(os.urandom(1024 * 1024))
+        size = os.path.getsize(path)
+
+        proxy = subprocess.Popen(iproxy, stdout=subprocess.DEVNULL,
+                                 stderr=subprocess.DEVNULL)
+        try:
+            if not wait_for_port(args.local_port, 30):
+                sys.exit("iproxy did not come up on port {}".format(
+                    args.local_port))
+            push(args, path, size)
+            pull(args, size)
+        finally:
+            proxy.terminate()
+            proxy.wait()
+
+
+if __name__ == "__main__":
+    main()
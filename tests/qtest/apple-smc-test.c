@@ -0,0 +1,196 @@
+/*
+ * QTest testcase for the Apple SMC key endpoint of the t8030 machine
+ *
+ * The machine needs an iOS kernel, device tree and trust cache to start,
+ * so the test only runs when QTEST_T8030_ARGS carries the command line
+ * options pointing at them, e.g.
+ *   "-M t8030,trustcache-filename=tc -kernel kc -dtb dtb"
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/bswap.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+
+/* AppleA7IOP v4 mailbox registers */
+#define A2I_SEND0           0x8800
+#define A2I_SEND1           0x8808
+#define I2A_CTRL            0x810c
+#define I2A_RECV0           0x8830
+#define I2A_RECV1           0x8838
+#define CTRL_EMPTY          (1 << 17)
+
+/* Application endpoints are offset by 31 on the wire */
+#define SMC_KEY_EP          (1 + 31)
+
+#define SMC_READ_KEY        0x10
+#define SMC_READ_KEY_BATCH  0xe0
+
+#define kSMCSuccess         0x00
+#define kSMCKeyNotFound     0x84
+#define kSMCKeyNotReadable  0x85
+
+#define KEY(a, b, c, d) \
+    (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | \
+     ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+typedef struct SMCTest {
+    QTestState *qts;
+    uint64_t mbox;
+    uint64_t sram;
+} SMCTest;
+
+static bool smc_test_start(SMCTest *t)
+{
+    const char *args = getenv("QTEST_T8030_ARGS");
+    g_autofree char *qtree = NULL;
+    char *p;
+    int i;
+
+    if (!args) {
+        g_test_skip("QTEST_T8030_ARGS is not set");
+        return false;
+    }
+    t->qts = qtest_init(args);
+
+    /* mmio 0 is the mailbox, mmio 2 the SRAM */
+    qtree = qtest_hmp(t->qts, "info qtree");
+    p = strstr(qtree, "dev: apple.smc,");
+    g_assert_nonnull(p);
+    for (i = 0; i < 3; i++) {
+        uint64_t addr;
+
+        p = strstr(p, "mmio ");
+        g_assert_nonnull(p);
+        p += strlen("mmio ");
+        addr = g_ascii_strtoull(p, NULL, 16);
+        if (i == 0) {
+            t->mbox = addr;
+        } else if (i == 2) {
+            t->sram = addr;
+        }
+    }
+    return true;
+}
+
+static uint64_t smc_command(SMCTest *t, uint8_t cmd, uint8_t tag,
+                            uint8_t length, uint32_t key)
+{
+    uint64_t msg = cmd | (tag << 8) | (length << 16) | ((uint64_t)key << 32);
+    int i;
+
+    qtest_writeq(t->qts, t->mbox + A2I_SEND0, msg);
+    qtest_writeq(t->qts, t->mbox + A2I_SEND1, SMC_KEY_EP);
+
+    for (i = 0; i < 1000; i++) {
+        if (qtest_readl(t->qts, t->mbox + I2A_CTRL) & CTRL_EMPTY) {
+            qtest_clock_step(t->qts, 1000);
+            continue;
+        }
+        msg = qtest_readq(t->qts, t->mbox + I2A_RECV0);
+        if ((uint32_t)qtest_readq(t->qts, t->mbox + I2A_RECV1)
+            == SMC_KEY_EP) {
+            g_assert_cmpuint((msg >> 8) & 0xff, ==, tag);
+            return msg;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void test_read_key_batch(void)
+{
+    static const uint8_t clkh[8] = {
+        0x00, 0x00, 0x70, 0x80, 0x00, 0x01, 0x19, 0x40
+    };
+    static const struct {
+        uint32_t key;
+        uint8_t status;
+        uint8_t size;
+    } expect[] = {
+        { KEY('#', 'K', 'E', 'Y'), kSMCSuccess, 4 },
+        { KEY('R', 'G', 'E', 'N'), kSMCSuccess, 1 },
+        { KEY('C', 'L', 'K', 'H'), kSMCSuccess, 8 },
+        { KEY('B', 'R', 'S', 'C'), kSMCSuccess, 2 },
+        { KEY('Q', 'E', 'M', 'U'), kSMCKeyNotFound, 0 },
+        { KEY('M', 'B', 'S', 'E'), kSMCKeyNotReadable, 0 },
+    };
+    uint8_t buf[256];
+    uint32_t off = 0;
+    uint64_t r;
+    SMCTest t;
+    int i;
+
+    if (!smc_test_start(&t)) {
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(expect); i++) {
+        stl_le_p(buf + i * 4, expect[i].key);
+    }
+    qtest_memwrite(t.qts, t.sram, buf, ARRAY_SIZE(expect) * 4);
+
+    r = smc_command(&t, SMC_READ_KEY_BATCH, 1, ARRAY_SIZE(expect), 0);
+    g_assert_cmpuint(r & 0xff, ==, kSMCSuccess);
+    g_assert_cmpuint((r >> 16) & 0xff, ==, ARRAY_SIZE(expect));
+
+    qtest_memread(t.qts, t.sram, buf, sizeof(buf));
+    for (i = 0; i < ARRAY_SIZE(expect); i++) {
+        g_assert_cmphex(ldl_le_p(buf + off), ==, expect[i].key);
+        g_assert_cmphex(buf[off + 4], ==, expect[i].status);
+        g_assert_cmpuint(buf[off + 5], ==, expect[i].size);
+        switch (expect[i].key) {
+        case KEY('#', 'K', 'E', 'Y'):
+            g_assert_cmpuint(ldl_le_p(buf + off + 6), >=, 5);
+            break;
+        case KEY('R', 'G', 'E', 'N'):
+            g_assert_cmpuint(buf[off + 6], ==, 3);
+            break;
+        case KEY('C', 'L', 'K', 'H'):
+            g_assert_cmpmem(buf + off + 6, 8, clkh, sizeof(clkh));
+            break;
+        case KEY('B', 'R', 'S', 'C'):
+            g_assert_cmpuint(lduw_le_p(buf + off + 6), ==, 100);
+            break;
+        }
+        off += 6 + buf[off + 5];
+    }
+    g_assert_cmpuint(r >> 32, ==, off);
+
+    qtest_quit(t.qts);
+}
+
+static void test_battery_level(void)
+{
+    QDict *resp;
+    uint64_t r;
+    SMCTest t;
+
+    if (!smc_test_start(&t)) {
+        return;
+    }
+
+    resp = qtest_qmp(t.qts, "{ 'execute': 'qom-set', 'arguments': "
+                     "{ 'path': '/machine', 'property': 'battery-level', "
+                     "'value': 42 } }");
+    g_assert(qdict_haskey(resp, "return"));
+    qobject_unref(resp);
+
+    r = smc_command(&t, SMC_READ_KEY, 2, 0, KEY('B', 'R', 'S', 'C'));
+    g_assert_cmpuint(r & 0xff, ==, kSMCSuccess);
+    g_assert_cmpuint((r >> 16) & 0xff, ==, 2);
+    g_assert_cmpuint((r >> 32) & 0xffff, ==, 42);
+
+    qtest_quit(t.qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/apple-smc/read-key-batch", test_read_key_batch);
+    qtest_add_func("/apple-smc/battery-level", test_battery_level);
+
+    return g_test_run();
+}
@@ -0,0 +1,376 @@
+/*
+ * Shared-memory frame stream of a graphic console
+ *
+ * Exports a console's frames, with a sequence number and the rectangles
+ * that changed, to a file or memfd that test harnesses can map instead of
+ * scraping a VNC session. See include/ui/frame-stream.h for the layout.
+ *
+ * SPDX-License-Identifier: GPL-2.0-or-later
+ */
+
+#include "qemu/osdep.h"
+#include "qapi/error.h"
+#include "qapi/qapi-commands-ui.h"
+#include "qemu/atomic.h"
+#include "qemu/error-report.h"
+#include "qemu/memfd.h"
+#include "exec/memory.h"
+#include "ui/console.h"
+#include "ui/frame-stream.h"
+
+typedef struct FrameStream {
+    DisplayChangeListener dcl;
+    FrameStreamFormat format;
+    char *path;
+
+    int fd;
+    void *map;
+    size_t size;
+    FrameStreamHeader *hdr;
+
+    DisplaySurface *surface;
+    /* Destination of the copies; NULL when pixels are shared zero-copy */
+    pixman_image_t *image;
+
+    /* A frame is being written, hdr->sequence is odd */
+    bool writing;
+    bool full;
+    uint32_t nrects;
+    FrameStreamRect rects[FRAME_STREAM_MAX_RECTS];
+} FrameStream;
+
+static FrameStream *frame_stream;
+
+static void frame_stream_unmap(FrameStream *fs)
+{
+    if (fs->image) {
+        pixman_image_unref(fs->image);
+        fs->image = NULL;
+    }
+    if (fs->map == NULL) {
+        return;
+    }
+    if (fs->format == FRAME_STREAM_FORMAT_MEMFD) {
+        /* Clients may still have the old memfd mapped */
+        fs->hdr->flags |= FRAME_STREAM_F_STALE;
+        qemu_memfd_free(fs->map, fs->size, fs->fd);
+        fs->fd = -1;
+    } else {
+        munmap(fs->map, fs->size);
+    }
+    fs->map = NULL;
+    fs->hdr = NULL;
+    fs->size = 0;
+}
+
+static bool frame_stream_map(FrameStream *fs, size_t size, Error **errp)
+{
+    if (fs->format == FRAME_STREAM_FORMAT_MEMFD) {
+        fs->map = qemu_memfd_alloc("frame-stream", size, 0, &fs->fd, errp);
+        if (fs->map == NULL) {
+            return false;
+        }
+    } else {
+        if (ftruncate(fs->fd, size) < 0) {
+            error_setg_errno(errp, errno, "Failed to resize '%s'", fs->path);
+            return false;
+        }
+        fs->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       fs->fd, 0);
+        if (fs->map == MAP_FAILED) {
+            fs->map = NULL;
+            error_setg_errno(errp, errno, "Failed to map '%s'", fs->path);
+            return false;
+        }
+    }
+    fs->size = size;
+    fs->hdr = fs->map;
+    return true;
+}
+
+/*
+ * Find the file descriptor backing @surface, if it is XRGB8888 guest RAM
+ * that was allocated from one (e.g. a memfd-backed framebuffer).
+ */
+static int frame_stream_surface_fd(DisplaySurface *surface, uint64_t *offset)
+{
+    MemoryRegion *mr;
+    ram_addr_t off;
+
+    if (surface_format(surface) != PIXMAN_x8r8g8b8) {
+        return -1;
+    }
+    mr = memory_region_from_host(surface_data(surface), &off);
+    if (mr == NULL || memory_region_get_fd(mr) < 0) {
+        return -1;
+    }
+    *offset = off;
+    return memory_region_get_fd(mr);
+}
+
+static void frame_stream_gfx_update(DisplayChangeListener *dcl,
+                                    int x, int y, int w, int h)
+{
+    FrameStream *fs = container_of(dcl, FrameStream, dcl);
+
+    if (fs->hdr == NULL || fs->surface == NULL) {
+        return;
+    }
+
+    if (!fs->writing) {
+        qatomic_set(&fs->hdr->sequence, fs->hdr->sequence + 1);
+        smp_wmb();
+        fs->writing = true;
+    }
+
+    if (fs->image) {
+        pixman_image_composite(PIXMAN_OP_SRC, fs->surface->image, NULL,
+                               fs->image, x, y, 0, 0, x, y, w, h);
+    }
+
+    if (fs->full) {
+        return;
+    }
+    if (fs->nrects == FRAME_STREAM_MAX_RECTS) {
+        fs->full = true;
+        return;
+    }
+    fs->rects[fs->nrects++] = (FrameStreamRect) { x, y, w, h };
+}
+
+static void frame_stream_publish(FrameStream *fs)
+{
+    FrameStreamHeader *hdr = fs->hdr;
+
+    if (!fs->writing) {
+        return;
+    }
+
+    hdr->nrects = fs->full ? 0 : fs->nrects;
+    memcpy(hdr->rects, fs->rects, hdr->nrects * sizeof(hdr->rects[0]));
+    smp_wmb();
+    qatomic_set(&hdr->sequence, hdr->sequence + 1);
+
+    fs->writing = false;
+    fs->full = false;
+    fs->nrects = 0;
+}
+
+static void frame_stream_gfx_switch(DisplayChangeListener *dcl,
+                                    DisplaySurface *surface)
+{
+    FrameStream *fs = container_of(dcl, FrameStream, dcl);
+    Error *err = NULL;
+    uint64_t sequence = fs->hdr ? fs->hdr->sequence : 0;
+    uint64_t data_offset = FRAME_STREAM_HEADER_SIZE;
+    int data_fd = -1;
+    uint32_t width, height, stride;
+    size_t size;
+
+    fs->surface = surface;
+    if (surface == NULL) {
+        return;
+    }
+
+    width = surface_width(surface);
+    height = surface_height(surface);
+    stride = width * 4;
+    if (fs->format == FRAME_STREAM_FORMAT_MEMFD) {
+        data_fd = frame_stream_surface_fd(surface, &data_offset);
+    }
+    size = FRAME_STREAM_HEADER_SIZE;
+    if (data_fd < 0) {
+        data_offset = FRAME_STREAM_HEADER_SIZE;
+        size += (size_t)stride * height;
+    }
+
+    if (size != fs->size) {
+        frame_stream_unmap(fs);
+        if (!frame_stream_map(fs, size, &err)) {
+            error_report_err(err);
+            return;
+        }
+    } else if (fs->image) {
+        pixman_image_unref(fs->image);
+        fs->image = NULL;
+    }
+
+    if (data_fd < 0) {
+        fs->image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+                                             (uint32_t *)((uint8_t *)fs->map
+                                             + FRAME_STREAM_HEADER_SIZE),
+                                             stride);
+    } else {
+        stride = surface_stride(surface);
+    }
+
+    /* Keep the sequence even and monotonic across switches */
+    memset(fs->hdr, 0, sizeof(*fs->hdr));
+    fs->hdr->magic = FRAME_STREAM_MAGIC;
+    fs->hdr->version = FRAME_STREAM_VERSION;
+    fs->hdr->sequence = sequence + (sequence & 1);
+    fs->hdr->width = width;
+    fs->hdr->height = height;
+    fs->hdr->stride = stride;
+    fs->hdr->fourcc = FRAME_STREAM_FOURCC_XR24;
+    fs->hdr->pid = getpid();
+    fs->hdr->data_fd = data_fd;
+    fs->hdr->data_offset = data_offset;
+
+    fs->writing = false;
+    fs->nrects = 0;
+    fs->full = true;
+    frame_stream_gfx_update(dcl, 0, 0, width, height);
+}
+
+static void frame_stream_refresh(DisplayChangeListener *dcl)
+{
+    FrameStream *fs = container_of(dcl, FrameStream, dcl);
+
+    graphic_hw_update(dcl->con);
+    if (fs->hdr) {
+        frame_stream_publish(fs);
+    }
+}
+
+static const DisplayChangeListenerOps frame_stream_ops = {
+    .dpy_name       = "frame-stream",
+    .dpy_refresh    = frame_stream_refresh,
+    .dpy_gfx_update = frame_stream_gfx_update,
+    .dpy_gfx_switch = frame_stream_gfx_switch,
+};
+
+static FrameStreamInfo *frame_stream_info(FrameStream *fs)
+{
+    FrameStreamInfo *info = g_new0(FrameStreamInfo, 1);
+
+    info->format = fs->format;
+    info->has_path = fs->path != NULL;
+    info->path = g_strdup(fs->path);
+    info->pid = getpid();
+    if (fs->format == FRAME_STREAM_FORMAT_MEMFD) {
+        info->has_fd = true;
+        info->fd = fs->fd;
+    }
+    if (fs->hdr) {
+        info->width = fs->hdr->width;
+        info->height = fs->hdr->height;
+        info->stride = fs->hdr->stride;
+        info->sequence = qatomic_read(&fs->hdr->sequence);
+        info->zero_copy = fs->hdr->data_fd >= 0;
+    }
+    return info;
+}
+
+static void frame_stream_free(FrameStream *fs)
+{
+    frame_stream_unmap(fs);
+    if (fs->fd >= 0) {
+        close(fs->fd);
+    }
+    g_free(fs->path);
+    g_free(fs);
+}
+
+FrameStreamInfo *qmp_frame_stream_start(bool has_path, const char *path,
+                                        bool has_format,
+                                        FrameStreamFormat format,
+                                        bool has_device, const char *device,
+                                        bool has_head, int64_t head,
+                                        bool has_interval, int64_t interval,
+                                        Error **errp)
+{
+    FrameStream *fs;
+    QemuConsole *con;
+
+    if (frame_stream) {
+        error_setg(errp, "A frame stream is already running");
+        return NULL;
+    }
+
+    if (!has_format) {
+        format = has_path ? FRAME_STREAM_FORMAT_BGRA
+                          : FRAME_STREAM_FORMAT_MEMFD;
+    }
+    if (format == FRAME_STREAM_FORMAT_BGRA && !has_path) {
+        error_setg(errp, "'path' is required for the 'bgra' format");
+        return NULL;
+    }
+    if (format == FRAME_STREAM_FORMAT_MEMFD && has_path) {
+        error_setg(errp, "'path' cannot be used with the 'memfd' format");
+        return NULL;
+    }
+    if (!has_interval) {
+        interval = GUI_REFRESH_INTERVAL_DEFAULT;
+    }
+    if (interval < 1 || interval > 1000) {
+        error_setg(errp, "'interval' must be between 1 and 1000 ms");
+        return NULL;
+    }
+
+    if (has_device) {
+        con = qemu_console_lookup_by_device_name(device, has_head ? head : 0,
+                                                 errp);
+        if (!con) {
+            return NULL;
+        }
+    } else {
+        if (has_head) {
+            error_setg(errp, "'head' must be specified together with 'device'");
+            return NULL;
+        }
+        con = qemu_console_lookup_by_index(0);
+        if (!con) {
+            error_setg(errp, "There is no console to stream");
+            return NULL;
+        }
+    }
+
+    fs = g_new0(FrameStream, 1);
+    fs->format = format;
+    fs->fd = -1;
+    if (format == FRAME_STREAM_FORMAT_BGRA) {
+        fs->path = g_strdup(path);
+        fs->fd = qemu_create(path, O_RDWR | O_TRUNC, 0600, errp);
+        if (fs->fd < 0) {
+            frame_stream_free(fs);
+            return NULL;
+        }
+    }
+
+    fs->dcl.ops = &frame_stream_ops;
+    fs->dcl.con = con;
+    register_displaychangelistener(&fs->dcl);
+    update_displaychangelistener(&fs->dcl, interval);
+    if (fs->hdr == NULL) {
+        unregister_displaychangelistener(&fs->dcl);
+        frame_stream_free(fs);
+        error_setg(errp, "Failed to set up the frame stream");
+        return NULL;
+    }
+
+    frame_stream = fs;
+    return frame_stream_info(fs);
+}
+
+void qmp_frame_stream_stop(Error **errp)
+{
+    if (!frame_stream) {
+        error_setg(errp, "No frame stream is running");
+        return;
+    }
+
+    unregister_displaychangelistener(&frame_stream->dcl);
+    frame_stream_free(frame_stream);
+    frame_stream = NULL;
+}
+
+FrameStreamInfo *qmp_query_frame_stream(Error **errp)
+{
+    if (!frame_stream) {
+        error_setg(errp, "No frame stream is running");
+        return NULL;
+    }
+
+    return frame_stream_info(frame_stream);
+}